@@ -9,6 +9,10 @@
 struct benc_entity {
 	int type;
 	struct benc_entity *next;
+	/* original encoding when parsed from memory, NULL once modified;
+	   only valid while the parsed buffer is alive */
+	const char *raw;
+	int raw_length;
 	union {
 		struct {
 			int length;
@@ -33,13 +37,28 @@ void benc_append_list (struct benc_entity *list, struct benc_entity *entity);
 struct benc_entity *benc_new_dictionary (void);
 void benc_append_dictionary (struct benc_entity *dictionary, struct benc_entity *key, struct benc_entity *value);
 struct benc_entity *benc_lookup_string (struct benc_entity *dictionary, const char *key);
+/* set/remove keep the dictionary sorted; callers must clear raw on the ancestors */
+void benc_set_dictionary (struct benc_entity *dictionary, const char *key, struct benc_entity *value);
+int benc_remove_dictionary (struct benc_entity *dictionary, const char *key);
 
 void benc_free_entity (struct benc_entity *entity);
 
 struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten, char *errbuf);
 struct benc_entity *benc_parse_stream (FILE *stream, char *errbuf);
 struct benc_entity *benc_parse_file (const char *file_name, char *errbuf);
+char *benc_load_file (const char *file_name, int *plength, char *errbuf);
 void benc_sha1_entity (struct benc_entity *entity, unsigned char *digest);
+
+struct benc_buffer {
+	char *data;
+	int length;
+	int capacity;
+};
+
+void benc_buffer_append (struct benc_buffer *buffer, const void *data, int length);
+void benc_buffer_free (struct benc_buffer *buffer);
+void benc_encode (struct benc_entity *entity, struct benc_buffer *buffer);
+int benc_encode_fd (struct benc_entity *entity, int fd, char *errbuf);
 void benc_dump_entity (struct benc_entity *entity);
 
 #endif
@@ -11,5 +11,8 @@
 #define OUTPUT_SCRAPE   6
 #define OUTPUT_SCRAPEC  7
 #define OUTPUT_MAGNET   8
+#define OUTPUT_PIECEMAP 9
+#define OUTPUT_EDIT     10
+#define OUTPUT_BATCH    11
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef CONNCACHE_H
+#define CONNCACHE_H
+
+#include <sys/socket.h>
+
+/*
+ * Process-wide cache of BEP 15 connection IDs keyed by tracker address
+ * and port, so repeated UDP scrapes skip the connect round trip. The spec
+ * lets a client reuse an ID for one minute after receiving it.
+ */
+#define CONNCACHE_TTL 60
+
+// Returns the seconds the cached ID stays valid, 0 if there is none
+int conncache_get (const struct sockaddr *addr, unsigned char *connection_id);
+void conncache_put (const struct sockaddr *addr, const unsigned char *connection_id);
+void conncache_invalidate (const struct sockaddr *addr);
+
+/* optional persistence for short-lived processes; a missing file is not an error */
+int conncache_load (const char *file_name);
+int conncache_save (const char *file_name);
+
+#endif
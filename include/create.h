@@ -0,0 +1,23 @@
+#ifndef CREATE_H
+#define CREATE_H
+
+#define CREATE_MAX_PIECE_LENGTH (64 * 1024 * 1024)   /* hashed as an int length; larger is refused */
+
+struct create_options {
+    long long int piece_length;  /* 0 selects one from the content size */
+    char **announces;            /* first one becomes "announce", all go in announce-list */
+    int announce_count;
+    const char *comment;
+    int private_flag;
+    int threads;                 /* 0 uses every online CPU */
+};
+
+// The torrent's name for path: the last component of its resolved path, so "." or "dir/"
+// name it after the directory; NULL with errbuf if path doesn't exist or is "/"
+char *create_torrent_name (const char *path, char *errbuf);
+
+// Hash the file or directory at path and write a .torrent to output; info_hash receives its 20-byte hash
+int create_torrent(const char *path, const char *output, const struct create_options *options,
+                   unsigned char *info_hash, char *errbuf);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FILETREE_H
+#define FILETREE_H
+
+#include "benc.h"
+
+/*
+ * Compact directory trie built from the "path" lists of a multi-file
+ * torrent. Path components are interned, so a directory name that repeats
+ * across thousands of entries is stored once. Component strings point into
+ * the benc tree the trie was built from, which must outlive it.
+ */
+struct file_tree_node {
+    int name;           /* index into file_tree.names */
+    int parent;         /* -1 for the root */
+    int first_child;    /* -1 for a leaf */
+    int last_child;
+    int next_sibling;
+    int depth;          /* 0 for the root */
+    int is_dir;
+    long long int size;       /* file size, or sum of all files below */
+    long long int file_count; /* 1 for a file, or number of files below */
+};
+
+struct file_tree_name {
+    const char *str;
+    int length;
+};
+
+struct file_tree {
+    struct file_tree_node *nodes;
+    int node_count;
+    int node_capacity;
+
+    struct file_tree_name *names;
+    int name_count;
+    int name_capacity;
+
+    /* open-addressing tables, sizes are powers of two */
+    int *name_slots;     /* name index + 1, 0 means empty */
+    int name_slot_mask;
+    int *child_slots;    /* node index + 1, keyed by (parent, name) */
+    int child_slot_mask;
+};
+
+/* Build the trie for info.files in a single pass. root_name is info.name.
+   Returns NULL and fills errbuf if the file list is malformed. */
+struct file_tree *file_tree_build(struct benc_entity *files, struct benc_entity *root_name, char *errbuf);
+
+void file_tree_free(struct file_tree *tree);
+
+#endif
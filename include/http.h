@@ -0,0 +1,58 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+/*
+ * Incremental HTTP/1.x response parser. Bytes are fed as they arrive; the
+ * parser consumes exactly one response (so pipelined responses can follow in
+ * the same buffer) and leaves the decoded body in a growable buffer. With
+ * HAVE_ZLIB a gzip or deflate Content-Encoding is inflated on the fly; the
+ * body limit applies to the inflated size.
+ */
+#define HTTP_MAX_LINE 8192              /* status, header or chunk-size line */
+#define HTTP_MAX_BODY (64 * 1024 * 1024)
+
+enum {
+    HTTP_STATUS_LINE,
+    HTTP_HEADER_LINE,
+    HTTP_BODY,                          /* Content-Length bytes */
+    HTTP_BODY_UNTIL_CLOSE,              /* neither length nor chunked */
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,                /* CRLF after a chunk */
+    HTTP_TRAILER,
+    HTTP_DONE
+};
+
+struct http_response {
+    int state;
+    int status;                         /* e.g. 200 */
+    int version_minor;                  /* HTTP/1.x */
+    int keep_alive;                     /* the connection may carry another response */
+    int chunked;
+    int compressed;                     /* Content-Encoding: gzip or deflate */
+    void *inflater;                     /* z_stream once compressed bytes arrived */
+    long long int content_length;       /* -1 if not given */
+    long long int remaining;            /* of the body or the current chunk */
+
+    char line[HTTP_MAX_LINE];           /* partial line being assembled */
+    int line_length;
+
+    char *body;                         /* decoded body, NUL-terminated for convenience */
+    int body_length;
+    int body_capacity;
+
+    const char *error;                  /* set when feeding fails */
+};
+
+void http_response_init (struct http_response *response);
+// Forget the last response but keep the body buffer for the next one
+void http_response_reset (struct http_response *response);
+void http_response_free (struct http_response *response);
+
+// Consume up to length bytes; returns how many belong to this response, -1 on a protocol error
+int http_response_feed (struct http_response *response, const char *data, int length);
+
+// The peer closed the connection; returns 0 if that completed the response
+int http_response_eof (struct http_response *response);
+
+#endif
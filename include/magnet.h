@@ -1,6 +1,53 @@
 #ifndef MAGNET_H
 #define MAGNET_H
 
-int parse_magnet_uri(const char *uri, unsigned char out_infohash[20], char ***out_trackers, int *out_tracker_count, char *out_display_name, char *errbuf);
+/*
+ * Magnet URI parser (BEP 9, BEP 53). One pass over the caller's string and
+ * no allocation: text fields are views into the URI, still percent-encoded,
+ * valid as long as the URI is; magnet_decode() copies one out decoded.
+ * Keys may carry a ".<n>" suffix (xt.1, tr.2); unknown keys and exact
+ * topics other than BitTorrent ones are ignored.
+ */
+#define MAGNET_MAX_TOPICS 4             /* xt kept; more are ignored */
+#define MAGNET_MAX_ITEMS  64            /* tr, x.pe and ws each */
+
+enum {
+    MAGNET_BTIH,                        /* urn:btih:, v1 info hash in hex or base32 */
+    MAGNET_BTMH                         /* urn:btmh:, v2 sha2-256 multihash in hex */
+};
+
+struct magnet_view {
+    const char *data;                   /* NULL if absent */
+    int length;
+};
+
+struct magnet_topic {
+    int type;                           /* MAGNET_BTIH or MAGNET_BTMH */
+    unsigned char hash[32];             /* 20 bytes for btih, 32 for btmh */
+};
+
+struct magnet {
+    struct magnet_topic topics[MAGNET_MAX_TOPICS];
+    int topic_count;
+    unsigned char info_hash[20];        /* for trackers: the btih, else the btmh truncated (BEP 52) */
+    struct magnet_view name;            /* dn */
+    long long int length;               /* xl, -1 if absent */
+    struct magnet_view trackers[MAGNET_MAX_ITEMS];
+    int tracker_count;
+    struct magnet_view peers[MAGNET_MAX_ITEMS];      /* x.pe, host:port */
+    int peer_count;
+    struct magnet_view web_seeds[MAGNET_MAX_ITEMS];  /* ws */
+    int web_seed_count;
+    struct magnet_view select;          /* so, e.g. "0,2,4-6"; checked by magnet_selected() */
+};
+
+// Parse uri into magnet; 1 with errbuf if it is not a magnet URI with a BitTorrent topic
+int magnet_parse (struct magnet *magnet, const char *uri, char *errbuf);
+
+// Percent-decode view ('+' is a space) into out, NUL-terminated and truncated to size; returns the full length
+int magnet_decode (const struct magnet_view *view, char *out, int size);
+
+// Does the so= selection include the file at index? Every file does without one.
+int magnet_selected (const struct magnet *magnet, long long int index);
 
 #endif
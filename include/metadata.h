@@ -0,0 +1,22 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+/*
+ * Fetch a torrent's info dictionary from peers knowing only its info hash:
+ * the BitTorrent handshake, the BEP 10 extension handshake, then BEP 9
+ * ut_metadata. Every peer is connected at once, the 16 KiB metadata pieces
+ * are spread over the peers that offer them, and the assembled dictionary
+ * must hash to the info hash. Pieces from peers whose metadata didn't
+ * check out are fetched again from the others.
+ */
+#define METADATA_PIECE_SIZE 16384
+#define METADATA_MAX_SIZE   (16 * 1024 * 1024)   /* larger metadata_size claims are refused */
+#define METADATA_MAX_PEERS  64
+#define METADATA_PIPELINE   4                    /* piece requests outstanding per peer */
+
+// Fetch from peers ("host:port" or "[v6]:port") within timeout_ms. Returns the bencoded
+// info dictionary (to be freed) and its length, or NULL with errbuf
+char *metadata_fetch (const unsigned char *info_hash, char **peers, int peer_count, int timeout_ms,
+                      int *plength, char *errbuf);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef PIECEMAP_H
+#define PIECEMAP_H
+
+#include "benc.h"
+
+/*
+ * Piece-to-file index. offsets[] is the prefix sum of the file lengths
+ * (offsets[i] is where file i starts in the torrent's byte stream and
+ * offsets[file_count] is the total size), so mapping a byte offset to its
+ * file is a binary search instead of a walk over info.files.
+ */
+struct piece_map {
+    int file_count;
+    long long int *offsets;
+    long long int piece_length;
+    long long int piece_count;
+    struct benc_entity **paths; /* info.files[i].path, NULL for single-file torrents */
+    struct benc_entity *name;   /* info.name */
+};
+
+struct piece_map *piece_map_new(const long long int *lengths, int count, long long int piece_length);
+struct piece_map *piece_map_from_info(struct benc_entity *info, char *errbuf);
+void piece_map_free(struct piece_map *map);
+
+// Index of the file holding byte offset (zero-length files are never returned), -1 if out of range
+int piece_map_file_at(const struct piece_map *map, long long int offset);
+
+// First and last file a piece spans; returns 1 if the piece doesn't exist
+int piece_map_piece_files(const struct piece_map *map, long long int piece, int *first, int *last);
+
+// Piece holding byte offset of file, -1 if out of range
+long long int piece_map_piece_at(const struct piece_map *map, int file, long long int offset);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netdb.h>
+
+/*
+ * Process-wide asynchronous host name cache. Lookups run getaddrinfo() on a
+ * small pool of worker threads; concurrent lookups of the same name share
+ * one query, and answers (including failures) are cached for a while.
+ *
+ * Callbacks never run on a worker thread: completions are queued and run by
+ * resolver_dispatch(), which the owner calls once resolver_fd() is readable.
+ */
+#define RESOLVER_THREADS      4
+#define RESOLVER_TTL          300   /* seconds an answer is reused */
+#define RESOLVER_NEGATIVE_TTL 30    /* seconds a failure is remembered */
+
+struct resolver_waiter;
+
+// addresses is NULL on failure, with error set; both are only valid during the call
+typedef void (*resolver_callback)(void *arg, const struct addrinfo *addresses, const char *error);
+
+// Eventfd that becomes readable when completions are waiting, -1 if the resolver could not start
+int resolver_fd (void);
+
+// Look host up. A cached answer runs callback before returning NULL; otherwise
+// the returned waiter can be passed to resolver_cancel() until the callback runs.
+struct resolver_waiter *resolver_lookup (const char *host, resolver_callback callback, void *arg);
+void resolver_cancel (struct resolver_waiter *waiter);
+
+// Run the callbacks of every finished lookup
+void resolver_dispatch (void);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SCRAPE_ENGINE_H
+#define SCRAPE_ENGINE_H
+
+#include "common.h"
+#include "scrapec.h"
+
+/*
+ * Single-threaded epoll engine keeping many HTTP and UDP scrapes in flight.
+ * Submit any number of requests, then scrape_engine_run() drives them all
+ * until none is left; each request's callback fires once, as soon as that
+ * request finishes. HTTP trackers are reached over a pool of keep-alive
+ * connections that lives as long as the engine, across runs.
+ */
+struct scrape_engine;
+struct scrape_job;
+
+struct scrape_request {
+    /* filled in by the caller */
+    const char *url;
+    const unsigned char (*info_hashes)[20];
+    int count;
+    struct scrape_result *results;     /* count entries */
+    void (*callback)(struct scrape_request *request, void *arg);
+    void *arg;
+
+    /* filled in by the engine before the callback */
+    int status;                        /* 0 if the tracker answered every batch */
+    char errbuf[ERRBUF_SIZE];
+
+    /* engine private */
+    int pending_jobs;
+    const unsigned char (*scrape_hashes)[20];  /* the hashes not answered from the scrape cache */
+    struct scrape_result *scrape_results;
+    int *scrape_map;                           /* their index in info_hashes, NULL if all of them */
+    int scrape_count;
+    int min_interval;                          /* the tracker's, for the cache */
+    long long int started;                     /* ms, for the tracker's health; 0 if no network */
+};
+
+struct scrape_engine *scrape_engine_new (void);
+void scrape_engine_free (struct scrape_engine *engine);
+
+// Start a request; timeout_ms <= 0 uses -w, else SCRAPE_DEFAULT_TIMEOUT for HTTP and the
+// retransmission schedule for UDP. The request must stay alive until its callback.
+void scrape_engine_submit (struct scrape_engine *engine, struct scrape_request *request, int timeout_ms);
+
+// Drive all submitted requests until none is in flight or scrape_engine_stop() is called
+void scrape_engine_run (struct scrape_engine *engine);
+
+// Make scrape_engine_run() return; requests still in flight complete as "cancelled"
+void scrape_engine_stop (struct scrape_engine *engine);
+
+#endif
@@ -1,6 +1,71 @@
 #ifndef SCRAPEC_H
 #define SCRAPEC_H
 
+/* BEP 15 caps a UDP scrape at about 74 hashes per packet; HTTP is
+   limited only by the URL length trackers accept */
+#define SCRAPE_UDP_MAX_HASHES  74
+#define SCRAPE_HTTP_MAX_HASHES 50
+
+/* used when -w isn't given */
+#define SCRAPE_DEFAULT_TIMEOUT 15
+
+/* BEP 15 retransmits after 15 * 2^n seconds, n = 0..8. Without -w a UDP
+   exchange runs until the wait after retransmission n = --udp-retries
+   (default below) runs out, instead of the fixed timeout. */
+#define SCRAPE_UDP_RETRANSMIT_BASE 15
+#define SCRAPE_UDP_MAX_RETRIES     8
+#define SCRAPE_UDP_DEFAULT_RETRIES 1
+
+/* scrape requests in flight at once, and per tracker host: requests per
+   second with a burst of SCRAPE_HOST_BURST (--max-requests, --host-rate;
+   0 lifts the limit) */
+#define SCRAPE_DEFAULT_MAX_REQUESTS 64
+#define SCRAPE_DEFAULT_HOST_RATE    4
+#define SCRAPE_HOST_BURST           8
+
+/* --announce: a tracker that refuses to scrape is asked for each hash with
+   a "stopped" announce for no peers instead; the port it is told we listen on */
+#define SCRAPE_ANNOUNCE_PORT 6881
+
+struct scrape_result {
+    int status;     /* 0 if the tracker reported this hash */
+    int seeders;
+    int completed;  /* -1 if unknown (an announce answered) */
+    int leechers;
+    char name[128]; /* "name" if the tracker sent one (BEP 48), else empty */
+};
+
 int scrapec (const char *url, const unsigned char *info_hash, int *result, char *errbuf);
+int scrapec_batch (const char *url, const unsigned char (*info_hashes)[20], int count,
+                   struct scrape_result *results, char *errbuf);
+
+/* -------------------------------------------------------------------------
+   Helpers shared with the scrape engine
+   ------------------------------------------------------------------------- */
+#define SCRAPE_PROTOCOL_HTTP 1
+#define SCRAPE_PROTOCOL_UDP  2
+
+struct url_struct {
+    int protocol;     /* SCRAPE_PROTOCOL_*, 0 if not parsed */
+    int tls;          /* https:// */
+    char *host;       /* an IPv6 literal without its brackets */
+    int port;         /* the scheme's default if the URL has none */
+    char *path;       /* path and query, as sent in the request line */
+};
+
+// Parse an http://, https:// or udp:// URL (RFC 3986) of any length, keeping the query; 1 with errbuf if
+// it is unusable. scrape_parse_url() gives an HTTP tracker's scrape path. Free with scrape_free_url()
+int scrape_parse_announce_url (struct url_struct *url_struct, const char *url, char *errbuf);
+int scrape_parse_url (struct url_struct *url_struct, const char *url, char *errbuf);
+void scrape_free_url (struct url_struct *url_struct);
+char *scrape_build_http_request (const struct url_struct *url_struct, const unsigned char (*info_hashes)[20],
+                                 int count, const char *http_version, int *plength);
+int scrape_parse_http_response (int status, const char *body, int body_length,
+                                const unsigned char (*info_hashes)[20], int count,
+                                struct scrape_result *results, int *min_interval, char *errbuf);
+char *scrape_build_http_announce (const struct url_struct *url_struct, const unsigned char *info_hash,
+                                  const unsigned char *peer_id, const char *http_version, int *plength);
+int scrape_parse_http_announce (int status, const char *body, int body_length,
+                                struct scrape_result *result, char *errbuf);
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef SCRAPECACHE_H
+#define SCRAPECACHE_H
+
+#include "scrapec.h"
+
+/*
+ * Persistent cache of scrape results keyed by (tracker URL, info hash), so
+ * repeated runs on the same torrents are answered without the network.
+ *
+ * The file is a small header and a power-of-two table of fixed 64-byte
+ * slots (open addressing), mapped shared by every process using it.
+ * Writers serialize on flock(); readers take no lock: a slot's sequence
+ * counter is odd while it is written, and a read that sees it change
+ * retries. A table that fills up is rehashed into a new file renamed over
+ * the old one; processes still mapping the old one notice on their next
+ * write.
+ */
+#define SCRAPECACHE_DEFAULT_MAX_AGE 300            /* seconds */
+#define SCRAPECACHE_MIN_SLOTS       1024
+#define SCRAPECACHE_KEEP            (7 * 86400)    /* older entries go when the table grows */
+
+// Map the cache file, creating it if needed; later calls are no-ops
+int scrapecache_open (const char *file_name, char *errbuf);
+void scrapecache_close (void);
+
+// 1 with *result filled in if the entry is younger than max_age seconds, or than
+// the min_request_interval the tracker gave with it; 0 if missing, stale, max_age is 0
+// or no cache is open
+int scrapecache_get (const char *url, const unsigned char *info_hash, int max_age, struct scrape_result *result);
+
+// Store every result with status 0
+void scrapecache_put (const char *url, const unsigned char (*info_hashes)[20], const struct scrape_result *results,
+                      int count, int min_interval);
+
+#endif
@@ -15,4 +15,17 @@ void print_field(struct benc_entity *root);
 // Display or fetch scrape info from a .torrent
 void scrape_torrent(struct benc_entity *root);
 
+// Scrape many .torrent files at once, grouped by tracker; returns the number of failures
+int batch_scrape_torrents(char **file_names, int count);
+
+// Scrape the magnet links in a file ("-" for stdin), one per line, deduplicated by info hash and
+// grouped by tracker; returns the number of failures
+int batch_scrape_magnets(const char *file_name);
+
+// Answer piece <-> file byte-range queries ("<piece>" or "<file>:<offset>")
+void query_piece_map(struct benc_entity *root, char **queries, int query_count);
+
+// Apply the --set-announce/--add-tracker/--strip-comment/--set-private edits to a .torrent in place
+int edit_torrent(const char *file_name, char *errbuf);
+
 #endif
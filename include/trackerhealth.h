@@ -0,0 +1,29 @@
+#ifndef TRACKERHEALTH_H
+#define TRACKERHEALTH_H
+
+#include <time.h>
+
+/*
+ * Process-wide health record per tracker URL: how often it answers, how
+ * fast, and what went wrong last. Trackers are tried fastest and most
+ * reliable first. One failing again and again is left alone for a cooldown
+ * that doubles with every failure in a row.
+ */
+#define TRACKERHEALTH_BACKOFF_MIN     60      /* seconds, after two failures in a row */
+#define TRACKERHEALTH_BACKOFF_MAX     3600
+#define TRACKERHEALTH_UNKNOWN_LATENCY 1000    /* ms assumed for a tracker never heard from */
+
+// Account for one finished scrape; latency_ms only counts when it succeeded
+void trackerhealth_record (const char *url, int success, int latency_ms, const char *error);
+
+// Seconds until the tracker is worth another try, 0 if now; *error gets its last error, if any
+int trackerhealth_backoff (const char *url, const char **error);
+
+// Stable sort, the most promising tracker first
+void trackerhealth_sort (char **urls, int count);
+
+/* optional persistence for short-lived processes; a missing file is not an error */
+int trackerhealth_load (const char *file_name);
+int trackerhealth_save (const char *file_name);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include "common.h"
+
+/*
+ * Byte stream over a connected non-blocking socket: plain TCP, or TLS when
+ * built with HAVE_OPENSSL. Calls never block; TRANSPORT_WANT_READ and
+ * TRANSPORT_WANT_WRITE say which readiness to wait for before calling
+ * again. TLS verifies the certificate against the system CAs (OpenSSL's
+ * SSL_CERT_FILE and SSL_CERT_DIR override them) and caches one session per
+ * host and port for the life of the process, so later connections resume
+ * instead of repeating the full handshake.
+ */
+enum {
+    TRANSPORT_ERROR = -1,               /* error says why */
+    TRANSPORT_WANT_READ = -2,
+    TRANSPORT_WANT_WRITE = -3
+};
+
+struct transport;
+
+struct transport_ops {
+    const char *name;
+    // 0 once data can flow, or a TRANSPORT_ code
+    int (*handshake) (struct transport *transport);
+    // Bytes moved (0 from recv at the end of the stream), or a TRANSPORT_ code
+    ssize_t (*send) (struct transport *transport, const void *data, size_t length);
+    ssize_t (*recv) (struct transport *transport, void *data, size_t length);
+    // Release the backend; the socket stays the caller's to close
+    void (*close) (struct transport *transport);
+};
+
+struct transport {
+    const struct transport_ops *ops;
+    int fd;
+    void *backend;                      /* SSL * for TLS */
+    char *session_key;                  /* "host:port" for TLS */
+    int resumed;                        /* the TLS handshake resumed a cached session */
+    char error[ERRBUF_SIZE];
+};
+
+void transport_plain (struct transport *transport, int fd);
+
+// TLS client to host on fd; 1 with error set if TLS is unavailable
+int transport_tls (struct transport *transport, int fd, const char *host, int port);
+
+#endif
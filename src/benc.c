@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
 #include "common.h"
 #include "sha1.h"
 #include "benc.h"
@@ -11,6 +13,8 @@ struct benc_entity *benc_new_string (int length, char *str)
 	struct benc_entity *retval = (struct benc_entity *)malloc(sizeof(struct benc_entity));
 	retval->type = BENC_STRING;
 	retval->next = NULL;
+	retval->raw = NULL;
+	retval->raw_length = 0;
 	retval->string.length = length;
 	retval->string.str = str;
 	return retval;
@@ -21,6 +25,8 @@ struct benc_entity *benc_new_integer (long long int value)
 	struct benc_entity *retval = (struct benc_entity *)malloc(sizeof(struct benc_entity));
 	retval->type = BENC_INTEGER;
 	retval->next = NULL;
+	retval->raw = NULL;
+	retval->raw_length = 0;
 	retval->integer = value;
 	return retval;
 }
@@ -30,6 +36,8 @@ struct benc_entity *benc_new_list (void)
 	struct benc_entity *retval = (struct benc_entity *)malloc(sizeof(struct benc_entity));
 	retval->type = BENC_LIST;
 	retval->next = NULL;
+	retval->raw = NULL;
+	retval->raw_length = 0;
 	retval->list.head = NULL;
 	return retval;
 }
@@ -51,6 +59,8 @@ struct benc_entity *benc_new_dictionary (void)
 	struct benc_entity *retval = (struct benc_entity *)malloc(sizeof(struct benc_entity));
 	retval->type = BENC_DICTIONARY;
 	retval->next = NULL;
+	retval->raw = NULL;
+	retval->raw_length = 0;
 	retval->dictionary.head = NULL;
 	return retval;
 }
@@ -90,6 +100,78 @@ struct benc_entity *benc_lookup_string (struct benc_entity *dictionary, const ch
 	return NULL;
 }
 
+void benc_set_dictionary (struct benc_entity *dictionary, const char *key, struct benc_entity *value)
+{
+	struct benc_entity *curr, *prev = NULL;
+	int length;
+
+	assert(dictionary != NULL && key != NULL && value != NULL && dictionary->type == BENC_DICTIONARY);
+
+	dictionary->raw = NULL;
+	length = strlen(key);
+	for (curr = dictionary->dictionary.head; curr != NULL && curr->next != NULL; prev = curr->next, curr = curr->next->next) {
+		int min = length < curr->string.length ? length : curr->string.length;
+		int cmp = memcmp(curr->string.str, key, min);
+		if (cmp == 0)
+			cmp = curr->string.length - length;
+		if (cmp == 0) {
+			/* replace the value in place */
+			value->next = curr->next->next;
+			curr->next->next = NULL;
+			benc_free_entity(curr->next);
+			curr->next = value;
+			if (value->next == NULL)
+				dictionary->dictionary.tail = value;
+			return;
+		}
+		if (cmp > 0)
+			break;
+	}
+
+	{
+		char *str = (char *)malloc(length + 1);
+		struct benc_entity *key_entity;
+
+		memcpy(str, key, length + 1);
+		key_entity = benc_new_string(length, str);
+		key_entity->next = value;
+		value->next = curr;
+		if (prev == NULL)
+			dictionary->dictionary.head = key_entity;
+		else
+			prev->next = key_entity;
+		if (curr == NULL)
+			dictionary->dictionary.tail = value;
+	}
+}
+
+int benc_remove_dictionary (struct benc_entity *dictionary, const char *key)
+{
+	struct benc_entity *curr, *prev = NULL;
+	int length;
+
+	assert(dictionary != NULL && key != NULL && dictionary->type == BENC_DICTIONARY);
+
+	length = strlen(key);
+	for (curr = dictionary->dictionary.head; curr != NULL && curr->next != NULL; prev = curr->next, curr = curr->next->next) {
+		if (curr->type == BENC_STRING && length == curr->string.length && strncmp(key, curr->string.str, length) == 0) {
+			struct benc_entity *value = curr->next;
+
+			if (prev == NULL)
+				dictionary->dictionary.head = value->next;
+			else
+				prev->next = value->next;
+			if (value->next == NULL)
+				dictionary->dictionary.tail = prev;
+			value->next = NULL;
+			benc_free_entity(curr);
+			dictionary->raw = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void benc_free_entity (struct benc_entity *entity)
 {
 	assert(entity != NULL);
@@ -145,6 +227,10 @@ static int parse_lldecimal_memory (const char *str, long long int *presult)
 struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten, char *errbuf)
 {
 	struct benc_entity *entity;
+	int total_eaten;
+
+	if (peaten == NULL)
+		peaten = &total_eaten;
 
 	if (length < 2) {
 		snprintf(errbuf, ERRBUF_SIZE, "parse error: length (%d) too small.", length);
@@ -162,8 +248,7 @@ struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten
 				snprintf(errbuf, ERRBUF_SIZE, "parse error: expecting 'e' for an integer");
 				return NULL;
 			}
-			if (peaten != NULL)
-				*peaten = eaten + 2;
+			*peaten = eaten + 2;
 			entity = benc_new_integer(value);
 		}
 		break;
@@ -191,8 +276,7 @@ struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten
 				ptr += eaten;
 				benc_append_list(entity, child_entity);
 			}
-			if (peaten != NULL)
-				*peaten = ptr + 1 - data;
+			*peaten = ptr + 1 - data;
 		}
 		break;
 	case 'd':
@@ -226,8 +310,7 @@ struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten
 				ptr += eaten;
 				benc_append_dictionary(entity, key, value);
 			}
-			if (peaten != NULL)
-				*peaten = ptr + 1 - data;
+			*peaten = ptr + 1 - data;
 		}
 		break;
 	default:
@@ -254,13 +337,14 @@ struct benc_entity *benc_parse_memory (const char *data, int length, int *peaten
 			memcpy(str, data + eaten + 1, (int)str_length);
 			str[str_length] = '\0';
 
-			if (peaten != NULL)
-				*peaten = eaten + 1 + (int)str_length;
+			*peaten = eaten + 1 + (int)str_length;
 			entity = benc_new_string((int)str_length, str);
 		}
 		break;
 	}
 
+	entity->raw = data;
+	entity->raw_length = *peaten;
 	return entity;
 }
 
@@ -415,8 +499,48 @@ struct benc_entity *benc_parse_file (const char *file_name, char *errbuf)
 	return entity;
 }
 
+char *benc_load_file (const char *file_name, int *plength, char *errbuf)
+{
+	FILE *fp;
+	char *data;
+	long size;
+
+	fp = fopen(file_name, "rb");
+	if (fp == NULL) {
+		snprintf(errbuf, ERRBUF_SIZE, "can't open file %s", file_name);
+		errbuf[ERRBUF_SIZE - 1] = '\0';
+		return NULL;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || size > 0x7fffffffL || fseek(fp, 0, SEEK_SET) != 0) {
+		snprintf(errbuf, ERRBUF_SIZE, "can't determine size of %s", file_name);
+		errbuf[ERRBUF_SIZE - 1] = '\0';
+		fclose(fp);
+		return NULL;
+	}
+
+	data = (char *)malloc(size + 1);
+	if (size != 0 && fread(data, size, 1, fp) != 1) {
+		snprintf(errbuf, ERRBUF_SIZE, "can't read file %s", file_name);
+		errbuf[ERRBUF_SIZE - 1] = '\0';
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+	data[size] = '\0';
+
+	fclose(fp);
+	*plength = (int)size;
+	return data;
+}
+
 static void benc_sha1_entity_rec (struct benc_entity *entity, SHA_CTX *ctx)
 {
+	if (entity->raw != NULL) {
+		SHAUpdate(ctx, (unsigned char *)entity->raw, entity->raw_length);
+		return;
+	}
+
 	switch (entity->type) {
 	case BENC_STRING:
 		{
@@ -468,6 +592,96 @@ void benc_sha1_entity (struct benc_entity *entity, unsigned char *digest)
 	SHAFinal(digest, &ctx);
 }
 
+void benc_buffer_append (struct benc_buffer *buffer, const void *data, int length)
+{
+	if (buffer->length + length > buffer->capacity) {
+		int capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (capacity < buffer->length + length)
+			capacity *= 2;
+		buffer->data = (char *)realloc(buffer->data, capacity);
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+void benc_buffer_free (struct benc_buffer *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = buffer->capacity = 0;
+}
+
+void benc_encode (struct benc_entity *entity, struct benc_buffer *buffer)
+{
+	/* untouched subtrees are copied verbatim from the parsed bytes */
+	if (entity->raw != NULL) {
+		benc_buffer_append(buffer, entity->raw, entity->raw_length);
+		return;
+	}
+
+	switch (entity->type) {
+	case BENC_STRING:
+		{
+			char size[16];
+			int len_size = sprintf(size, "%d:", entity->string.length);
+			benc_buffer_append(buffer, size, len_size);
+			benc_buffer_append(buffer, entity->string.str, entity->string.length);
+		}
+		break;
+	case BENC_INTEGER:
+		{
+			char size[32];
+			int len_size = sprintf(size, "i%llde", entity->integer);
+			benc_buffer_append(buffer, size, len_size);
+		}
+		break;
+	case BENC_LIST:
+		{
+			struct benc_entity *curr;
+
+			benc_buffer_append(buffer, "l", 1);
+			for (curr = entity->list.head; curr != NULL; curr = curr->next)
+				benc_encode(curr, buffer);
+			benc_buffer_append(buffer, "e", 1);
+		}
+		break;
+	case BENC_DICTIONARY:
+		{
+			struct benc_entity *curr;
+
+			benc_buffer_append(buffer, "d", 1);
+			for (curr = entity->dictionary.head; curr != NULL; curr = curr->next)
+				benc_encode(curr, buffer);
+			benc_buffer_append(buffer, "e", 1);
+		}
+		break;
+	default:
+		assert(0);
+	}
+}
+
+int benc_encode_fd (struct benc_entity *entity, int fd, char *errbuf)
+{
+	struct benc_buffer buffer = {NULL, 0, 0};
+	int written = 0;
+
+	benc_encode(entity, &buffer);
+	while (written < buffer.length) {
+		ssize_t len = write(fd, buffer.data + written, buffer.length - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			snprintf(errbuf, ERRBUF_SIZE, "write error: %s", strerror(errno));
+			benc_buffer_free(&buffer);
+			return 1;
+		}
+		written += len;
+	}
+	benc_buffer_free(&buffer);
+	return 0;
+}
+
 static int is_ascii (const char *str, int length)
 {
 	while (--length >= 0) {
@@ -0,0 +1,174 @@
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "conncache.h"
+
+struct conncache_entry {
+    int family;
+    unsigned char address[16];   /* IPv4 uses the first 4 bytes */
+    unsigned short port;         /* host order */
+    unsigned char connection_id[8];
+    time_t expires;              /* wall clock, so it survives a save/load */
+};
+
+static struct conncache_entry *entries;
+static int entry_count;
+static int entry_capacity;
+
+/* Reduce a socket address to the cache key; returns 0 for unsupported families. */
+static int make_key(const struct sockaddr *addr, struct conncache_entry *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->family = addr->sa_family;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        memcpy(key->address, &in->sin_addr, 4);
+        key->port = ntohs(in->sin_port);
+        return 1;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        memcpy(key->address, &in6->sin6_addr, 16);
+        key->port = ntohs(in6->sin6_port);
+        return 1;
+    }
+    return 0;
+}
+
+static struct conncache_entry *find_entry(const struct conncache_entry *key)
+{
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].family == key->family && entries[i].port == key->port &&
+            memcmp(entries[i].address, key->address, 16) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
+
+static void store_entry(const struct conncache_entry *key, const unsigned char *connection_id, time_t expires)
+{
+    struct conncache_entry *entry = find_entry(key);
+
+    if (entry == NULL) {
+        /* reuse an expired slot before growing */
+        time_t now = time(NULL);
+        for (int i = 0; i < entry_count && entry == NULL; i++) {
+            if (entries[i].expires <= now)
+                entry = &entries[i];
+        }
+    }
+    if (entry == NULL) {
+        if (entry_count == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 16;
+            entries = realloc(entries, sizeof(struct conncache_entry) * entry_capacity);
+        }
+        entry = &entries[entry_count++];
+    }
+    *entry = *key;
+    memcpy(entry->connection_id, connection_id, 8);
+    entry->expires = expires;
+}
+
+int conncache_get(const struct sockaddr *addr, unsigned char *connection_id)
+{
+    struct conncache_entry key, *entry;
+    time_t now = time(NULL);
+
+    if (!make_key(addr, &key) || (entry = find_entry(&key)) == NULL || entry->expires <= now)
+        return 0;
+    memcpy(connection_id, entry->connection_id, 8);
+    return (int) (entry->expires - now);
+}
+
+void conncache_put(const struct sockaddr *addr, const unsigned char *connection_id)
+{
+    struct conncache_entry key;
+
+    if (make_key(addr, &key))
+        store_entry(&key, connection_id, time(NULL) + CONNCACHE_TTL);
+}
+
+void conncache_invalidate(const struct sockaddr *addr)
+{
+    struct conncache_entry key, *entry;
+
+    if (make_key(addr, &key) && (entry = find_entry(&key)) != NULL)
+        entry->expires = 0;
+}
+
+/* -------------------------------------------------------------------------
+   PERSISTENCE: one "<address> <port> <connection id hex> <expiry>" per line
+   ------------------------------------------------------------------------- */
+int conncache_load(const char *file_name)
+{
+    FILE *fp = fopen(file_name, "r");
+    char address[INET6_ADDRSTRLEN], id_hex[17];
+    unsigned int port;
+    long long int expires;
+    time_t now = time(NULL);
+
+    if (fp == NULL)
+        return 0;
+    while (fscanf(fp, "%45s %u %16s %lld", address, &port, id_hex, &expires) == 4) {
+        struct conncache_entry key;
+        unsigned char connection_id[8];
+        int valid = strlen(id_hex) == 16;
+
+        if (expires <= now || port > 65535)
+            continue;
+        memset(&key, 0, sizeof(key));
+        if (inet_pton(AF_INET6, address, key.address) == 1)
+            key.family = AF_INET6;
+        else if (inet_pton(AF_INET, address, key.address) == 1)
+            key.family = AF_INET;
+        else
+            continue;
+        key.port = (unsigned short) port;
+        for (int i = 0; i < 8 && valid; i++)
+            valid = sscanf(id_hex + i * 2, "%2hhx", &connection_id[i]) == 1;
+        if (valid)
+            store_entry(&key, connection_id, (time_t) expires);
+    }
+    fclose(fp);
+    return 0;
+}
+
+int conncache_save(const char *file_name)
+{
+    char *tmp_name = malloc(strlen(file_name) + 8);
+    time_t now = time(NULL);
+    FILE *fp;
+    int fd;
+
+    /* write a temporary file and rename it, concurrent runs may share the cache */
+    sprintf(tmp_name, "%s.XXXXXX", file_name);
+    fd = mkstemp(tmp_name);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        free(tmp_name);
+        return 1;
+    }
+    for (int i = 0; i < entry_count; i++) {
+        char address[INET6_ADDRSTRLEN];
+
+        if (entries[i].expires <= now ||
+            inet_ntop(entries[i].family, entries[i].address, address, sizeof(address)) == NULL)
+            continue;
+        fprintf(fp, "%s %u ", address, entries[i].port);
+        for (int j = 0; j < 8; j++)
+            fprintf(fp, "%02x", entries[i].connection_id[j]);
+        fprintf(fp, " %lld\n", (long long int) entries[i].expires);
+    }
+    if (fclose(fp) != 0 || rename(tmp_name, file_name) != 0) {
+        unlink(tmp_name);
+        free(tmp_name);
+        return 1;
+    }
+    free(tmp_name);
+    return 0;
+}
@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "benc.h"
+#include "sha1.h"
+#include "piecemap.h"
+#include "create.h"
+
+#ifndef DUMPTORRENT_VERSION
+#define DUMPTORRENT_VERSION "unknown"
+#endif
+
+#define READ_UNIT_SIZE   (4 * 1024 * 1024)  /* bytes read per work unit */
+#define READ_ALIGNMENT   4096
+#define MIN_PIECE_LENGTH (16 * 1024)
+#define MAX_PIECE_LENGTH (16 * 1024 * 1024)
+#define TARGET_PIECES    2000
+
+/* -------------------------------------------------------------------------
+   CONTENT WALK
+   ------------------------------------------------------------------------- */
+struct content_file {
+    char *disk_path;
+    char **components;   /* path inside the torrent */
+    int component_count;
+    long long int length;
+};
+
+struct content_list {
+    struct content_file *files;
+    int count;
+    int capacity;
+};
+
+static void add_content_file(struct content_list *list, const char *disk_path,
+                             char **components, int component_count, long long int length)
+{
+    struct content_file *file;
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->files = realloc(list->files, sizeof(struct content_file) * list->capacity);
+    }
+    file = &list->files[list->count++];
+    file->disk_path = strdup(disk_path);
+    file->component_count = component_count;
+    file->components = malloc(sizeof(char *) * component_count);
+    for (int i = 0; i < component_count; i++)
+        file->components[i] = strdup(components[i]);
+    file->length = length;
+}
+
+/* Recursively collect regular files below dir, in sorted order so the
+   same content always yields the same torrent. */
+static int walk_directory(struct content_list *list, const char *dir,
+                          char ***components, int depth, int *max_depth, char *errbuf)
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, NULL, alphasort);
+
+    if (count < 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't read directory %s", dir);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        return 1;
+    }
+    if (depth >= *max_depth) {
+        *max_depth *= 2;
+        *components = realloc(*components, sizeof(char *) * *max_depth);
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char *name = entries[i]->d_name;
+        struct stat st;
+        char *child;
+        int found;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        child = malloc(strlen(dir) + strlen(name) + 2);
+        sprintf(child, "%s/%s", dir, name);
+        (*components)[depth] = (char *) name;
+
+        /* symlinked files are followed, symlinked directories aren't: one
+           pointing above itself would be walked until the path hit ELOOP */
+        found = lstat(child, &st) == 0;
+        if (found && S_ISLNK(st.st_mode))
+            found = stat(child, &st) == 0 && !S_ISDIR(st.st_mode);
+
+        if (!found) {
+            /* dangling symlink, symlinked directory or a file that vanished under us */
+        } else if (S_ISDIR(st.st_mode)) {
+            if (walk_directory(list, child, components, depth + 1, max_depth, errbuf) != 0) {
+                free(child);
+                for (; i < count; i++)
+                    free(entries[i]);
+                free(entries);
+                return 1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            add_content_file(list, child, *components, depth + 1, (long long int) st.st_size);
+        }
+        free(child);
+    }
+
+    for (int i = 0; i < count; i++)
+        free(entries[i]);
+    free(entries);
+    return 0;
+}
+
+static void free_content(struct content_list *list)
+{
+    for (int i = 0; i < list->count; i++) {
+        for (int j = 0; j < list->files[i].component_count; j++)
+            free(list->files[i].components[j]);
+        free(list->files[i].components);
+        free(list->files[i].disk_path);
+    }
+    free(list->files);
+}
+
+static long long int pick_piece_length(long long int total_length)
+{
+    long long int piece_length = MIN_PIECE_LENGTH;
+
+    while (piece_length < MAX_PIECE_LENGTH && total_length / piece_length > TARGET_PIECES)
+        piece_length *= 2;
+    return piece_length;
+}
+
+/* -------------------------------------------------------------------------
+   BUFFER POOL
+   ------------------------------------------------------------------------- */
+struct buffer_pool {
+    void **free_list;
+    int free_count;
+    int capacity;
+    size_t size;
+    pthread_mutex_t lock;
+};
+
+static void pool_init(struct buffer_pool *pool, int capacity, size_t size)
+{
+    pool->free_list = malloc(sizeof(void *) * capacity);
+    pool->free_count = 0;
+    pool->capacity = capacity;
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+static void *pool_get(struct buffer_pool *pool)
+{
+    void *buffer = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count > 0)
+        buffer = pool->free_list[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buffer == NULL && posix_memalign(&buffer, READ_ALIGNMENT, pool->size) != 0)
+        buffer = NULL;
+    return buffer;
+}
+
+static void pool_put(struct buffer_pool *pool, void *buffer)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < pool->capacity) {
+        pool->free_list[pool->free_count++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+}
+
+static void pool_destroy(struct buffer_pool *pool)
+{
+    while (pool->free_count > 0)
+        free(pool->free_list[--pool->free_count]);
+    free(pool->free_list);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* -------------------------------------------------------------------------
+   PARALLEL HASHING
+   ------------------------------------------------------------------------- */
+struct hash_job {
+    const struct content_list *content;
+    const struct piece_map *map;
+    unsigned char *pieces;        /* piece_count * 20, filled by index */
+    long long int unit_pieces;    /* pieces per work unit */
+    long long int unit_count;
+    long long int next_unit;
+    struct buffer_pool pool;
+    pthread_mutex_t lock;
+    int failed;
+    char errbuf[ERRBUF_SIZE];
+};
+
+struct hash_worker {
+    struct hash_job *job;
+    pthread_t thread;
+    int cached_file;              /* keep the last file open across units */
+    int cached_fd;
+};
+
+static void hash_fail(struct hash_job *job, const char *message, const char *path)
+{
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed) {
+        job->failed = 1;
+        snprintf(job->errbuf, ERRBUF_SIZE, "%s %s", message, path);
+        job->errbuf[ERRBUF_SIZE - 1] = '\0';
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Read [start, end) of the concatenated content into buffer. */
+static int read_span(struct hash_worker *worker, long long int start, long long int end, char *buffer)
+{
+    const struct piece_map *map = worker->job->map;
+    int file = piece_map_file_at(map, start);
+
+    while (start < end) {
+        const struct content_file *content = &worker->job->content->files[file];
+        long long int file_end = map->offsets[file + 1] < end ? map->offsets[file + 1] : end;
+        long long int position = start - map->offsets[file];
+
+        if (file_end <= start) {
+            file++;
+            continue;
+        }
+        if (worker->cached_file != file) {
+            if (worker->cached_fd >= 0)
+                close(worker->cached_fd);
+            worker->cached_fd = open(content->disk_path, O_RDONLY);
+            worker->cached_file = file;
+            if (worker->cached_fd < 0) {
+                hash_fail(worker->job, "can't open", content->disk_path);
+                return 1;
+            }
+            posix_fadvise(worker->cached_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        while (start < file_end) {
+            ssize_t len = pread(worker->cached_fd, buffer, (size_t) (file_end - start), position);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0) {
+                hash_fail(worker->job, "short read from", content->disk_path);
+                return 1;
+            }
+            buffer += len;
+            start += len;
+            position += len;
+        }
+        file++;
+    }
+    return 0;
+}
+
+static void *hash_worker_main(void *arg)
+{
+    struct hash_worker *worker = arg;
+    struct hash_job *job = worker->job;
+    const struct piece_map *map = job->map;
+    long long int total = map->offsets[map->file_count];
+
+    for (;;) {
+        long long int unit, first, last, start, end;
+        char *buffer;
+
+        pthread_mutex_lock(&job->lock);
+        unit = job->failed ? job->unit_count : job->next_unit++;
+        pthread_mutex_unlock(&job->lock);
+        if (unit >= job->unit_count)
+            break;
+
+        first = unit * job->unit_pieces;
+        last = first + job->unit_pieces;
+        if (last > map->piece_count)
+            last = map->piece_count;
+        start = first * map->piece_length;
+        end = last * map->piece_length < total ? last * map->piece_length : total;
+
+        buffer = pool_get(&job->pool);
+        if (buffer == NULL) {
+            hash_fail(job, "out of memory for", "piece buffer");
+            break;
+        }
+        if (read_span(worker, start, end, buffer) == 0) {
+            /* each digest lands at its piece index, so completion order doesn't matter */
+            for (long long int piece = first; piece < last; piece++) {
+                long long int offset = (piece - first) * map->piece_length;
+                long long int length = end - start - offset < map->piece_length ? end - start - offset : map->piece_length;
+                SHA_CTX ctx;
+
+                SHAInit(&ctx);
+                SHAUpdate(&ctx, (unsigned char *) buffer + offset, (int) length);
+                SHAFinal(job->pieces + piece * 20, &ctx);
+            }
+        }
+        pool_put(&job->pool, buffer);
+    }
+
+    if (worker->cached_fd >= 0)
+        close(worker->cached_fd);
+    return NULL;
+}
+
+static int hash_pieces(const struct content_list *content, const struct piece_map *map,
+                       unsigned char *pieces, int threads, char *errbuf)
+{
+    struct hash_job job;
+    struct hash_worker *workers;
+    int started = 0;
+
+    job.content = content;
+    job.map = map;
+    job.pieces = pieces;
+    job.unit_pieces = map->piece_length >= READ_UNIT_SIZE ? 1 : READ_UNIT_SIZE / map->piece_length;
+    job.unit_count = (map->piece_count + job.unit_pieces - 1) / job.unit_pieces;
+    job.next_unit = 0;
+    job.failed = 0;
+    pool_init(&job.pool, threads, (size_t) (job.unit_pieces * map->piece_length));
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (threads > job.unit_count)
+        threads = (int) job.unit_count;
+    workers = malloc(sizeof(struct hash_worker) * (threads > 0 ? threads : 1));
+    for (int i = 0; i < threads; i++) {
+        workers[i].job = &job;
+        workers[i].cached_file = -1;
+        workers[i].cached_fd = -1;
+        if (pthread_create(&workers[i].thread, NULL, hash_worker_main, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    if (started == 0 && threads > 0) {
+        /* no threads available, hash on the calling thread */
+        workers[0].job = &job;
+        workers[0].cached_file = -1;
+        workers[0].cached_fd = -1;
+        hash_worker_main(&workers[0]);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+    pool_destroy(&job.pool);
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.failed) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s", job.errbuf);
+        return 1;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+   METAINFO ASSEMBLY
+   ------------------------------------------------------------------------- */
+static struct benc_entity *string_entity(const char *str)
+{
+    return benc_new_string((int) strlen(str), strdup(str));
+}
+
+static struct benc_entity *build_metainfo(const struct content_list *content, const char *name, int single_file,
+                                          long long int piece_length, unsigned char *pieces, long long int piece_count,
+                                          const struct create_options *options)
+{
+    struct benc_entity *root = benc_new_dictionary();
+    struct benc_entity *info = benc_new_dictionary();
+
+    if (single_file) {
+        benc_set_dictionary(info, "length", benc_new_integer(content->files[0].length));
+    } else {
+        struct benc_entity *files = benc_new_list();
+        for (int i = 0; i < content->count; i++) {
+            struct benc_entity *file = benc_new_dictionary();
+            struct benc_entity *path = benc_new_list();
+            for (int j = 0; j < content->files[i].component_count; j++)
+                benc_append_list(path, string_entity(content->files[i].components[j]));
+            benc_set_dictionary(file, "length", benc_new_integer(content->files[i].length));
+            benc_set_dictionary(file, "path", path);
+            benc_append_list(files, file);
+        }
+        benc_set_dictionary(info, "files", files);
+    }
+    benc_set_dictionary(info, "name", string_entity(name));
+    benc_set_dictionary(info, "piece length", benc_new_integer(piece_length));
+    benc_set_dictionary(info, "pieces", benc_new_string((int) (piece_count * 20), (char *) pieces));
+    if (options->private_flag)
+        benc_set_dictionary(info, "private", benc_new_integer(1));
+    benc_set_dictionary(root, "info", info);
+
+    if (options->announce_count > 0)
+        benc_set_dictionary(root, "announce", string_entity(options->announces[0]));
+    if (options->announce_count > 1) {
+        struct benc_entity *announce_list = benc_new_list();
+        for (int i = 0; i < options->announce_count; i++) {
+            struct benc_entity *tier = benc_new_list();
+            benc_append_list(tier, string_entity(options->announces[i]));
+            benc_append_list(announce_list, tier);
+        }
+        benc_set_dictionary(root, "announce-list", announce_list);
+    }
+    if (options->comment)
+        benc_set_dictionary(root, "comment", string_entity(options->comment));
+    benc_set_dictionary(root, "created by", string_entity("dumptorrent/" DUMPTORRENT_VERSION));
+    benc_set_dictionary(root, "creation date", benc_new_integer((long long int) time(NULL)));
+    return root;
+}
+
+char *create_torrent_name(const char *path, char *errbuf)
+{
+    char *resolved = realpath(path, NULL), *name;
+
+    if (resolved == NULL) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't stat %s", path);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        return NULL;
+    }
+    /* realpath() leaves no ".", ".." or trailing '/', except in "/" itself */
+    while (strlen(resolved) > 1 && resolved[strlen(resolved) - 1] == '/')
+        resolved[strlen(resolved) - 1] = '\0';
+    name = strrchr(resolved, '/') ? strrchr(resolved, '/') + 1 : resolved;
+    if (*name == '\0') {
+        snprintf(errbuf, ERRBUF_SIZE, "%s has no name to give the torrent", path);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        free(resolved);
+        return NULL;
+    }
+    name = strdup(name);
+    free(resolved);
+    return name;
+}
+
+int create_torrent(const char *path, const char *output, const struct create_options *options,
+                   unsigned char *info_hash, char *errbuf)
+{
+    struct content_list content = {NULL, 0, 0};
+    struct piece_map *map;
+    struct benc_entity *root;
+    struct stat st;
+    long long int *lengths, total_length = 0, piece_length;
+    unsigned char *pieces;
+    char *base, *name;
+    int single_file, threads, fd, retval = 1;
+
+    if (options->piece_length > CREATE_MAX_PIECE_LENGTH) {
+        snprintf(errbuf, ERRBUF_SIZE, "piece length above %d", CREATE_MAX_PIECE_LENGTH);
+        return 1;
+    }
+
+    name = create_torrent_name(path, errbuf);
+    if (name == NULL)
+        return 1;
+    base = strdup(path);
+    while (strlen(base) > 1 && base[strlen(base) - 1] == '/')
+        base[strlen(base) - 1] = '\0';
+
+    if (stat(base, &st) != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't stat %s", path);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        free(base);
+        free(name);
+        return 1;
+    }
+    single_file = S_ISREG(st.st_mode);
+    if (single_file) {
+        add_content_file(&content, base, &name, 1, (long long int) st.st_size);
+    } else if (S_ISDIR(st.st_mode)) {
+        int max_depth = 16;
+        char **components = malloc(sizeof(char *) * max_depth);
+        int failed = walk_directory(&content, base, &components, 0, &max_depth, errbuf);
+        free(components);
+        if (failed)
+            goto out;
+    }
+
+    lengths = malloc(sizeof(long long int) * (content.count > 0 ? content.count : 1));
+    for (int i = 0; i < content.count; i++) {
+        lengths[i] = content.files[i].length;
+        total_length += lengths[i];
+    }
+    if (total_length == 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "no content to hash in %s", path);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        free(lengths);
+        goto out;
+    }
+
+    piece_length = options->piece_length > 0 ? options->piece_length : pick_piece_length(total_length);
+    map = piece_map_new(lengths, content.count, piece_length);
+    free(lengths);
+
+    threads = options->threads > 0 ? options->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    pieces = malloc(map->piece_count * 20 + 1);
+    pieces[map->piece_count * 20] = '\0';
+    if (hash_pieces(&content, map, pieces, threads, errbuf) != 0) {
+        free(pieces);
+        piece_map_free(map);
+        goto out;
+    }
+
+    root = build_metainfo(&content, name, single_file, piece_length, pieces, map->piece_count, options);
+    piece_map_free(map);
+    benc_sha1_entity(benc_lookup_string(root, "info"), info_hash);
+
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't create %s", output);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+    } else {
+        retval = benc_encode_fd(root, fd, errbuf);
+        if (close(fd) != 0 && retval == 0) {
+            snprintf(errbuf, ERRBUF_SIZE, "write error: %s", strerror(errno));
+            retval = 1;
+        }
+    }
+    benc_free_entity(root);
+
+out:
+    free_content(&content);
+    free(base);
+    free(name);
+    return retval;
+}
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "common.h"
+#include "benc.h"
+#include "filetree.h"
+
+/* -------------------------------------------------------------------------
+   HASHING HELPERS
+   ------------------------------------------------------------------------- */
+static uint32_t hash_bytes(const char *str, int length)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (int i = 0; i < length; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_child(int parent, int name)
+{
+    uint32_t h = (uint32_t) parent * 2654435761u;
+    h ^= (uint32_t) name + 0x9e3779b9u + (h << 6) + (h >> 2);
+    return h;
+}
+
+static int *new_slots(int count)
+{
+    return (int *) calloc((size_t) count, sizeof(int));
+}
+
+/* -------------------------------------------------------------------------
+   NAME INTERNING
+   ------------------------------------------------------------------------- */
+static void grow_name_slots(struct file_tree *tree)
+{
+    int new_mask = tree->name_slot_mask * 2 + 1;
+    int *slots = new_slots(new_mask + 1);
+
+    for (int i = 0; i < tree->name_count; i++) {
+        uint32_t pos = hash_bytes(tree->names[i].str, tree->names[i].length) & new_mask;
+        while (slots[pos])
+            pos = (pos + 1) & new_mask;
+        slots[pos] = i + 1;
+    }
+    free(tree->name_slots);
+    tree->name_slots = slots;
+    tree->name_slot_mask = new_mask;
+}
+
+static int intern_name(struct file_tree *tree, const char *str, int length)
+{
+    uint32_t pos = hash_bytes(str, length) & tree->name_slot_mask;
+
+    while (tree->name_slots[pos]) {
+        struct file_tree_name *name = &tree->names[tree->name_slots[pos] - 1];
+        if (name->length == length && memcmp(name->str, str, length) == 0)
+            return tree->name_slots[pos] - 1;
+        pos = (pos + 1) & tree->name_slot_mask;
+    }
+
+    if (tree->name_count == tree->name_capacity) {
+        tree->name_capacity *= 2;
+        tree->names = realloc(tree->names, sizeof(struct file_tree_name) * tree->name_capacity);
+    }
+    tree->names[tree->name_count].str = str;
+    tree->names[tree->name_count].length = length;
+    tree->name_slots[pos] = ++tree->name_count;
+
+    /* keep the load factor under one half */
+    if (tree->name_count * 2 > tree->name_slot_mask)
+        grow_name_slots(tree);
+    return tree->name_count - 1;
+}
+
+/* -------------------------------------------------------------------------
+   TRIE NODES
+   ------------------------------------------------------------------------- */
+static void grow_child_slots(struct file_tree *tree)
+{
+    int new_mask = tree->child_slot_mask * 2 + 1;
+    int *slots = new_slots(new_mask + 1);
+
+    for (int i = 1; i < tree->node_count; i++) {
+        uint32_t pos = hash_child(tree->nodes[i].parent, tree->nodes[i].name) & new_mask;
+        while (slots[pos])
+            pos = (pos + 1) & new_mask;
+        slots[pos] = i + 1;
+    }
+    free(tree->child_slots);
+    tree->child_slots = slots;
+    tree->child_slot_mask = new_mask;
+}
+
+static int new_node(struct file_tree *tree, int parent, int name)
+{
+    struct file_tree_node *node;
+
+    if (tree->node_count == tree->node_capacity) {
+        tree->node_capacity *= 2;
+        tree->nodes = realloc(tree->nodes, sizeof(struct file_tree_node) * tree->node_capacity);
+    }
+    node = &tree->nodes[tree->node_count];
+    node->name = name;
+    node->parent = parent;
+    node->first_child = node->last_child = node->next_sibling = -1;
+    node->depth = parent < 0 ? 0 : tree->nodes[parent].depth + 1;
+    node->is_dir = 0;
+    node->size = 0;
+    node->file_count = 0;
+
+    if (parent >= 0) {
+        struct file_tree_node *p = &tree->nodes[parent];
+        if (p->last_child < 0)
+            p->first_child = tree->node_count;
+        else
+            tree->nodes[p->last_child].next_sibling = tree->node_count;
+        p->last_child = tree->node_count;
+    }
+    return tree->node_count++;
+}
+
+/* Find the child of parent called name, creating it if needed. */
+static int lookup_child(struct file_tree *tree, int parent, int name)
+{
+    uint32_t pos = hash_child(parent, name) & tree->child_slot_mask;
+    int index;
+
+    while (tree->child_slots[pos]) {
+        struct file_tree_node *node = &tree->nodes[tree->child_slots[pos] - 1];
+        if (node->parent == parent && node->name == name)
+            return tree->child_slots[pos] - 1;
+        pos = (pos + 1) & tree->child_slot_mask;
+    }
+
+    index = new_node(tree, parent, name);
+    tree->child_slots[pos] = index + 1;
+    if (tree->node_count * 2 > tree->child_slot_mask)
+        grow_child_slots(tree);
+    return index;
+}
+
+/* -------------------------------------------------------------------------
+   PUBLIC API
+   ------------------------------------------------------------------------- */
+struct file_tree *file_tree_build(struct benc_entity *files, struct benc_entity *root_name, char *errbuf)
+{
+    struct file_tree *tree;
+    int root;
+
+    if (files == NULL || files->type != BENC_LIST) {
+        snprintf(errbuf, ERRBUF_SIZE, "info.files is not a list");
+        return NULL;
+    }
+
+    tree = (struct file_tree *) malloc(sizeof(struct file_tree));
+    tree->node_count = tree->name_count = 0;
+    tree->node_capacity = tree->name_capacity = 64;
+    tree->nodes = malloc(sizeof(struct file_tree_node) * tree->node_capacity);
+    tree->names = malloc(sizeof(struct file_tree_name) * tree->name_capacity);
+    tree->name_slot_mask = tree->child_slot_mask = 127;
+    tree->name_slots = new_slots(tree->name_slot_mask + 1);
+    tree->child_slots = new_slots(tree->child_slot_mask + 1);
+
+    root = new_node(tree, -1, intern_name(tree, root_name->string.str, root_name->string.length));
+    tree->nodes[root].is_dir = 1;
+
+    for (struct benc_entity *file = files->list.head; file != NULL; file = file->next) {
+        struct benc_entity *path, *length;
+        int node = root;
+
+        if (file->type != BENC_DICTIONARY ||
+            (path = benc_lookup_string(file, "path")) == NULL || path->type != BENC_LIST ||
+            (length = benc_lookup_string(file, "length")) == NULL || length->type != BENC_INTEGER) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid file structure.");
+            file_tree_free(tree);
+            return NULL;
+        }
+
+        for (struct benc_entity *component = path->list.head; component != NULL; component = component->next) {
+            if (component->type != BENC_STRING) {
+                snprintf(errbuf, ERRBUF_SIZE, "path list item is not string");
+                file_tree_free(tree);
+                return NULL;
+            }
+            tree->nodes[node].is_dir = 1;
+            node = lookup_child(tree, node, intern_name(tree, component->string.str, component->string.length));
+        }
+
+        /* credit the file to every directory on its path */
+        for (; node >= 0; node = tree->nodes[node].parent) {
+            tree->nodes[node].size += length->integer;
+            tree->nodes[node].file_count++;
+        }
+    }
+
+    return tree;
+}
+
+void file_tree_free(struct file_tree *tree)
+{
+    free(tree->nodes);
+    free(tree->names);
+    free(tree->name_slots);
+    free(tree->child_slots);
+    free(tree);
+}
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "http.h"
+
+static void inflater_free(struct http_response *response)
+{
+#ifdef HAVE_ZLIB
+    if (response->inflater) {
+        inflateEnd(response->inflater);
+        free(response->inflater);
+    }
+#endif
+    response->inflater = NULL;
+}
+
+void http_response_init(struct http_response *response)
+{
+    memset(response, 0, sizeof(*response));
+    http_response_reset(response);
+}
+
+void http_response_reset(struct http_response *response)
+{
+    response->state = HTTP_STATUS_LINE;
+    response->status = 0;
+    response->version_minor = 0;
+    response->keep_alive = 0;
+    response->chunked = 0;
+    response->compressed = 0;
+    inflater_free(response);
+    response->content_length = -1;
+    response->remaining = 0;
+    response->line_length = 0;
+    response->body_length = 0;
+    response->error = NULL;
+}
+
+void http_response_free(struct http_response *response)
+{
+    inflater_free(response);
+    free(response->body);
+    response->body = NULL;
+    response->body_capacity = 0;
+}
+
+static int fail(struct http_response *response, const char *error)
+{
+    response->error = error;
+    return -1;
+}
+
+/* Room for length more bytes of body, plus the NUL. */
+static int body_reserve(struct http_response *response, int length)
+{
+    if (response->body_length + length > HTTP_MAX_BODY)
+        return fail(response, "response body too large");
+    if (response->body_length + length + 1 > response->body_capacity) {
+        while (response->body_length + length + 1 > response->body_capacity)
+            response->body_capacity = response->body_capacity ? response->body_capacity * 2 : 4096;
+        response->body = realloc(response->body, response->body_capacity);
+    }
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+static int body_inflate(struct http_response *response, const char *data, int length)
+{
+    z_stream *stream = response->inflater;
+    int status = Z_OK;
+
+    if (stream == NULL) {
+        stream = calloc(1, sizeof(z_stream));
+        /* 15 + 32: zlib or gzip header, detected automatically */
+        if (inflateInit2(stream, 15 + 32) != Z_OK) {
+            free(stream);
+            return fail(response, "cannot initialize zlib");
+        }
+        response->inflater = stream;
+    }
+
+    stream->next_in = (Bytef *) data;
+    stream->avail_in = length;
+    while (stream->avail_in > 0 && status != Z_STREAM_END) {
+        /* inflate into whatever the buffer has left, growing it as needed */
+        if (body_reserve(response, 4096) != 0)
+            return -1;
+        stream->next_out = (Bytef *) response->body + response->body_length;
+        stream->avail_out = response->body_capacity - response->body_length - 1;
+        status = inflate(stream, Z_NO_FLUSH);
+        response->body_length = (int) ((char *) stream->next_out - response->body);
+        response->body[response->body_length] = '\0';
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+            return fail(response, "bad compressed body");
+        if (response->body_length > HTTP_MAX_BODY)
+            return fail(response, "response body too large");
+    }
+    return 0;
+}
+#endif
+
+static int body_append(struct http_response *response, const char *data, int length)
+{
+#ifdef HAVE_ZLIB
+    if (response->compressed)
+        return body_inflate(response, data, length);
+#endif
+    if (body_reserve(response, length) != 0)
+        return -1;
+    memcpy(response->body + response->body_length, data, length);
+    response->body_length += length;
+    response->body[response->body_length] = '\0';
+    return 0;
+}
+
+/* The whole body is in: a compressed one must have ended too. */
+static int body_done(struct http_response *response)
+{
+    response->state = HTTP_DONE;
+#ifdef HAVE_ZLIB
+    if (response->inflater && inflate(response->inflater, Z_FINISH) != Z_STREAM_END)
+        return fail(response, "truncated compressed body");
+#endif
+    return 0;
+}
+
+/* Does the comma-separated header value contain token (case-insensitive)? */
+static int has_token(const char *value, const char *token)
+{
+    size_t length = strlen(token);
+
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        if (strncasecmp(value, token, length) == 0 &&
+            (value[length] == '\0' || value[length] == ',' || value[length] == ' ' || value[length] == ';'))
+            return 1;
+        while (*value && *value != ',')
+            value++;
+    }
+    return 0;
+}
+
+/* The blank line after the headers: decide how the body is framed. */
+static int headers_done(struct http_response *response)
+{
+    /* 1xx interim responses are followed by the real one */
+    if (response->status >= 100 && response->status < 200) {
+        response->state = HTTP_STATUS_LINE;
+        response->chunked = 0;
+        response->content_length = -1;
+        return 0;
+    }
+    if (response->status == 204 || response->status == 304)
+        response->state = HTTP_DONE;
+    else if (response->chunked)
+        response->state = HTTP_CHUNK_SIZE;
+    else if (response->content_length >= 0) {
+        response->remaining = response->content_length;
+        response->state = response->remaining > 0 ? HTTP_BODY : HTTP_DONE;
+    }
+    else {
+        response->state = HTTP_BODY_UNTIL_CLOSE;
+        response->keep_alive = 0;
+    }
+    return 0;
+}
+
+/* One complete line, without its line ending. */
+static int parse_line(struct http_response *response, char *line, int length)
+{
+    char *colon, *value, *end;
+
+    switch (response->state) {
+    case HTTP_STATUS_LINE:
+        /* RFC 7230 3.5: ignore stray empty lines before the status line */
+        if (length == 0)
+            return 0;
+        if (length < 12 || strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) line[7]) ||
+            line[8] != ' ' || !isdigit((unsigned char) line[9]) || !isdigit((unsigned char) line[10]) ||
+            !isdigit((unsigned char) line[11]))
+            return fail(response, "bad HTTP status line");
+        response->version_minor = line[7] - '0';
+        response->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+        response->keep_alive = response->version_minor >= 1;
+        response->state = HTTP_HEADER_LINE;
+        return 0;
+
+    case HTTP_HEADER_LINE:
+        if (length == 0)
+            return headers_done(response);
+        colon = memchr(line, ':', length);
+        if (colon == NULL)
+            return fail(response, "bad HTTP header line");
+        *colon = '\0';
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+            ;
+        for (end = line + length; end > value && (end[-1] == ' ' || end[-1] == '\t'); end--)
+            ;
+        *end = '\0';
+
+        if (strcasecmp(line, "Content-Length") == 0) {
+            response->content_length = strtoll(value, &end, 10);
+            if (end == value || *end != '\0' || response->content_length < 0)
+                return fail(response, "bad Content-Length");
+        }
+        else if (strcasecmp(line, "Transfer-Encoding") == 0)
+            response->chunked = has_token(value, "chunked");
+        else if (strcasecmp(line, "Content-Encoding") == 0) {
+            response->compressed = has_token(value, "gzip") || has_token(value, "x-gzip") ||
+                                   has_token(value, "deflate");
+#ifndef HAVE_ZLIB
+            if (response->compressed)
+                return fail(response, "compressed body, built without zlib");
+#endif
+            if (!response->compressed && *value != '\0' && !has_token(value, "identity"))
+                return fail(response, "unsupported Content-Encoding");
+        }
+        else if (strcasecmp(line, "Connection") == 0) {
+            if (has_token(value, "close"))
+                response->keep_alive = 0;
+            else if (has_token(value, "keep-alive"))
+                response->keep_alive = 1;
+        }
+        return 0;
+
+    case HTTP_CHUNK_SIZE:
+        /* hex size, optionally followed by ";extensions" */
+        response->remaining = strtoll(line, &end, 16);
+        if (end == line || response->remaining < 0 || (*end != '\0' && *end != ';' && *end != ' '))
+            return fail(response, "bad chunk size");
+        response->state = response->remaining > 0 ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+        return 0;
+
+    case HTTP_CHUNK_DATA_END:
+        if (length != 0)
+            return fail(response, "missing CRLF after chunk");
+        response->state = HTTP_CHUNK_SIZE;
+        return 0;
+
+    case HTTP_TRAILER:
+        if (length == 0)
+            return body_done(response);
+        return 0;
+    }
+    return 0;
+}
+
+int http_response_feed(struct http_response *response, const char *data, int length)
+{
+    int used = 0;
+
+    while (used < length && response->state != HTTP_DONE) {
+        const char *lf;
+        int take;
+
+        if (response->state == HTTP_BODY || response->state == HTTP_CHUNK_DATA ||
+            response->state == HTTP_BODY_UNTIL_CLOSE) {
+            take = length - used;
+            if (response->state != HTTP_BODY_UNTIL_CLOSE && take > response->remaining)
+                take = (int) response->remaining;
+            if (body_append(response, data + used, take) != 0)
+                return -1;
+            used += take;
+            if (response->state == HTTP_BODY_UNTIL_CLOSE)
+                continue;
+            response->remaining -= take;
+            if (response->remaining == 0) {
+                if (response->state == HTTP_CHUNK_DATA)
+                    response->state = HTTP_CHUNK_DATA_END;
+                else if (body_done(response) != 0)
+                    return -1;
+            }
+            continue;
+        }
+
+        /* line-oriented states: gather bytes up to the LF */
+        lf = memchr(data + used, '\n', length - used);
+        take = lf ? (int) (lf - (data + used)) + 1 : length - used;
+        if (response->line_length + take > HTTP_MAX_LINE)
+            return fail(response, "HTTP line too long");
+        memcpy(response->line + response->line_length, data + used, take);
+        response->line_length += take;
+        used += take;
+        if (lf == NULL)
+            break;
+
+        /* strip LF and an optional CR; the line buffer always has room for the NUL */
+        take = response->line_length - 1;
+        if (take > 0 && response->line[take - 1] == '\r')
+            take--;
+        response->line[take] = '\0';
+        response->line_length = 0;
+        if (parse_line(response, response->line, take) != 0)
+            return -1;
+    }
+    return used;
+}
+
+int http_response_eof(struct http_response *response)
+{
+    if (response->state == HTTP_BODY_UNTIL_CLOSE)
+        return body_done(response);
+    if (response->state == HTTP_DONE)
+        return 0;
+    return fail(response, "connection closed before the response was complete");
+}
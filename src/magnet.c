@@ -1,111 +1,264 @@
 #include <string.h>
-#include <stdlib.h>
+#include <strings.h>
 #include <stdio.h>
-#include <ctype.h>
-#include "magnet.h"
 #include "common.h"
-#include <ctype.h>
-
-/**
- * unsigned char infohash_out[20],
- *
- * @param uri The magnet URI to parse.
- * @param out_infohash A buffer to store the 20-byte infohash extracted from the URI.
- * @param trackers_out A pointer to an array of tracker URLs extracted from the URI.
- *                      The caller is responsible for freeing this array.
- * @param tracker_count_out A pointer to an integer to store the number of trackers found.
- * @param display_name_out A buffer to store the display name (dn=...) if present.
- * @param errbuf A buffer to store error messages in case of failure.
- *               Must be at least ERRBUF_SIZE bytes long.
- * @return 0 on success, or 1 if an error occurred (error message will be in errbuf).
- */
- char *urldecode(const char *src);
-
- int parse_magnet_uri(const char *uri, unsigned char out_infohash[20], char ***trackers_out, int *tracker_count_out, char *display_name_out, char *errbuf) {
-    if (!uri) {
-        snprintf(errbuf, ERRBUF_SIZE, "URI is NULL");
-        return 1;
+#include "magnet.h"
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* RFC 4648 alphabet; magnet links use either case */
+static int base32_value(int c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a';
+    if (c >= '2' && c <= '7')
+        return c - '2' + 26;
+    return -1;
+}
+
+/* Exactly size * 2 hex digits into size bytes; 0 if the text is anything else. */
+static int decode_hex(const char *text, int length, unsigned char *out, int size)
+{
+    if (length != size * 2)
+        return 0;
+    for (int i = 0; i < size; i++) {
+        int high = hex_value(text[i * 2]), low = hex_value(text[i * 2 + 1]);
+
+        if (high < 0 || low < 0)
+            return 0;
+        out[i] = (unsigned char) (high << 4 | low);
     }
-    if (strncmp(uri, "magnet:?", 8) != 0) {
-        snprintf(errbuf, ERRBUF_SIZE, "Not a magnet URI: %s", uri);
-        return 1;
+    return 1;
+}
+
+/* 32 base32 digits, no padding, into 20 bytes. */
+static int decode_base32(const char *text, int length, unsigned char *out)
+{
+    unsigned int bits = 0;
+    int bit_count = 0, count = 0;
+
+    if (length != 32)
+        return 0;
+    for (int i = 0; i < 32; i++) {
+        int value = base32_value(text[i]);
+
+        if (value < 0)
+            return 0;
+        bits = (bits << 5 | (unsigned int) value) & 0xffff;
+        bit_count += 5;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            out[count++] = (unsigned char) (bits >> bit_count);
+        }
     }
+    return 1;
+}
 
-    char *copy = strdup(uri + 8); // skip "magnet:?"
-    if (!copy) {
-        snprintf(errbuf, ERRBUF_SIZE, "Out of memory");
+/* Is the key name, or name.<n>? */
+static int key_is(const char *key, int length, const char *name)
+{
+    int name_length = (int) strlen(name);
+
+    if (length < name_length || memcmp(key, name, name_length) != 0)
+        return 0;
+    if (length == name_length)
         return 1;
+    if (key[name_length] != '.' || length == name_length + 1)
+        return 0;
+    for (int i = name_length + 1; i < length; i++) {
+        if (key[i] < '0' || key[i] > '9')
+            return 0;
+    }
+    return 1;
+}
+
+static int parse_topic(struct magnet *magnet, const char *value, int length, char *errbuf)
+{
+    struct magnet_topic topic;
+    unsigned char multihash[34];
+
+    if (length > 9 && strncasecmp(value, "urn:btih:", 9) == 0) {
+        topic.type = MAGNET_BTIH;
+        if (!decode_hex(value + 9, length - 9, topic.hash, 20) &&
+            !decode_base32(value + 9, length - 9, topic.hash)) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid btih: need 40 hex or 32 base32 digits");
+            return 1;
+        }
+    } else if (length > 9 && strncasecmp(value, "urn:btmh:", 9) == 0) {
+        /* sha2-256 (0x12) of 32 bytes (0x20), the one multihash BEP 52 uses */
+        if (!decode_hex(value + 9, length - 9, multihash, 34) || multihash[0] != 0x12 || multihash[1] != 0x20) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid btmh: need a sha2-256 multihash, \"1220\" and 64 hex digits");
+            return 1;
+        }
+        topic.type = MAGNET_BTMH;
+        memcpy(topic.hash, multihash + 2, 32);
+    } else {
+        /* another network's topic (ed2k, sha1...) */
+        return 0;
+    }
+    if (magnet->topic_count < MAGNET_MAX_TOPICS)
+        magnet->topics[magnet->topic_count++] = topic;
+    return 0;
+}
+
+/* so=: indexes and ranges, "0,2,4-6" */
+static int valid_selection(const char *value, int length)
+{
+    int digits = 0, range = 0;
+
+    for (int i = 0; i < length; i++) {
+        char c = value[i];
+
+        if (c >= '0' && c <= '9') {
+            /* keeps magnet_selected() clear of overflow */
+            if (++digits > 18)
+                return 0;
+            continue;
+        }
+        if (digits == 0 || (c != ',' && c != '-') || (c == '-' && range))
+            return 0;
+        range = c == '-';
+        digits = 0;
     }
+    return digits > 0;
+}
 
-    char *saveptr;
-    char *param = strtok_r(copy, "&", &saveptr);
+static void add_view(struct magnet_view *views, int *count, const char *data, int length)
+{
+    if (*count < MAGNET_MAX_ITEMS) {
+        views[*count].data = data;
+        views[*count].length = length;
+        (*count)++;
+    }
+}
 
-    int tracker_count = 0;
-    char **trackers = NULL;
-    display_name_out[0] = '\0'; // empty by default
+int magnet_parse(struct magnet *magnet, const char *uri, char *errbuf)
+{
+    const char *param;
 
-    while (param) {
-        char *eq = strchr(param, '=');
-        if (!eq) {
-            snprintf(errbuf, ERRBUF_SIZE, "Malformed param: %s", param);
-            free(copy);
+    memset(magnet, 0, sizeof(*magnet));
+    magnet->length = -1;
+    if (strncmp(uri, "magnet:?", 8) != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "not a magnet URI");
+        return 1;
+    }
+
+    for (param = uri + 8; *param != '\0';) {
+        const char *end = param, *equals = NULL, *value;
+        int key_length, length;
+
+        for (; *end != '\0' && *end != '&'; end++) {
+            if (*end == '=' && equals == NULL)
+                equals = end;
+        }
+        if (end == param) {
+            param++;
+            continue;
+        }
+        if (equals == NULL) {
+            snprintf(errbuf, ERRBUF_SIZE, "malformed parameter: %.*s", (int) (end - param > 40 ? 40 : end - param),
+                     param);
             return 1;
         }
+        key_length = (int) (equals - param);
+        value = equals + 1;
+        length = (int) (end - value);
 
-        *eq = '\0';
-        const char *key = param;
-        const char *value = eq + 1;
-
-        if (strcmp(key, "xt") == 0 && strncmp(value, "urn:btih:", 9) == 0) {
-            const char *hash = value + 9;
-            if (strlen(hash) == 40) {
-                for (int i = 0; i < 20; i++) {
-                    sscanf(hash + 2 * i, "%2hhx", &out_infohash[i]);
-                }
-            } else {
-                snprintf(errbuf, ERRBUF_SIZE, "Invalid infohash length");
-                free(copy);
+        if (key_is(param, key_length, "xt")) {
+            if (parse_topic(magnet, value, length, errbuf) != 0)
+                return 1;
+        } else if (key_is(param, key_length, "dn")) {
+            magnet->name.data = value;
+            magnet->name.length = length;
+        } else if (key_is(param, key_length, "xl")) {
+            magnet->length = length > 0 && length <= 18 ? 0 : -1;
+            for (int i = 0; i < length && magnet->length >= 0; i++)
+                magnet->length = value[i] >= '0' && value[i] <= '9' ? magnet->length * 10 + (value[i] - '0') : -1;
+        } else if (key_is(param, key_length, "tr")) {
+            add_view(magnet->trackers, &magnet->tracker_count, value, length);
+        } else if (key_is(param, key_length, "x.pe")) {
+            add_view(magnet->peers, &magnet->peer_count, value, length);
+        } else if (key_is(param, key_length, "ws")) {
+            add_view(magnet->web_seeds, &magnet->web_seed_count, value, length);
+        } else if (key_is(param, key_length, "so")) {
+            if (!valid_selection(value, length)) {
+                snprintf(errbuf, ERRBUF_SIZE, "invalid so= selection: %.*s", length > 40 ? 40 : length, value);
                 return 1;
             }
-        } else if (strcmp(key, "tr") == 0) {
-            char *decoded = urldecode(value);
-            trackers = realloc(trackers, sizeof(char *) * (tracker_count + 1));
-            trackers[tracker_count++] = decoded;           
-        }  else if (strcmp(key, "dn") == 0) {
-            char *decoded = urldecode(value);
-            strncpy(display_name_out, decoded, ERRBUF_SIZE - 1);
-            display_name_out[ERRBUF_SIZE - 1] = '\0';
-            free(decoded);
+            magnet->select.data = value;
+            magnet->select.length = length;
         }
-
-        param = strtok_r(NULL, "&", &saveptr);
+        param = *end != '\0' ? end + 1 : end;
     }
 
-    free(copy);
-    *trackers_out = trackers;
-    *tracker_count_out = tracker_count;
-
+    for (int i = 0; i < magnet->topic_count; i++) {
+        if (magnet->topics[i].type == MAGNET_BTIH) {
+            memcpy(magnet->info_hash, magnet->topics[i].hash, 20);
+            return 0;
+        }
+    }
+    if (magnet->topic_count == 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "no btih or btmh topic (xt=) in magnet URI");
+        return 1;
+    }
+    /* a v2-only torrent: trackers know it by the truncated hash */
+    memcpy(magnet->info_hash, magnet->topics[0].hash, 20);
     return 0;
 }
 
-char *urldecode(const char *src) {
-    char *out = malloc(strlen(src) + 1);
-    char *dst = out;
-
-    while (*src) {
-        if (*src == '%' && isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2])) {
-            int high = src[1] > '9' ? tolower(src[1]) - 'a' + 10 : src[1] - '0';
-            int low  = src[2] > '9' ? tolower(src[2]) - 'a' + 10 : src[2] - '0';
-            *dst++ = (char)((high << 4) | low);
-            src += 3;
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
+int magnet_decode(const struct magnet_view *view, char *out, int size)
+{
+    int length = 0;
+
+    for (int i = 0; i < view->length; i++) {
+        char c = view->data[i];
+
+        if (c == '+')
+            c = ' ';
+        else if (c == '%' && i + 2 < view->length && hex_value(view->data[i + 1]) >= 0 &&
+                 hex_value(view->data[i + 2]) >= 0) {
+            c = (char) (hex_value(view->data[i + 1]) << 4 | hex_value(view->data[i + 2]));
+            i += 2;
         }
+        if (length < size - 1)
+            out[length] = c;
+        length++;
     }
+    if (size > 0)
+        out[length < size - 1 ? length : size - 1] = '\0';
+    return length;
+}
 
-    *dst = '\0';
-    return out;
+int magnet_selected(const struct magnet *magnet, long long int index)
+{
+    const char *ptr = magnet->select.data, *end = ptr + magnet->select.length;
+
+    if (ptr == NULL)
+        return 1;
+    while (ptr < end) {
+        long long int first = 0, last;
+
+        for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++)
+            first = first * 10 + (*ptr - '0');
+        last = first;
+        if (ptr < end && *ptr == '-') {
+            for (last = 0, ptr++; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++)
+                last = last * 10 + (*ptr - '0');
+        }
+        if (index >= first && index <= last)
+            return 1;
+        ptr++; /* the comma */
+    }
+    return 0;
 }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <time.h>
 #include <string.h>
 #include <stdio.h>
@@ -8,8 +9,14 @@
 #include "common.h"
 #include "benc.h"
 #include "scrapec.h"
+#include "scrape_engine.h"
 #include "torrent.h"
 #include "magnet.h"
+#include "metadata.h"
+#include "create.h"
+#include "conncache.h"
+#include "scrapecache.h"
+#include "trackerhealth.h"
 
 /* -------------------------------------------------------------------------
     VERSION DEFINITION
@@ -21,12 +28,44 @@
 int   option_output   = OUTPUT_DEFAULT;
 char *option_field    = NULL;
 int          option_timeout  = 0;
+int          option_udp_retries = SCRAPE_UDP_DEFAULT_RETRIES;
+int          option_max_requests = SCRAPE_DEFAULT_MAX_REQUESTS;
+int          option_host_rate = SCRAPE_DEFAULT_HOST_RATE;
+int          option_first    = 0;
+int          option_announce = 0;
 char        *option_tracker  = NULL;
 char        *option_info_hash = NULL;
+int          option_tree     = 0;
+int          option_tree_depth = -1;
+char       **option_map_queries = NULL;
+int          option_map_query_count = 0;
+char        *option_set_announce = NULL;
+char       **option_add_trackers = NULL;
+int          option_add_tracker_count = 0;
+int          option_strip_comment = 0;
+int          option_set_private = 0;
+char        *option_conn_cache = NULL;
+char        *option_scrape_cache = NULL;
+char        *option_tracker_health = NULL;
+char        *option_magnets_from = NULL;
+int          option_metadata = 0;
+char       **option_peers    = NULL;
+int          option_peer_count = 0;
+int          option_max_age  = SCRAPECACHE_DEFAULT_MAX_AGE;
 
 /* -------------------------------------------------------------------------
     UTILITY FUNCTIONS
    ------------------------------------------------------------------------- */
+static void save_conn_cache(void)
+{
+    conncache_save(option_conn_cache);
+}
+
+static void save_tracker_health(void)
+{
+    trackerhealth_save(option_tracker_health);
+}
+
 static int is_magnet_uri(const char *str) {
     return strncmp(str, "magnet:?", 8) == 0;
 
@@ -76,6 +115,329 @@ static int do_scrapec(void)
     return 0;
 }
 
+/* -------------------------------------------------------------------------
+    MAGNET SCRAPE: every tracker of the magnet queried at once under one
+    deadline, answers printed as they arrive. Trackers see overlapping
+    swarms, so the summary gives the max and median, not a sum.
+   ------------------------------------------------------------------------- */
+struct magnet_scrape {
+    struct scrape_engine *engine;
+    struct scrape_result *answers;  /* one per tracker that knew the hash */
+    int scrape_success;
+    int stopped;                    /* --first reached, the rest is cancelled */
+};
+
+static void magnet_scrape_done(struct scrape_request *request, void *arg)
+{
+    struct magnet_scrape *state = arg;
+    struct scrape_result *result = &request->results[0];
+
+    if (state->stopped)
+        return;
+    if (request->status != 0) {
+        printf("  %s: %s\n", request->url, request->errbuf);
+    } else if (result->status != 0) {
+        printf("  %s: info hash not found in scrape response\n", request->url);
+    } else {
+        printf("                %s, (seeders=%d, completed=%d, leechers=%d)\n",
+               request->url, result->seeders, result->completed, result->leechers);
+        fflush(stdout);
+        state->answers[state->scrape_success++] = *result;
+        if (option_first > 0 && state->scrape_success >= option_first) {
+            state->stopped = 1;
+            scrape_engine_stop(state->engine);
+        }
+    }
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* "max=<n>, median=<n>" of one field of the answers; unknown (-1) values are left out */
+static void print_spread(const char *label, const struct magnet_scrape *state, size_t offset)
+{
+    int *values = malloc(sizeof(int) * state->scrape_success);
+    int count = 0, median;
+
+    for (int i = 0; i < state->scrape_success; i++) {
+        int value = *(const int *) ((const char *) &state->answers[i] + offset);
+        if (value >= 0)
+            values[count++] = value;
+    }
+    if (count == 0) {
+        free(values);
+        return;
+    }
+    qsort(values, count, sizeof(int), compare_int);
+    median = count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+    printf("  %-10s max=%d, median=%d\n", label, values[count - 1], median);
+    free(values);
+}
+
+static void scrape_magnet_trackers(char **trackers, int tracker_count, const unsigned char *infohash)
+{
+    struct scrape_engine *engine = scrape_engine_new();
+    struct scrape_request *requests = calloc(tracker_count > 0 ? tracker_count : 1, sizeof(struct scrape_request));
+    struct scrape_result *results = calloc(tracker_count > 0 ? tracker_count : 1, sizeof(struct scrape_result));
+    struct magnet_scrape state = {engine, NULL, 0, 0};
+    int timeout_ms = (option_timeout > 0 ? option_timeout : SCRAPE_DEFAULT_TIMEOUT) * 1000;
+    struct timespec start, now;
+
+    /* one deadline for all of them, UDP retransmissions included */
+    state.answers = calloc(tracker_count > 0 ? tracker_count : 1, sizeof(struct scrape_result));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < tracker_count && !state.stopped; i++) {
+        int elapsed_ms;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (int) ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        requests[i].url = trackers[i];
+        requests[i].info_hashes = (const unsigned char (*)[20]) infohash;
+        requests[i].count = 1;
+        requests[i].results = &results[i];
+        requests[i].callback = magnet_scrape_done;
+        requests[i].arg = &state;
+        scrape_engine_submit(engine, &requests[i], elapsed_ms < timeout_ms ? timeout_ms - elapsed_ms : 1);
+    }
+    if (!state.stopped)
+        scrape_engine_run(engine);
+    scrape_engine_free(engine);
+
+    if (state.scrape_success > 1) {
+        printf("\nSummary (from %d trackers):\n", state.scrape_success);
+        print_spread("seeders", &state, offsetof(struct scrape_result, seeders));
+        print_spread("completed", &state, offsetof(struct scrape_result, completed));
+        print_spread("leechers", &state, offsetof(struct scrape_result, leechers));
+    }
+    free(state.answers);
+    free(requests);
+    free(results);
+}
+
+static char *decode_view(const struct magnet_view *view)
+{
+    int length = magnet_decode(view, NULL, 0);
+    char *text = malloc(length + 1);
+
+    magnet_decode(view, text, length + 1);
+    return text;
+}
+
+static void print_views(const char *label, const struct magnet_view *views, int count)
+{
+    if (count > 0)
+        printf("%s\n", label);
+    for (int i = 0; i < count; i++) {
+        char *text = decode_view(&views[i]);
+        printf("                %s\n", text);
+        free(text);
+    }
+}
+
+/* The info dictionary from the magnet's x.pe peers and --peer ones, shown
+   as the torrent it makes with the first tracker; 1 if it can't be had. */
+static int fetch_magnet_metadata(const struct magnet *magnet)
+{
+    struct benc_buffer torrent = {NULL, 0, 0};
+    struct benc_entity *root;
+    char **peers = malloc(sizeof(char *) * (magnet->peer_count + option_peer_count + 1));
+    char *info = NULL, *announce, errbuf[ERRBUF_SIZE], number[24];
+    int peer_count = 0, info_length, btih = 0, failed;
+    int timeout_ms = (option_timeout > 0 ? option_timeout : SCRAPE_DEFAULT_TIMEOUT) * 1000;
+
+    for (int i = 0; i < magnet->topic_count; i++)
+        btih |= magnet->topics[i].type == MAGNET_BTIH;
+    for (int i = 0; i < magnet->peer_count; i++)
+        peers[peer_count++] = decode_view(&magnet->peers[i]);
+    for (int i = 0; i < option_peer_count; i++)
+        peers[peer_count++] = strdup(option_peers[i]);
+
+    printf("\nMetadata:\n");
+    if (!btih)
+        snprintf(errbuf, ERRBUF_SIZE, "ut_metadata needs a v1 info hash (btih)");
+    else
+        info = metadata_fetch(magnet->info_hash, peers, peer_count, timeout_ms, &info_length, errbuf);
+    for (int i = 0; i < peer_count; i++)
+        free(peers[i]);
+    free(peers);
+    if (info == NULL) {
+        printf("%s\n", errbuf);
+        return 1;
+    }
+
+    /* show_torrent_info() wants a whole torrent: the announce, then the info as fetched */
+    announce = magnet->tracker_count > 0 ? decode_view(&magnet->trackers[0]) : strdup("");
+    snprintf(number, sizeof(number), "%d:", (int) strlen(announce));
+    benc_buffer_append(&torrent, "d8:announce", 11);
+    benc_buffer_append(&torrent, number, (int) strlen(number));
+    benc_buffer_append(&torrent, announce, (int) strlen(announce));
+    benc_buffer_append(&torrent, "4:info", 6);
+    benc_buffer_append(&torrent, info, info_length);
+    benc_buffer_append(&torrent, "e", 1);
+    root = benc_parse_memory(torrent.data, torrent.length, NULL, errbuf);
+    failed = root == NULL || benc_lookup_string(root, "info")->type != BENC_DICTIONARY;
+    if (failed)
+        printf("fetched metadata is not an info dictionary\n");
+    else
+        show_torrent_info(root);
+    if (root != NULL)
+        benc_free_entity(root);
+    benc_buffer_free(&torrent);
+    free(announce);
+    free(info);
+    return failed;
+}
+
+/* What the magnet URI says, its metadata if asked for, then a scrape of its
+   trackers; 1 if it doesn't parse or the metadata fetch failed. */
+static int print_magnet(const char *uri)
+{
+    struct magnet magnet;
+    char errbuf[ERRBUF_SIZE];
+    char **trackers;
+    int fetch = option_metadata || option_peer_count > 0, failed = 0;
+
+    if (magnet_parse(&magnet, uri, errbuf) != 0) {
+        printf("%s: %s\n", uri, errbuf);
+        return 1;
+    }
+    if (magnet.tracker_count == 0 && !fetch) {
+        printf("%s: no tracker found in magnet URI\n", uri);
+        return 0;
+    }
+
+    if (magnet.name.data) {
+        char *name = decode_view(&magnet.name);
+        printf("Name:           %s\n", name);
+        free(name);
+    }
+    printf("Magnet URI:     %s\n", uri);
+    for (int i = 0; i < magnet.topic_count; i++) {
+        int v2 = magnet.topics[i].type == MAGNET_BTMH;
+
+        printf("%s", v2 ? "Info Hash v2:   " : "Info Hash:      ");
+        for (int j = 0; j < (v2 ? 32 : 20); j++)
+            printf("%02x", magnet.topics[i].hash[j]);
+        printf("\n");
+    }
+    if (magnet.length >= 0)
+        printf("Total Size:     %lld\n", magnet.length);
+    if (magnet.select.data)
+        printf("Selected Files: %.*s\n", magnet.select.length, magnet.select.data);
+    print_views("Announce List:", magnet.trackers, magnet.tracker_count);
+    print_views("Web Seeds:", magnet.web_seeds, magnet.web_seed_count);
+    print_views("Peers:", magnet.peers, magnet.peer_count);
+    if (fetch)
+        failed = fetch_magnet_metadata(&magnet);
+    if (magnet.tracker_count == 0)
+        return failed;
+    printf("\nScrapping test:\n");
+
+    trackers = malloc(sizeof(char *) * magnet.tracker_count);
+    for (int i = 0; i < magnet.tracker_count; i++)
+        trackers[i] = decode_view(&magnet.trackers[i]);
+    scrape_magnet_trackers(trackers, magnet.tracker_count, magnet.info_hash);
+    for (int i = 0; i < magnet.tracker_count; i++)
+        free(trackers[i]);
+    free(trackers);
+    return failed;
+}
+
+/* -------------------------------------------------------------------------
+    CREATE MODE: dumptorrent create <path> -a <url>... [-p <size>]
+   ------------------------------------------------------------------------- */
+static long long int parse_size(const char *str)
+{
+    char *end;
+    long long int value = strtoll(str, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+        value *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        value *= 1024 * 1024, end++;
+    return *end == '\0' ? value : -1;
+}
+
+static int do_create(int argc, char *argv[])
+{
+    struct create_options options = {0, NULL, 0, NULL, 0, 0};
+    const char *path = NULL;
+    char *output = NULL;
+    unsigned char info_hash[20];
+    char errbuf[ERRBUF_SIZE];
+    int retval;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-o") == 0 ||
+             strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 >= argc) {
+            printf("%s requires an argument.\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-p") == 0) {
+            options.piece_length = parse_size(argv[++i]);
+            /* piece length must be a power of two from 16K to 64M */
+            if (options.piece_length < 16384 || options.piece_length > CREATE_MAX_PIECE_LENGTH ||
+                (options.piece_length & (options.piece_length - 1)) != 0) {
+                printf("piece size must be a power of two from 16K to 64M. \"%s\" is invalid.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-a") == 0) {
+            options.announces = realloc(options.announces, sizeof(char *) * (options.announce_count + 1));
+            options.announces[options.announce_count++] = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            options.comment = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            options.threads = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-P") == 0) {
+            options.private_flag = 1;
+        } else if (argv[i][0] == '-' || path != NULL) {
+            printf("Unknown create argument \"%s\"\n", argv[i]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        printf("create requires a <path> argument.\n");
+        return 1;
+    }
+    /* a torrent without "announce" is one dumptorrent itself won't read */
+    if (options.announce_count == 0) {
+        printf("create requires at least one -a <announce> URL.\n");
+        return 1;
+    }
+
+    if (output == NULL) {
+        /* default to <name>.torrent in the current directory */
+        char *name = create_torrent_name(path, errbuf);
+        if (name == NULL) {
+            printf("%s\n", errbuf);
+            free(options.announces);
+            return 1;
+        }
+        output = malloc(strlen(name) + 9);
+        sprintf(output, "%s.torrent", name);
+        free(name);
+    }
+
+    retval = create_torrent(path, output, &options, info_hash, errbuf);
+    if (retval != 0) {
+        printf("%s\n", errbuf);
+    } else {
+        printf("%s: ", output);
+        for (int i = 0; i < 20; i++)
+            printf("%02x", info_hash[i]);
+        printf("\n");
+    }
+    free(options.announces);
+    return retval;
+}
+
 /* -------------------------------------------------------------------------
     PRINT USAGE / HELP
    ------------------------------------------------------------------------- */
@@ -83,13 +445,40 @@ static void print_help(const char *prog)
 {
     printf("Dump Torrent v%s\n", DUMPTORRENT_VERSION);
     printf("Usage: %s [options] [--] <files.torrent...>\n", prog);
+    printf("       %s create <path> -a <announce>... [-p <piece-size>] [-o <file>] [-c <comment>] [-P] [-j <threads>]\n", prog);
+    printf("  --: end of options, e.g. \"%s -- create\" dumps a torrent named \"create\"\n", prog);
     printf("  -t: validate torrent files only (test mode)\n");
     printf("  -f <field>: output a single field (e.g. 'name'), one per file\n");
     printf("  -b: brief dump\n");
     printf("  -v: full dump\n");
     printf("  -d: raw hierarchical dump\n");
     printf("  -s: show scrape info (via built-in logic)\n");
+    printf("  -S: batch scrape all given torrents, grouped by tracker\n");
+    printf("  --magnets-from <file>: batch scrape the magnet links in <file> (\"-\" for stdin), one per line\n");
+    printf("  --metadata: fetch a magnet's info dictionary from its x.pe peers (BEP 9) and show it\n");
+    printf("  --peer <host:port>: also fetch it from this peer, implies --metadata (repeatable)\n");
+    printf("  --tree: show files as a directory tree with per-directory totals\n");
+    printf("  --depth <n>: limit --tree output to <n> directory levels\n");
+    printf("  -m <piece|file:offset>: show the files a piece spans, or the piece holding\n");
+    printf("     a byte of a file (repeatable, \"-m -\" reads queries from stdin)\n");
+    printf("  --set-announce <url>: rewrite the announce URL (also in announce-list)\n");
+    printf("  --add-tracker <url>: append <url> as a new announce-list tier (repeatable)\n");
+    printf("  --strip-comment: remove the comment\n");
+    printf("  --set-private: set info.private (changes the info hash)\n");
     printf("  -w <timeout>: network timeout in seconds\n");
+    printf("  --udp-retries <n>: retransmit UDP requests up to <n> times, after 15*2^i seconds (max %d)\n",
+           SCRAPE_UDP_MAX_RETRIES);
+    printf("  --max-requests <n>: scrape requests in flight at once (default %d, 0 for no limit)\n",
+           SCRAPE_DEFAULT_MAX_REQUESTS);
+    printf("  --host-rate <n>: scrape requests per second to one tracker host, bursts of %d (default %d, 0 for no limit)\n",
+           SCRAPE_HOST_BURST, SCRAPE_DEFAULT_HOST_RATE);
+    printf("  --first <n>: stop scraping a magnet's trackers after <n> of them answered\n");
+    printf("  --announce: if a tracker won't scrape, ask with a \"stopped\" announce per torrent instead\n");
+    printf("  --conn-cache <file>: keep UDP tracker connection IDs in <file> between runs\n");
+    printf("  --scrape-cache <file>: answer scrapes from results kept in <file> when fresh enough\n");
+    printf("  --max-age <seconds>: oldest cached scrape result to use, or the tracker's min_request_interval\n");
+    printf("     if longer (default %d, 0 always scrapes)\n", SCRAPECACHE_DEFAULT_MAX_AGE);
+    printf("  --tracker-health <file>: keep tracker latency, success rate and cooldowns in <file>\n");
     printf("  -scrape <url> <infohash>: scrape a particular infohash from the given tracker\n");
     printf("  -V: print dumptorrent version and exit\n");
     printf("  -h: print this help message\n\n");
@@ -97,6 +486,7 @@ static void print_help(const char *prog)
     printf("  %s somefile.torrent                 (default output)\n", prog);
     printf("  %s -t file1.torrent file2.torrent   (test each file)\n", prog);
     printf("  %s -scrape http://tracker/ann ...   (scrape a specific infohash)\n", prog);
+    printf("  %s create dir/ -a http://tracker/ann (hash dir/ into dir.torrent)\n", prog);
 }
 
 /* -------------------------------------------------------------------------
@@ -112,13 +502,22 @@ int main(int argc, char *argv[])
     struct string_list *head = NULL, *tail = NULL;
     struct string_list *curr, *temp;
     char errbuf[ERRBUF_SIZE];
+    char *end;
     int count;
 
     srand((unsigned) time(NULL));
 
+    if (argc > 1 && strcmp(argv[1], "create") == 0)
+        return do_create(argc - 1, argv + 1);
+
     /* Parse command-line arguments */
     for (count = 1; count < argc; count++) {
-        if (strcmp(argv[count], "-h") == 0) {
+        if (strcmp(argv[count], "--") == 0) {
+            /* the rest are file names, handled below */
+            count++;
+            break;
+        }
+        else if (strcmp(argv[count], "-h") == 0) {
             print_help(argv[0]);
             return 0;
         } 
@@ -150,6 +549,77 @@ int main(int argc, char *argv[])
         else if (strcmp(argv[count], "-s") == 0) {
             option_output = OUTPUT_SCRAPE;
         } 
+        else if (strcmp(argv[count], "-S") == 0) {
+            option_output = OUTPUT_BATCH;
+        }
+        else if (strcmp(argv[count], "--magnets-from") == 0) {
+            if (count + 1 >= argc) {
+                printf("--magnets-from requires a <file> argument.\n");
+                return 1;
+            }
+            option_magnets_from = argv[++count];
+        }
+        else if (strcmp(argv[count], "--metadata") == 0) {
+            option_metadata = 1;
+        }
+        else if (strcmp(argv[count], "--peer") == 0) {
+            if (count + 1 >= argc) {
+                printf("--peer requires a <host:port> argument.\n");
+                return 1;
+            }
+            option_peers = realloc(option_peers, sizeof(char *) * (option_peer_count + 1));
+            option_peers[option_peer_count++] = argv[++count];
+        }
+        else if (strcmp(argv[count], "--tree") == 0) {
+            option_tree = 1;
+        }
+        else if (strcmp(argv[count], "--depth") == 0) {
+            if (count + 1 >= argc) {
+                printf("--depth requires an integer <n> argument.\n");
+                return 1;
+            }
+            option_tree = 1;
+            option_tree_depth = strtol(argv[++count], &end, 10);
+            if (end == argv[count] || *end != '\0' || option_tree_depth < 0) {
+                printf("depth must be a non-negative integer. \"%s\" is invalid.\n", argv[count]);
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[count], "-m") == 0) {
+            if (count + 1 >= argc) {
+                printf("-m requires a <piece|file:offset> argument.\n");
+                return 1;
+            }
+            option_output = OUTPUT_PIECEMAP;
+            option_map_queries = realloc(option_map_queries, sizeof(char *) * (option_map_query_count + 1));
+            option_map_queries[option_map_query_count++] = argv[++count];
+        }
+        else if (strcmp(argv[count], "--set-announce") == 0) {
+            if (count + 1 >= argc) {
+                printf("--set-announce requires a <url> argument.\n");
+                return 1;
+            }
+            option_output = OUTPUT_EDIT;
+            option_set_announce = argv[++count];
+        }
+        else if (strcmp(argv[count], "--add-tracker") == 0) {
+            if (count + 1 >= argc) {
+                printf("--add-tracker requires a <url> argument.\n");
+                return 1;
+            }
+            option_output = OUTPUT_EDIT;
+            option_add_trackers = realloc(option_add_trackers, sizeof(char *) * (option_add_tracker_count + 1));
+            option_add_trackers[option_add_tracker_count++] = argv[++count];
+        }
+        else if (strcmp(argv[count], "--strip-comment") == 0) {
+            option_output = OUTPUT_EDIT;
+            option_strip_comment = 1;
+        }
+        else if (strcmp(argv[count], "--set-private") == 0) {
+            option_output = OUTPUT_EDIT;
+            option_set_private = 1;
+        }
         else if (strcmp(argv[count], "-w") == 0) {
             if (count + 1 >= argc) {
                 printf("-w requires an integer <timeout> argument.\n");
@@ -162,6 +632,89 @@ int main(int argc, char *argv[])
                 return 1;
             }
         } 
+        else if (strcmp(argv[count], "--udp-retries") == 0) {
+            if (count + 1 >= argc) {
+                printf("--udp-retries requires an integer <n> argument.\n");
+                return 1;
+            }
+            option_udp_retries = strtol(argv[++count], NULL, 10);
+            if (option_udp_retries < 0 || option_udp_retries > SCRAPE_UDP_MAX_RETRIES) {
+                printf("udp retries must be between 0 and %d. \"%s\" is invalid.\n", SCRAPE_UDP_MAX_RETRIES, argv[count]);
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[count], "--max-requests") == 0) {
+            if (count + 1 >= argc) {
+                printf("--max-requests requires an integer <n> argument.\n");
+                return 1;
+            }
+            option_max_requests = strtol(argv[++count], NULL, 10);
+            if (option_max_requests < 0) {
+                printf("--max-requests must be a non-negative integer. \"%s\" is invalid.\n", argv[count]);
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[count], "--host-rate") == 0) {
+            if (count + 1 >= argc) {
+                printf("--host-rate requires an integer <n> argument.\n");
+                return 1;
+            }
+            option_host_rate = strtol(argv[++count], NULL, 10);
+            if (option_host_rate < 0) {
+                printf("--host-rate must be a non-negative integer. \"%s\" is invalid.\n", argv[count]);
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[count], "--first") == 0) {
+            if (count + 1 >= argc) {
+                printf("--first requires an integer <n> argument.\n");
+                return 1;
+            }
+            option_first = strtol(argv[++count], NULL, 10);
+            if (option_first < 0) {
+                printf("--first must be a non-negative integer. \"%s\" is invalid.\n", argv[count]);
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[count], "--announce") == 0) {
+            option_announce = 1;
+        }
+        else if (strcmp(argv[count], "--conn-cache") == 0) {
+            if (count + 1 >= argc) {
+                printf("--conn-cache requires a <file> argument.\n");
+                return 1;
+            }
+            option_conn_cache = argv[++count];
+        }
+        else if (strcmp(argv[count], "--scrape-cache") == 0) {
+            if (count + 1 >= argc) {
+                printf("--scrape-cache requires a <file> argument.\n");
+                return 1;
+            }
+            option_scrape_cache = argv[++count];
+        }
+        else if (strcmp(argv[count], "--tracker-health") == 0) {
+            if (count + 1 >= argc) {
+                printf("--tracker-health requires a <file> argument.\n");
+                return 1;
+            }
+            option_tracker_health = argv[++count];
+        }
+        else if (strcmp(argv[count], "--max-age") == 0) {
+            if (count + 1 >= argc) {
+                printf("--max-age requires a <seconds> argument.\n");
+                return 1;
+            }
+            option_max_age = strtol(argv[++count], NULL, 10);
+            if (option_max_age < 0) {
+                printf("--max-age must be non-negative.\n");
+                return 1;
+            }
+        }
         else if (strcmp(argv[count], "-scrape") == 0) {
             if (count + 2 >= argc) {
                 printf("url and infohash expected for -scrape.\n");
@@ -213,58 +766,40 @@ int main(int argc, char *argv[])
             }
         }
     }
-
-    if (option_output == OUTPUT_MAGNET) {
-        unsigned char infohash[20];
-        char display_name[ERRBUF_SIZE];
-        char **trackers = NULL;
-        int tracker_count = 0;
-        char errbuf[ERRBUF_SIZE];
-    
-        if (parse_magnet_uri(option_tracker, infohash, &trackers, &tracker_count, display_name, errbuf) != 0) {
-            fprintf(stderr, "Magnet parse error: %s\n", errbuf);
-            return 1;
-        }
-        
-        if (display_name[0])
-            printf("Name:           %s\n", display_name);
-            printf("Magnet URI:     %s\n", option_tracker);
-            printf("Info Hash:      ");
-        for (int i = 0; i < 20; i++) printf("%02x", infohash[i]);
-            printf("\n");
-
-        if (tracker_count > 0) {
-            printf("Announce List:\n");
-            for (int i = 0; i < tracker_count; i++) {
-                printf("                %s\n", trackers[i]);
-            }
+    /* after "--", even "create" or "-v" is a file name */
+    for (; count < argc; count++) {
+        curr = (struct string_list *) malloc(sizeof(struct string_list));
+        curr->str = argv[count];
+        curr->next = NULL;
+        if (head == NULL)
+            head = tail = curr;
+        else {
+            tail->next = curr;
+            tail = curr;
         }
-        printf("\nScrapping test:\n");
+    }
 
-        int total_seeders = 0, total_leechers = 0, total_completed = 0;
-        int scrape_success = 0;
-        int result[3];
+    if (option_conn_cache) {
+        conncache_load(option_conn_cache);
+        atexit(save_conn_cache);
+    }
+    if (option_tracker_health) {
+        trackerhealth_load(option_tracker_health);
+        atexit(save_tracker_health);
+    }
+    if (option_scrape_cache && scrapecache_open(option_scrape_cache, errbuf) != 0)
+        printf("%s: %s\n", option_scrape_cache, errbuf);
 
-        for (int i = 0; i < tracker_count; i++) {
-            if (scrapec(trackers[i], infohash, result, errbuf) != 0) {
-                printf("  %s\n", errbuf);
-            } else {
-                printf("                %s, (seeders=%d, completed=%d, leechers=%d)\n", trackers[i], result[0], result[1], result[2]);
-                total_seeders += result[0];
-                total_completed += result[1];
-                total_leechers += result[2];
-                scrape_success++;
-            }
-        }
+    if (option_output == OUTPUT_MAGNET)
+        return print_magnet(option_tracker);
 
-        if (scrape_success > 1) {
-            printf("\nTotal (from %d trackers): seeders=%d, completed=%d, leechers=%d\n",
-                scrape_success, total_seeders, total_completed, total_leechers);
+    if (option_magnets_from) {
+        if (head != NULL) {
+            printf("Usage of --magnets-from is invalid with additional file arguments.\n");
+            print_help(argv[0]);
+            return 1;
         }
-    
-        for (int i = 0; i < tracker_count; i++) free(trackers[i]);
-        free(trackers);
-        return 0;
+        return batch_scrape_magnets(option_magnets_from) > 0;
     }
 
     if (option_output == OUTPUT_SCRAPEC) {
@@ -284,73 +819,37 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (option_output == OUTPUT_BATCH) {
+        /* every file is needed up front to group them by tracker */
+        char **file_names = NULL;
+        int file_count = 0, failed;
+        for (curr = head; curr != NULL; curr = curr->next) {
+            file_names = realloc(file_names, sizeof(char *) * (file_count + 1));
+            file_names[file_count++] = curr->str;
+        }
+        failed = batch_scrape_torrents(file_names, file_count);
+        free(file_names);
+        return failed;
+    }
+
     /* Process each file */
     int test_fail_count = 0;
     for (curr = head; curr != NULL; /* advanced below */) {
         struct benc_entity *root;
-        if (strcmp(curr->str, "-") == 0) {
-            root = benc_parse_stream(stdin, errbuf);
-        } else if (is_magnet_uri(curr->str)) {
-            unsigned char infohash[20];
-            char *display_name = malloc(ERRBUF_SIZE);
-            char **trackers = NULL;
-            int tracker_count = 0;
-            int result[3];
-            int total_seeders = 0, total_leechers = 0, total_completed = 0;
-            int scrape_success = 0;
-        
-            if (parse_magnet_uri(curr->str, infohash, &trackers, &tracker_count, display_name, errbuf) != 0) {
+        if (option_output == OUTPUT_EDIT) {
+            /* rewritten in place, only failures are reported */
+            if (edit_torrent(curr->str, errbuf) != 0) {
                 printf("%s: %s\n", curr->str, errbuf);
                 test_fail_count++;
-                free(display_name);
-                curr = curr->next;
-                continue;
-            }
-        
-            if (tracker_count == 0) {
-                printf("%s: no tracker found in magnet URI\n", curr->str);
-                free(display_name);
-                curr = curr->next;
-                continue;
-            }
-        
-            printf("%s:\n", curr->str);
-            if (display_name[0])
-                printf("%s:\n", curr->str);
-                printf("Name:           %s\n", display_name);
-                printf("Magnet URI:     %s\n", option_tracker);
-                printf("Info Hash:      ");
-            for (int i = 0; i < 20; i++) printf("%02x", infohash[i]);
-            printf("\n");
-        
-            if (tracker_count > 0) {
-                printf("Announce List:\n");
-                for (int i = 0; i < tracker_count; i++) {
-                    printf("                %s\n", trackers[i]);
-                }
-            }
-            printf("\nScrapping test:\n");
-        
-            for (int i = 0; i < tracker_count; i++) {
-                if (scrapec(trackers[i], infohash, result, errbuf) != 0) {
-                    printf("  %s\n", errbuf);
-                } else {
-                    printf("                %s, (seeders=%d, completed=%d, leechers=%d)\n", trackers[i], result[0], result[1], result[2]);
-                    total_seeders += result[0];
-                    total_completed += result[1];
-                    total_leechers += result[2];
-                    scrape_success++;
-                }
-            }
-        
-            if (scrape_success > 1) {
-                printf("Total (from %d trackers): seeders=%d, completed=%d, leechers=%d\n",
-                    scrape_success, total_seeders, total_completed, total_leechers);
             }
-        
-            for (int i = 0; i < tracker_count; i++) free(trackers[i]);
-            free(trackers);
-            free(display_name);
+            temp = curr->next;
+            free(curr);
+            curr = temp;
+            continue;
+        } else if (strcmp(curr->str, "-") == 0) {
+            root = benc_parse_stream(stdin, errbuf);
+        } else if (is_magnet_uri(curr->str)) {
+            test_fail_count += print_magnet(curr->str);
             curr = curr->next;
             continue;
         } else {
@@ -415,6 +914,16 @@ int main(int argc, char *argv[])
                 }
                 break;
 
+            case OUTPUT_PIECEMAP:
+                printf("%s:\n", curr->str);
+                if (!root) {
+                    printf("%s\n", errbuf);
+                } else {
+                    query_piece_map(root, option_map_queries, option_map_query_count);
+                    printf("\n");
+                }
+                break;
+
             default:
                 assert(0); /* Should never happen */
         }
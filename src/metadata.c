@@ -0,0 +1,518 @@
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "benc.h"
+#include "sha1.h"
+#include "metadata.h"
+
+#define HANDSHAKE_LENGTH 68
+#define MAX_MESSAGE      (1024 * 1024)   /* a bitfield of a huge torrent still fits */
+#define MSG_EXTENDED     20
+#define UT_METADATA_ID   1               /* what peers send our ut_metadata messages as */
+
+enum {
+    PEER_CONNECTING,
+    PEER_HANDSHAKE,      /* waiting for the peer's handshake */
+    PEER_EXTENDED,       /* waiting for its extension handshake */
+    PEER_READY,          /* takes piece requests */
+    PEER_DEAD
+};
+
+struct metadata_peer {
+    const char *address;
+    int fd;
+    int state;
+    int ut_metadata;             /* the peer's id for our requests */
+    int requested;               /* pieces asked for and not answered yet */
+    char *in;
+    int in_length;
+    int in_capacity;
+    struct benc_buffer out;
+    int out_sent;
+};
+
+struct metadata_state {
+    const unsigned char *info_hash;
+    struct metadata_peer *peers;
+    int peer_count;
+    char *data;                  /* size bytes, once a peer gave metadata_size */
+    int size;
+    int piece_count;
+    int *owner;                  /* per piece: the peer asked for it or that sent it, -1 for none */
+    unsigned char *have;
+    int have_count;
+    int single_source;           /* every piece from one peer, since a mix didn't check out */
+    int done;                    /* the metadata checked out */
+    char error[ERRBUF_SIZE];     /* the latest peer failure */
+};
+
+static long long int now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put_u32(unsigned char *ptr, unsigned int value)
+{
+    value = htonl(value);
+    memcpy(ptr, &value, 4);
+}
+
+static unsigned int get_u32(const unsigned char *ptr)
+{
+    unsigned int value;
+    memcpy(&value, ptr, 4);
+    return ntohl(value);
+}
+
+static void peer_fail(struct metadata_state *state, int index, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* Drop the peer; the pieces it was asked for go back to the others. */
+static void peer_fail(struct metadata_state *state, int index, const char *format, ...)
+{
+    struct metadata_peer *peer = &state->peers[index];
+    int used;
+    va_list ap;
+
+    /* the whole address, then as much of the reason as fits */
+    used = snprintf(state->error, ERRBUF_SIZE, "%s: ", peer->address);
+    if (used < ERRBUF_SIZE) {
+        va_start(ap, format);
+        vsnprintf(state->error + used, ERRBUF_SIZE - used, format, ap);
+        va_end(ap);
+    }
+
+    if (peer->fd >= 0)
+        close(peer->fd);
+    peer->fd = -1;
+    peer->state = PEER_DEAD;
+    for (int i = 0; i < state->piece_count; i++) {
+        if (state->owner[i] == index && !state->have[i])
+            state->owner[i] = -1;
+    }
+}
+
+static void send_extended(struct metadata_peer *peer, int id, const char *payload, int length)
+{
+    unsigned char head[6];
+
+    put_u32(head, (unsigned int) length + 2);
+    head[4] = MSG_EXTENDED;
+    head[5] = (unsigned char) id;
+    benc_buffer_append(&peer->out, head, 6);
+    benc_buffer_append(&peer->out, payload, length);
+}
+
+static int piece_length(const struct metadata_state *state, int piece)
+{
+    return piece < state->piece_count - 1 ? METADATA_PIECE_SIZE : state->size - piece * METADATA_PIECE_SIZE;
+}
+
+/* Keep every ready peer METADATA_PIPELINE requests deep in pieces nobody
+   has been asked for, or only one of them in single source mode. */
+static void request_pieces(struct metadata_state *state)
+{
+    int next = 0, source = -1;
+
+    if (state->single_source) {
+        for (int i = 0; i < state->piece_count && source < 0; i++) {
+            if (state->owner[i] >= 0 && state->peers[state->owner[i]].state == PEER_READY)
+                source = state->owner[i];
+        }
+        for (int i = 0; i < state->peer_count && source < 0; i++) {
+            if (state->peers[i].state == PEER_READY)
+                source = i;
+        }
+    }
+
+    for (int i = 0; i < state->peer_count; i++) {
+        struct metadata_peer *peer = &state->peers[i];
+
+        while (peer->state == PEER_READY && peer->requested < METADATA_PIPELINE && (source < 0 || i == source)) {
+            char request[64];
+
+            while (next < state->piece_count && state->owner[next] != -1)
+                next++;
+            if (next == state->piece_count)
+                return;
+            snprintf(request, sizeof(request), "d8:msg_typei0e5:piecei%dee", next);
+            send_extended(peer, peer->ut_metadata, request, (int) strlen(request));
+            state->owner[next] = i;
+            peer->requested++;
+        }
+    }
+}
+
+/* Every piece is in: does it hash to the info hash? If not, a peer that
+   sent all of it is dropped; pieces from several peers don't tell which
+   one lied, so they are fetched again from one peer at a time. */
+static void check_metadata(struct metadata_state *state)
+{
+    unsigned char digest[20];
+    int sender = state->owner[0], mixed = 0;
+    SHA_CTX ctx;
+
+    SHAInit(&ctx);
+    SHAUpdate(&ctx, (unsigned char *) state->data, state->size);
+    SHAFinal(digest, &ctx);
+    if (memcmp(digest, state->info_hash, 20) == 0) {
+        state->done = 1;
+        return;
+    }
+
+    for (int i = 0; i < state->piece_count; i++) {
+        mixed |= state->owner[i] != sender;
+        state->have[i] = 0;
+        state->owner[i] = -1;
+    }
+    state->have_count = 0;
+    if (mixed) {
+        state->single_source = 1;
+        snprintf(state->error, ERRBUF_SIZE, "metadata from several peers doesn't match the info hash");
+    }
+    else if (state->peers[sender].state != PEER_DEAD)
+        peer_fail(state, sender, "metadata doesn't match the info hash");
+}
+
+static void extension_handshake(struct metadata_state *state, int index, const char *payload, int length)
+{
+    struct metadata_peer *peer = &state->peers[index];
+    struct benc_entity *root, *m, *id, *size;
+    char errbuf[ERRBUF_SIZE];
+
+    root = benc_parse_memory(payload, length, NULL, errbuf);
+    if (root == NULL || root->type != BENC_DICTIONARY) {
+        peer_fail(state, index, "bad extension handshake");
+        if (root != NULL)
+            benc_free_entity(root);
+        return;
+    }
+    m = benc_lookup_string(root, "m");
+    id = m != NULL && m->type == BENC_DICTIONARY ? benc_lookup_string(m, "ut_metadata") : NULL;
+    size = benc_lookup_string(root, "metadata_size");
+    if (id == NULL || id->type != BENC_INTEGER || id->integer <= 0 || id->integer > 255)
+        peer_fail(state, index, "no ut_metadata support");
+    else if (size == NULL || size->type != BENC_INTEGER || size->integer <= 0 || size->integer > METADATA_MAX_SIZE)
+        peer_fail(state, index, "no usable metadata_size");
+    else if (state->size != 0 && size->integer != state->size)
+        peer_fail(state, index, "metadata_size %lld, other peers said %d", size->integer, state->size);
+    else {
+        peer->ut_metadata = (int) id->integer;
+        peer->state = PEER_READY;
+        if (state->size == 0) {
+            state->size = (int) size->integer;
+            state->piece_count = (state->size + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE;
+            state->data = malloc(state->size);
+            state->owner = malloc(sizeof(int) * state->piece_count);
+            state->have = calloc(state->piece_count, 1);
+            for (int i = 0; i < state->piece_count; i++)
+                state->owner[i] = -1;
+        }
+    }
+    benc_free_entity(root);
+}
+
+static void metadata_message(struct metadata_state *state, int index, const char *payload, int length)
+{
+    struct metadata_peer *peer = &state->peers[index];
+    struct benc_entity *root, *type, *piece;
+    char errbuf[ERRBUF_SIZE];
+    int eaten = 0, number;
+
+    /* a bencoded dictionary, followed by the piece for a data message */
+    root = benc_parse_memory(payload, length, &eaten, errbuf);
+    if (root == NULL || root->type != BENC_DICTIONARY) {
+        peer_fail(state, index, "bad ut_metadata message");
+        if (root != NULL)
+            benc_free_entity(root);
+        return;
+    }
+    type = benc_lookup_string(root, "msg_type");
+    piece = benc_lookup_string(root, "piece");
+    if (type == NULL || type->type != BENC_INTEGER || piece == NULL || piece->type != BENC_INTEGER ||
+        piece->integer < 0 || piece->integer >= state->piece_count) {
+        benc_free_entity(root);
+        return;
+    }
+    number = (int) piece->integer;
+
+    if (type->integer == 1 && state->owner[number] == index && !state->have[number]) {
+        if (length - eaten != piece_length(state, number))
+            peer_fail(state, index, "metadata piece %d of %d bytes", number, length - eaten);
+        else {
+            memcpy(state->data + number * METADATA_PIECE_SIZE, payload + eaten, length - eaten);
+            state->have[number] = 1;
+            state->have_count++;
+            peer->requested--;
+            if (state->have_count == state->piece_count)
+                check_metadata(state);
+        }
+    }
+    else if (type->integer == 2 && state->owner[number] == index) {
+        /* peers reject when they don't have the metadata themselves */
+        peer_fail(state, index, "rejected metadata piece %d", number);
+    }
+    /* requests (0) we can't serve go unanswered */
+    benc_free_entity(root);
+}
+
+/* Handle what arrived; the peer may fail on the way. */
+static void peer_input(struct metadata_state *state, int index)
+{
+    static const char extensions[] = "d1:md11:ut_metadatai" "1" "eee";
+    struct metadata_peer *peer = &state->peers[index];
+    const unsigned char *in = (const unsigned char *) peer->in;
+    int offset = 0;
+
+    if (peer->state == PEER_HANDSHAKE) {
+        if (peer->in_length < HANDSHAKE_LENGTH)
+            return;
+        if (in[0] != 19 || memcmp(in + 1, "BitTorrent protocol", 19) != 0) {
+            peer_fail(state, index, "not a BitTorrent peer");
+            return;
+        }
+        if (memcmp(in + 28, state->info_hash, 20) != 0) {
+            peer_fail(state, index, "peer answered for another info hash");
+            return;
+        }
+        if (!(in[25] & 0x10)) {
+            peer_fail(state, index, "no extension protocol (BEP 10)");
+            return;
+        }
+        offset = HANDSHAKE_LENGTH;
+        peer->state = PEER_EXTENDED;
+        send_extended(peer, 0, extensions, (int) sizeof(extensions) - 1);
+    }
+
+    while (peer->state != PEER_DEAD && peer->in_length - offset >= 4) {
+        unsigned int length = get_u32(in + offset);
+
+        if (length > MAX_MESSAGE) {
+            peer_fail(state, index, "message of %u bytes", length);
+            return;
+        }
+        if ((unsigned int) (peer->in_length - offset - 4) < length)
+            break;
+        /* keep-alives, choke, bitfield, have... mean nothing here */
+        if (length >= 2 && in[offset + 4] == MSG_EXTENDED) {
+            const char *payload = peer->in + offset + 6;
+
+            if (in[offset + 5] == 0 && peer->state == PEER_EXTENDED)
+                extension_handshake(state, index, payload, (int) length - 2);
+            else if (in[offset + 5] == UT_METADATA_ID && peer->state == PEER_READY)
+                metadata_message(state, index, payload, (int) length - 2);
+        }
+        offset += 4 + (int) length;
+    }
+    if (peer->state != PEER_DEAD) {
+        memmove(peer->in, peer->in + offset, peer->in_length - offset);
+        peer->in_length -= offset;
+    }
+}
+
+static void peer_receive(struct metadata_state *state, int index)
+{
+    struct metadata_peer *peer = &state->peers[index];
+
+    for (;;) {
+        ssize_t len;
+
+        if (peer->in_capacity - peer->in_length < 16384) {
+            peer->in_capacity = peer->in_capacity ? peer->in_capacity * 2 : 65536;
+            peer->in = realloc(peer->in, peer->in_capacity);
+        }
+        len = recv(peer->fd, peer->in + peer->in_length, peer->in_capacity - peer->in_length, 0);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (len <= 0) {
+            peer_fail(state, index, "%s", len == 0 ? "connection closed" : strerror(errno));
+            return;
+        }
+        peer->in_length += (int) len;
+        peer_input(state, index);
+        if (peer->state == PEER_DEAD || state->done)
+            return;
+    }
+}
+
+static void peer_flush(struct metadata_state *state, int index)
+{
+    struct metadata_peer *peer = &state->peers[index];
+
+    while (peer->out_sent < peer->out.length) {
+        ssize_t len = send(peer->fd, peer->out.data + peer->out_sent, peer->out.length - peer->out_sent,
+                           MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                peer_fail(state, index, "%s", strerror(errno));
+            return;
+        }
+        peer->out_sent += (int) len;
+    }
+    peer->out_sent = peer->out.length = 0;
+}
+
+/* Start a non-blocking connect and queue our handshake. */
+static void peer_connect(struct metadata_state *state, int index, const unsigned char *peer_id)
+{
+    struct metadata_peer *peer = &state->peers[index];
+    struct addrinfo hints, *addresses = NULL;
+    unsigned char handshake[HANDSHAKE_LENGTH];
+    char host[256];
+    const char *port = strrchr(peer->address, ':');
+    int host_length, error;
+
+    /* "host:port" or "[v6]:port" */
+    if (port == NULL || port[1] == '\0') {
+        peer_fail(state, index, "no port");
+        return;
+    }
+    host_length = (int) (port - peer->address);
+    if (peer->address[0] == '[' && host_length > 2 && port[-1] == ']')
+        snprintf(host, sizeof(host), "%.*s", host_length - 2, peer->address + 1);
+    else
+        snprintf(host, sizeof(host), "%.*s", host_length, peer->address);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    error = getaddrinfo(host, port + 1, &hints, &addresses);
+    if (error != 0) {
+        peer_fail(state, index, "%s", gai_strerror(error));
+        return;
+    }
+    peer->fd = socket(addresses->ai_family, SOCK_STREAM, 0);
+    if (peer->fd < 0 || fcntl(peer->fd, F_SETFL, O_NONBLOCK) != 0 ||
+        (connect(peer->fd, addresses->ai_addr, addresses->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+        error = errno;
+        freeaddrinfo(addresses);
+        peer_fail(state, index, "connect() error: %s", strerror(error));
+        return;
+    }
+    freeaddrinfo(addresses);
+
+    /* reserved bit 20 (byte 5, 0x10): the extension protocol */
+    handshake[0] = 19;
+    memcpy(handshake + 1, "BitTorrent protocol", 19);
+    memset(handshake + 20, 0, 8);
+    handshake[25] = 0x10;
+    memcpy(handshake + 28, state->info_hash, 20);
+    memcpy(handshake + 48, peer_id, 20);
+    benc_buffer_append(&peer->out, handshake, HANDSHAKE_LENGTH);
+}
+
+char *metadata_fetch(const unsigned char *info_hash, char **peers, int peer_count, int timeout_ms,
+                     int *plength, char *errbuf)
+{
+    struct metadata_state state;
+    struct pollfd fds[METADATA_MAX_PEERS];
+    int index_of[METADATA_MAX_PEERS];
+    unsigned char peer_id[20];
+    long long int deadline = now_ms() + timeout_ms;
+    char *data = NULL;
+
+    if (peer_count > METADATA_MAX_PEERS)
+        peer_count = METADATA_MAX_PEERS;
+    memset(&state, 0, sizeof(state));
+    state.info_hash = info_hash;
+    state.peer_count = peer_count;
+    state.peers = calloc(peer_count > 0 ? peer_count : 1, sizeof(struct metadata_peer));
+    snprintf(state.error, ERRBUF_SIZE, "no peers to fetch the metadata from");
+
+    memcpy(peer_id, "-DT0000-", 8);
+    for (int i = 8; i < 20; i++)
+        peer_id[i] = (unsigned char) rand();
+    for (int i = 0; i < peer_count; i++) {
+        state.peers[i].address = peers[i];
+        state.peers[i].fd = -1;
+        peer_connect(&state, i, peer_id);
+    }
+
+    while (!state.done) {
+        long long int wait = deadline - now_ms();
+        int count = 0;
+
+        for (int i = 0; i < peer_count; i++) {
+            struct metadata_peer *peer = &state.peers[i];
+
+            if (peer->state == PEER_DEAD)
+                continue;
+            fds[count].fd = peer->fd;
+            fds[count].events = POLLIN;
+            if (peer->state == PEER_CONNECTING || peer->out_sent < peer->out.length)
+                fds[count].events |= POLLOUT;
+            index_of[count++] = i;
+        }
+        if (count == 0)
+            break;
+        if (wait <= 0) {
+            if (state.piece_count == 0)
+                snprintf(state.error, ERRBUF_SIZE, "timeout before any peer offered the metadata");
+            else
+                snprintf(state.error, ERRBUF_SIZE, "timeout with %d of %d metadata pieces", state.have_count,
+                         state.piece_count);
+            break;
+        }
+        if (poll(fds, count, (int) wait) < 0 && errno != EINTR) {
+            snprintf(state.error, ERRBUF_SIZE, "poll() error: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count && !state.done; i++) {
+            struct metadata_peer *peer = &state.peers[index_of[i]];
+
+            if (fds[i].revents == 0 || peer->state == PEER_DEAD)
+                continue;
+            if (peer->state == PEER_CONNECTING) {
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+
+                getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+                if (error != 0) {
+                    peer_fail(&state, index_of[i], "connect() error: %s", strerror(error));
+                    continue;
+                }
+                peer->state = PEER_HANDSHAKE;
+            }
+            if (fds[i].revents & POLLOUT)
+                peer_flush(&state, index_of[i]);
+            if (peer->state != PEER_DEAD && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                peer_receive(&state, index_of[i]);
+        }
+        if (!state.done && state.piece_count > 0)
+            request_pieces(&state);
+    }
+
+    if (state.done) {
+        data = state.data;
+        *plength = state.size;
+        state.data = NULL;
+    }
+    else
+        snprintf(errbuf, ERRBUF_SIZE, "%s", state.error);
+
+    for (int i = 0; i < peer_count; i++) {
+        if (state.peers[i].fd >= 0)
+            close(state.peers[i].fd);
+        free(state.peers[i].in);
+        benc_buffer_free(&state.peers[i].out);
+    }
+    free(state.peers);
+    free(state.data);
+    free(state.owner);
+    free(state.have);
+    return data;
+}
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "common.h"
+#include "benc.h"
+#include "piecemap.h"
+
+struct piece_map *piece_map_new(const long long int *lengths, int count, long long int piece_length)
+{
+    struct piece_map *map = (struct piece_map *) malloc(sizeof(struct piece_map));
+
+    map->file_count = count;
+    map->offsets = (long long int *) malloc(sizeof(long long int) * (count + 1));
+    map->offsets[0] = 0;
+    for (int i = 0; i < count; i++)
+        map->offsets[i + 1] = map->offsets[i] + lengths[i];
+    map->piece_length = piece_length;
+    map->piece_count = piece_length > 0 ? (map->offsets[count] + piece_length - 1) / piece_length : 0;
+    map->paths = NULL;
+    map->name = NULL;
+    return map;
+}
+
+/* info.name if it is a string, else NULL */
+static struct benc_entity *valid_name(struct benc_entity *info)
+{
+    struct benc_entity *name = benc_lookup_string(info, "name");
+
+    return name != NULL && name->type == BENC_STRING ? name : NULL;
+}
+
+struct piece_map *piece_map_from_info(struct benc_entity *info, char *errbuf)
+{
+    struct benc_entity *piece_length, *length, *files;
+    struct piece_map *map;
+    long long int *lengths;
+    int count = 0;
+
+    piece_length = benc_lookup_string(info, "piece length");
+    if (piece_length == NULL || piece_length->type != BENC_INTEGER || piece_length->integer <= 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "no info.piece length");
+        return NULL;
+    }
+
+    length = benc_lookup_string(info, "length");
+    if (length != NULL) {
+        if (length->type != BENC_INTEGER || length->integer < 0) {
+            snprintf(errbuf, ERRBUF_SIZE, "info.length is not valid");
+            return NULL;
+        }
+        map = piece_map_new(&length->integer, 1, piece_length->integer);
+        map->name = valid_name(info);
+        return map;
+    }
+
+    files = benc_lookup_string(info, "files");
+    if (files == NULL || files->type != BENC_LIST) {
+        snprintf(errbuf, ERRBUF_SIZE, "no info.length nor info.files");
+        return NULL;
+    }
+    for (struct benc_entity *file = files->list.head; file != NULL; file = file->next)
+        count++;
+    if (count == 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "info.files is empty");
+        return NULL;
+    }
+
+    lengths = (long long int *) malloc(sizeof(long long int) * count);
+    count = 0;
+    for (struct benc_entity *file = files->list.head; file != NULL; file = file->next) {
+        struct benc_entity *length2, *path;
+        if (file->type != BENC_DICTIONARY ||
+            (length2 = benc_lookup_string(file, "length")) == NULL ||
+            length2->type != BENC_INTEGER || length2->integer < 0) {
+            snprintf(errbuf, ERRBUF_SIZE, "files list item doesn't have valid length");
+            free(lengths);
+            return NULL;
+        }
+        /* print_map_path() walks it as a list of strings */
+        path = benc_lookup_string(file, "path");
+        if (path == NULL || path->type != BENC_LIST || path->list.head == NULL) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid file structure.");
+            free(lengths);
+            return NULL;
+        }
+        for (struct benc_entity *component = path->list.head; component != NULL; component = component->next) {
+            if (component->type != BENC_STRING) {
+                snprintf(errbuf, ERRBUF_SIZE, "path list item is not string");
+                free(lengths);
+                return NULL;
+            }
+        }
+        lengths[count++] = length2->integer;
+    }
+
+    map = piece_map_new(lengths, count, piece_length->integer);
+    free(lengths);
+    map->name = valid_name(info);
+    map->paths = (struct benc_entity **) malloc(sizeof(struct benc_entity *) * count);
+    count = 0;
+    for (struct benc_entity *file = files->list.head; file != NULL; file = file->next)
+        map->paths[count++] = benc_lookup_string(file, "path");
+    return map;
+}
+
+void piece_map_free(struct piece_map *map)
+{
+    free(map->offsets);
+    free(map->paths);
+    free(map);
+}
+
+int piece_map_file_at(const struct piece_map *map, long long int offset)
+{
+    int lo = 0, hi = map->file_count;
+
+    if (offset < 0 || offset >= map->offsets[map->file_count])
+        return -1;
+
+    /* last file whose start is <= offset; empty files share their start
+       with the next file, so they are skipped over naturally */
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (map->offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int piece_map_piece_files(const struct piece_map *map, long long int piece, int *first, int *last)
+{
+    long long int start, end;
+
+    if (piece < 0 || piece >= map->piece_count)
+        return 1;
+
+    start = piece * map->piece_length;
+    end = start + map->piece_length;
+    if (end > map->offsets[map->file_count])
+        end = map->offsets[map->file_count];
+
+    *first = piece_map_file_at(map, start);
+    *last = piece_map_file_at(map, end - 1);
+    return 0;
+}
+
+long long int piece_map_piece_at(const struct piece_map *map, int file, long long int offset)
+{
+    if (file < 0 || file >= map->file_count || offset < 0 ||
+        offset >= map->offsets[file + 1] - map->offsets[file])
+        return -1;
+    return (map->offsets[file] + offset) / map->piece_length;
+}
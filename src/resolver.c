@@ -0,0 +1,272 @@
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "resolver.h"
+
+#define RESOLVER_MIN_SLOTS 64
+
+enum {
+    ENTRY_QUEUED,      /* waiting for a worker */
+    ENTRY_RESOLVING,   /* a worker runs getaddrinfo() */
+    ENTRY_DONE         /* answer (or failure) until expires */
+};
+
+/* One getaddrinfo() outcome; callbacks hold a reference so a re-resolve can't free it under them. */
+struct resolver_answer {
+    int refs;
+    struct addrinfo *addresses;   /* NULL on failure */
+    int error;                    /* getaddrinfo() code */
+};
+
+struct resolver_waiter {
+    struct resolver_entry *entry;
+    resolver_callback callback;
+    void *arg;
+    struct resolver_waiter *next;
+};
+
+struct resolver_entry {
+    char *host;
+    int state;
+    struct resolver_answer *answer;
+    time_t expires;
+    struct resolver_waiter *waiters;
+    struct resolver_entry *next_queued;     /* work queue */
+    struct resolver_entry *next_completed;  /* waiting for resolver_dispatch() */
+    int on_completed;
+};
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_work = PTHREAD_COND_INITIALIZER;
+static int notify_fd = -1;
+static int thread_count;
+static int idle_threads;
+
+/* open addressing on the host name; entries live for the whole process */
+static struct resolver_entry **slots;
+static int slot_count;
+static int entry_count;
+
+static struct resolver_entry *queue_head, *queue_tail;
+static struct resolver_entry *completed;
+
+/* called with resolver_lock held */
+static void release_answer(struct resolver_answer *answer)
+{
+    if (answer != NULL && --answer->refs == 0) {
+        if (answer->addresses)
+            freeaddrinfo(answer->addresses);
+        free(answer);
+    }
+}
+
+/* Run callback on answer without the lock; returns with it held again. */
+static void deliver(struct resolver_answer *answer, resolver_callback callback, void *arg)
+{
+    answer->refs++;
+    pthread_mutex_unlock(&resolver_lock);
+    callback(arg, answer->addresses, answer->addresses ? NULL : gai_strerror(answer->error));
+    pthread_mutex_lock(&resolver_lock);
+    release_answer(answer);
+}
+
+static uint32_t hash_name(const char *str)
+{
+    uint32_t hash = 2166136261u;    /* FNV-1a */
+    while (*str)
+        hash = (hash ^ (unsigned char) *str++) * 16777619u;
+    return hash;
+}
+
+static struct resolver_entry **find_slot(const char *host)
+{
+    uint32_t i = hash_name(host) & (slot_count - 1);
+    while (slots[i] != NULL && strcmp(slots[i]->host, host) != 0)
+        i = (i + 1) & (slot_count - 1);
+    return &slots[i];
+}
+
+static struct resolver_entry *intern_entry(const char *host)
+{
+    struct resolver_entry **slot;
+
+    if ((entry_count + 1) * 2 > slot_count) {
+        struct resolver_entry **old_slots = slots;
+        int old_count = slot_count;
+
+        slot_count = slot_count ? slot_count * 2 : RESOLVER_MIN_SLOTS;
+        slots = calloc(slot_count, sizeof(struct resolver_entry *));
+        for (int i = 0; i < old_count; i++) {
+            if (old_slots[i] != NULL)
+                *find_slot(old_slots[i]->host) = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    slot = find_slot(host);
+    if (*slot == NULL) {
+        *slot = calloc(1, sizeof(struct resolver_entry));
+        (*slot)->host = strdup(host);
+        (*slot)->state = ENTRY_DONE;   /* expires == 0: stale, resolved on first use */
+        entry_count++;
+    }
+    return *slot;
+}
+
+/* -------------------------------------------------------------------------
+   WORKERS
+   ------------------------------------------------------------------------- */
+static void *resolver_thread(void *unused)
+{
+    (void) unused;
+    pthread_mutex_lock(&resolver_lock);
+    for (;;) {
+        struct resolver_entry *entry;
+        struct addrinfo hints;
+        struct resolver_answer *answer = calloc(1, sizeof(struct resolver_answer));
+        uint64_t one = 1;
+
+        while (queue_head == NULL) {
+            idle_threads++;
+            pthread_cond_wait(&resolver_work, &resolver_lock);
+            idle_threads--;
+        }
+        entry = queue_head;
+        queue_head = entry->next_queued;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        entry->state = ENTRY_RESOLVING;
+        pthread_mutex_unlock(&resolver_lock);
+
+        /* the host string never changes once interned */
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;   /* one entry per address; UDP uses the same ones */
+        hints.ai_flags = AI_ADDRCONFIG;
+        answer->refs = 1;
+        answer->error = getaddrinfo(entry->host, NULL, &hints, &answer->addresses);
+        if (answer->error != 0)
+            answer->addresses = NULL;
+
+        pthread_mutex_lock(&resolver_lock);
+        release_answer(entry->answer);
+        entry->answer = answer;
+        entry->expires = time(NULL) + (answer->error == 0 ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+        entry->state = ENTRY_DONE;
+        if (!entry->on_completed) {
+            entry->on_completed = 1;
+            entry->next_completed = completed;
+            completed = entry;
+        }
+        if (write(notify_fd, &one, sizeof(one)) < 0) {
+            /* counter overflow only, the fd stays readable */
+        }
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------
+   PUBLIC API
+   ------------------------------------------------------------------------- */
+int resolver_fd(void)
+{
+    pthread_mutex_lock(&resolver_lock);
+    if (notify_fd < 0)
+        notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&resolver_lock);
+    return notify_fd;
+}
+
+struct resolver_waiter *resolver_lookup(const char *host, resolver_callback callback, void *arg)
+{
+    struct resolver_entry *entry;
+    struct resolver_waiter *waiter;
+
+    if (resolver_fd() < 0) {
+        callback(arg, NULL, "resolver unavailable");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&resolver_lock);
+    entry = intern_entry(host);
+
+    if (entry->state == ENTRY_DONE && entry->expires > time(NULL)) {
+        deliver(entry->answer, callback, arg);
+        pthread_mutex_unlock(&resolver_lock);
+        return NULL;
+    }
+
+    waiter = malloc(sizeof(struct resolver_waiter));
+    waiter->entry = entry;
+    waiter->callback = callback;
+    waiter->arg = arg;
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+
+    /* stale: queue it, unless another lookup already did */
+    if (entry->state == ENTRY_DONE) {
+        entry->state = ENTRY_QUEUED;
+        entry->next_queued = NULL;
+        if (queue_tail)
+            queue_tail->next_queued = entry;
+        else
+            queue_head = entry;
+        queue_tail = entry;
+
+        if (idle_threads == 0 && thread_count < RESOLVER_THREADS) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, resolver_thread, NULL) == 0) {
+                pthread_detach(thread);
+                thread_count++;
+            }
+        }
+        pthread_cond_signal(&resolver_work);
+    }
+    pthread_mutex_unlock(&resolver_lock);
+    return waiter;
+}
+
+void resolver_cancel(struct resolver_waiter *waiter)
+{
+    struct resolver_waiter **link;
+
+    pthread_mutex_lock(&resolver_lock);
+    for (link = &waiter->entry->waiters; *link != NULL; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            free(waiter);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+void resolver_dispatch(void)
+{
+    uint64_t value;
+
+    if (read(notify_fd, &value, sizeof(value)) < 0) {
+        /* nothing signalled yet, completions may still be listed */
+    }
+
+    pthread_mutex_lock(&resolver_lock);
+    while (completed != NULL) {
+        struct resolver_entry *entry = completed;
+        struct resolver_waiter *waiter;
+
+        completed = entry->next_completed;
+        entry->on_completed = 0;
+        /* take one waiter at a time: a callback may cancel the others */
+        while ((waiter = entry->waiters) != NULL && entry->state == ENTRY_DONE) {
+            entry->waiters = waiter->next;
+            deliver(entry->answer, waiter->callback, waiter->arg);
+            free(waiter);
+        }
+    }
+    pthread_mutex_unlock(&resolver_lock);
+}
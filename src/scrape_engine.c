@@ -0,0 +1,2205 @@
+#define _GNU_SOURCE /* sendmmsg(), recvmmsg() */
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include "common.h"
+#include "scrapec.h"
+#include "scrape_engine.h"
+#include "conncache.h"
+#include "resolver.h"
+#include "http.h"
+#include "transport.h"
+#include "scrapecache.h"
+#include "trackerhealth.h"
+
+extern int option_timeout;
+extern int option_udp_retries;
+extern int option_max_age;
+extern int option_max_requests;
+extern int option_host_rate;
+extern int option_announce;
+
+#define EPOLL_BATCH 64
+
+/* timer wheel geometry: 256 slots of 50ms cover 12.8s per revolution */
+#define WHEEL_SLOTS   256
+#define WHEEL_TICK_MS 50
+
+/* Happy Eyeballs (RFC 8305): addresses tried per job, and the Connection
+   Attempt Delay before the next one joins the race */
+#define MAX_ADDRESSES 8
+#define RACE_DELAY_MS 250
+
+/* HTTP keep-alive pool: connections per tracker, requests pipelined on one
+   connection, and how long an idle connection is trusted to still be open */
+#define HTTP_MAX_CONNECTIONS 4
+#define HTTP_PIPELINE_DEPTH  8
+#define HTTP_IDLE_TIMEOUT    30000
+
+/* UDP: datagrams per sendmmsg()/recvmmsg() call, the largest reply read,
+   and the receive buffer asked for the shared sockets */
+#define UDP_BATCH       64
+#define UDP_PACKET_SIZE (8 + SCRAPE_UDP_MAX_HASHES * 12)
+#define UDP_RCVBUF      (1 << 20)
+
+#define CONTAINER_OF(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* -------------------------------------------------------------------------
+   JOB STATES
+   ------------------------------------------------------------------------- */
+enum {
+    JOB_DEFERRED,         /* the tracker's min_request_interval hasn't passed */
+    JOB_SCHEDULED,        /* resolved, waiting for a token of its host or a free slot */
+    JOB_RESOLVING,        /* waiting for the resolver, still holds every hash */
+    JOB_HTTP_WAITING,     /* no pooled connection can take it yet */
+    JOB_HTTP_QUEUED,      /* request written to a connection, response pending */
+    JOB_UDP_CONNECTING,   /* BEP 15 connect (action 0) sent */
+    JOB_UDP_SCRAPING      /* scrape (action 2), or announce (action 1), sent */
+};
+
+/* Anything registered with epoll; data.ptr points here (NULL is the resolver). */
+struct engine_source {
+    void (*event)(struct scrape_engine *engine, struct engine_source *source, unsigned int events);
+};
+
+struct engine_timer {
+    long long int at;             /* CLOCK_MONOTONIC milliseconds */
+    int slot;                     /* -1 while off the wheel */
+    struct engine_timer *prev, *next;
+    void (*fire)(struct scrape_engine *engine, struct engine_timer *timer, long long int now);
+};
+
+struct scrape_address {
+    struct sockaddr_storage addr;
+    socklen_t length;
+};
+
+/* Sockets racing to the addresses of one host. UDP jobs only use the
+   addresses and the schedule: their packets go out on the shared sockets. */
+struct scrape_race {
+    struct scrape_address addresses[MAX_ADDRESSES];  /* in RFC 8305 order */
+    int address_count;
+    int fds[MAX_ADDRESSES];       /* sockets still racing, and their addresses */
+    int indexes[MAX_ADDRESSES];
+    int count;
+    int next;                     /* next address to join the race */
+    long long int at;             /* when it joins, 0 for none */
+    int error;                    /* errno of the last attempt that failed */
+};
+
+struct job_queue {
+    struct scrape_job *head, *tail;
+    int length;
+};
+
+/* A tracker host: its token bucket and the jobs waiting for a token. */
+struct engine_host {
+    char *name;
+    double tokens;
+    long long int refilled;       /* when tokens was brought up to date */
+    struct job_queue ready;
+    struct engine_host *prev, *next;  /* ring, served round-robin */
+};
+
+/* What the engine remembers about a tracker URL between requests; the URL
+   is parsed once, when first seen. */
+struct engine_tracker {
+    char *url;
+    struct url_struct scrape;     /* protocol 0 if it has no scrape URL */
+    struct url_struct announce;   /* protocol 0 if the URL is unusable */
+    char error[ERRBUF_SIZE];      /* why not */
+    long long int not_before;     /* BEP 48 min_request_interval: no scrape until then */
+    struct engine_host *host;     /* NULL until it has been resolved */
+};
+
+/* One network exchange: a slice of a request's hashes sent to one tracker. */
+struct scrape_job {
+    struct engine_timer timer;    /* deadline, retransmission, race delay */
+    struct scrape_engine *engine;
+    struct scrape_request *request;
+    int first;                    /* slice of request->scrape_hashes */
+    int count;
+    int announce;                 /* a "stopped" announce for one hash instead of a scrape */
+    const struct url_struct *url; /* the tracker's scrape or announce URL */
+    struct engine_tracker *tracker;
+    long long int start_at;       /* while JOB_DEFERRED */
+    int active;                   /* holds one of the max_requests slots */
+    struct resolver_waiter *waiter;  /* while JOB_RESOLVING */
+    struct scrape_race race;      /* resolved addresses; UDP races on it */
+    int state;
+    long long int deadline;       /* LLONG_MAX for none */
+
+    /* HTTP */
+    const char *http_version;
+    struct http_connection *conn; /* carrying the request, NULL while waiting */
+    struct job_queue *queue;      /* its host's, the connection's or the engine's wait queue */
+    struct scrape_job *queue_prev, *queue_next;
+
+    /* UDP */
+    int winner;                   /* the address that answered, -1 while racing */
+    unsigned int failed;          /* bit per address that reported an error */
+    int queued;                   /* packets waiting in engine->udp_outbox */
+    char *buffer;                 /* packet being (re)sent */
+    int length;
+    int capacity;
+    unsigned int transaction_id;  /* kept across retransmissions of one packet; 0 for none */
+    unsigned char connection_id[8];
+    int cached_id;                /* connection_id came from the conncache */
+    long long int id_expires;     /* connection_id may be used until then */
+    int attempt;                  /* BEP 15 n for the packet in buffer */
+    long long int retransmit_at;  /* 0 for none */
+
+    struct scrape_job *prev, *next;
+};
+
+/* A persistent connection to one HTTP tracker. Requests are written as they
+   come (pipelined); responses arrive in the same order, so queue.head is
+   always the job the next response belongs to. */
+struct http_connection {
+    struct engine_source source;
+    struct engine_timer timer;    /* race delay while connecting */
+    char *host;
+    int port;
+    int tls;                      /* https:// */
+    int pooled;                   /* 0: HTTP/1.0, one request then closed */
+    struct scrape_race race;
+    int fd;                       /* -1 while connecting */
+    struct transport transport;   /* once connected */
+    int handshaking;              /* no requests go out until it's done */
+    int want_write;               /* the transport waits for EPOLLOUT */
+    int served;                   /* responses received */
+    long long int idle_since;
+    int dead;                     /* freed, waiting for the batch to end */
+
+    char *out;                    /* requests not yet sent */
+    int out_length;
+    int out_capacity;
+    int out_sent;
+
+    struct job_queue queue;
+    struct http_response response;
+    struct http_connection *prev, *next;
+};
+
+/* One unconnected UDP socket per address family, shared by every job. */
+struct udp_socket {
+    struct engine_source source;
+    int fd;                       /* -1 until first needed */
+};
+
+/* A packet waiting for the next sendmmsg(): job->buffer to one of its addresses. */
+struct udp_outgoing {
+    struct scrape_job *job;       /* NULL once the job is gone or moved on */
+    int address;
+};
+
+struct scrape_engine {
+    int epoll_fd;
+    int stopped;
+    struct scrape_job *jobs;      /* in flight */
+    struct http_connection *connections;
+    struct http_connection *graveyard;  /* may still have events in the batch */
+    struct job_queue http_waiting;
+    struct engine_tracker **trackers;  /* open addressing on the URL */
+    unsigned int tracker_mask;
+    int tracker_count;
+    struct engine_host *hosts;    /* the next one to serve */
+    int host_count;
+    int active;                   /* jobs holding a slot */
+    int dispatch_pending;         /* a slot or a token may have come free */
+    struct engine_timer dispatch_timer;  /* the next token, if jobs wait for one */
+    struct udp_socket udp[2];     /* [0] IPv4, [1] IPv6 */
+    struct scrape_job **udp_jobs; /* open addressing on the transaction_id */
+    unsigned int udp_mask;
+    int udp_count;
+    struct udp_outgoing *udp_outbox;
+    int udp_out_count;
+    int udp_out_capacity;
+    int udp_blocked;              /* sendmmsg() hit EAGAIN, waiting for EPOLLOUT */
+    unsigned char *udp_in;        /* UDP_BATCH reply buffers */
+    unsigned char peer_id[20];    /* announces */
+    struct engine_timer *wheel[WHEEL_SLOTS];
+    long long int wheel_tick;     /* next tick to process */
+};
+
+static long long int now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put_u32(unsigned char *ptr, unsigned int value)
+{
+    value = htonl(value);
+    memcpy(ptr, &value, 4);
+}
+
+static unsigned int get_u32(const unsigned char *ptr)
+{
+    unsigned int value;
+    memcpy(&value, ptr, 4);
+    return ntohl(value);
+}
+
+static void buffer_reserve(char **buffer, int *capacity, int needed)
+{
+    if (*capacity >= needed)
+        return;
+    while (*capacity < needed)
+        *capacity = *capacity ? *capacity * 2 : 4096;
+    *buffer = realloc(*buffer, *capacity);
+}
+
+static unsigned int hash_url(const char *url)
+{
+    unsigned int hash = 2166136261u;    /* FNV-1a */
+    while (*url)
+        hash = (hash ^ (unsigned char) *url++) * 16777619u;
+    return hash;
+}
+
+static struct engine_tracker **tracker_slot(struct scrape_engine *engine, const char *url)
+{
+    unsigned int pos = hash_url(url) & engine->tracker_mask;
+
+    while (engine->trackers[pos] != NULL && strcmp(engine->trackers[pos]->url, url) != 0)
+        pos = (pos + 1) & engine->tracker_mask;
+    return &engine->trackers[pos];
+}
+
+static struct engine_tracker *tracker_get(struct scrape_engine *engine, const char *url)
+{
+    struct engine_tracker **slot;
+
+    if ((engine->tracker_count + 1) * 2 > (int) engine->tracker_mask) {
+        struct engine_tracker **old_trackers = engine->trackers;
+        unsigned int old_mask = engine->tracker_mask;
+
+        engine->tracker_mask = old_trackers ? old_mask * 2 + 1 : 15;
+        engine->trackers = calloc(engine->tracker_mask + 1, sizeof(struct engine_tracker *));
+        for (unsigned int i = 0; old_trackers != NULL && i <= old_mask; i++) {
+            if (old_trackers[i] != NULL)
+                *tracker_slot(engine, old_trackers[i]->url) = old_trackers[i];
+        }
+        free(old_trackers);
+    }
+
+    slot = tracker_slot(engine, url);
+    if (*slot == NULL) {
+        struct engine_tracker *tracker = calloc(1, sizeof(struct engine_tracker));
+
+        tracker->url = strdup(url);
+        if (scrape_parse_announce_url(&tracker->announce, url, tracker->error) == 0)
+            scrape_parse_url(&tracker->scrape, url, tracker->error);
+        *slot = tracker;
+        engine->tracker_count++;
+    }
+    return *slot;
+}
+
+static void queue_push(struct job_queue *queue, struct scrape_job *job)
+{
+    job->queue = queue;
+    job->queue_next = NULL;
+    job->queue_prev = queue->tail;
+    if (queue->tail)
+        queue->tail->queue_next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    queue->length++;
+}
+
+static void queue_remove(struct scrape_job *job)
+{
+    struct job_queue *queue = job->queue;
+
+    if (job->queue_prev)
+        job->queue_prev->queue_next = job->queue_next;
+    else
+        queue->head = job->queue_next;
+    if (job->queue_next)
+        job->queue_next->queue_prev = job->queue_prev;
+    else
+        queue->tail = job->queue_prev;
+    queue->length--;
+    job->queue = NULL;
+    job->queue_prev = job->queue_next = NULL;
+}
+
+/* -------------------------------------------------------------------------
+   TIMER WHEEL
+   Jobs and connections embed an engine_timer. Slots hash by tick, so a slot
+   also holds timers from later revolutions; those are skipped until due.
+   ------------------------------------------------------------------------- */
+static void timer_cancel(struct scrape_engine *engine, struct engine_timer *timer)
+{
+    if (timer->slot < 0)
+        return;
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        engine->wheel[timer->slot] = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    timer->slot = -1;
+}
+
+/* (Re)arm timer for at; 0 just cancels it. */
+static void timer_arm(struct scrape_engine *engine, struct engine_timer *timer, long long int at)
+{
+    long long int tick;
+
+    timer_cancel(engine, timer);
+    if (at == 0)
+        return;
+    timer->at = at;
+    tick = at / WHEEL_TICK_MS + 1;
+    if (tick < engine->wheel_tick)
+        tick = engine->wheel_tick;
+    timer->slot = (int) (tick % WHEEL_SLOTS);
+    timer->next = engine->wheel[timer->slot];
+    if (timer->next)
+        timer->next->prev = timer;
+    engine->wheel[timer->slot] = timer;
+}
+
+/* Milliseconds until the first non-empty slot comes up, -1 if the wheel is empty. */
+static int timer_next_timeout(struct scrape_engine *engine, long long int now)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        if (engine->wheel[(engine->wheel_tick + i) % WHEEL_SLOTS]) {
+            long long int at = (engine->wheel_tick + i) * WHEEL_TICK_MS;
+            return at <= now ? 0 : (int) (at - now);
+        }
+    }
+    return -1;
+}
+
+static void timer_expire(struct scrape_engine *engine, long long int now)
+{
+    long long int now_tick = now / WHEEL_TICK_MS;
+
+    /* after a long idle stretch one pass over every slot is enough */
+    if (now_tick - engine->wheel_tick >= WHEEL_SLOTS)
+        engine->wheel_tick = now_tick - WHEEL_SLOTS + 1;
+
+    for (; engine->wheel_tick <= now_tick && !engine->stopped; engine->wheel_tick++) {
+        int slot = (int) (engine->wheel_tick % WHEEL_SLOTS);
+        struct engine_timer *timer;
+
+        /* rescan after each firing: a callback may cancel or re-arm other timers */
+        do {
+            for (timer = engine->wheel[slot]; timer != NULL && timer->at > now; timer = timer->next)
+                ;
+            if (timer != NULL) {
+                timer_cancel(engine, timer);
+                timer->fire(engine, timer, now);
+            }
+        } while (timer != NULL && !engine->stopped);
+    }
+}
+
+/* The job's timer goes off at the earliest of its deadline, its deferred
+   start, its next UDP retransmission and the next address joining its race. */
+static void job_arm(struct scrape_engine *engine, struct scrape_job *job)
+{
+    long long int at = job->deadline;
+
+    if (job->start_at && job->start_at < at)
+        at = job->start_at;
+    if (job->retransmit_at && job->retransmit_at < at)
+        at = job->retransmit_at;
+    if (job->race.at && job->race.at < at)
+        at = job->race.at;
+    timer_arm(engine, &job->timer, at);
+}
+
+/* -------------------------------------------------------------------------
+   JOB LIFECYCLE
+   ------------------------------------------------------------------------- */
+static void connection_abandon(struct scrape_engine *engine, struct scrape_job *job);
+static void udp_forget(struct scrape_engine *engine, struct scrape_job *job);
+static int announce_instead(struct scrape_engine *engine, struct scrape_job *job);
+
+/* Drop a hold on the request. The last one accounts for the tracker's
+   health, stores what the network answered in the scrape cache, merges it
+   with the cached results and runs the callback. */
+static void request_release(struct scrape_engine *engine, struct scrape_request *request)
+{
+    if (--request->pending_jobs > 0)
+        return;
+    if (request->scrape_count > 0 && request->started > 0 && !engine->stopped)
+        trackerhealth_record(request->url, request->status == 0, (int) (now_ms() - request->started),
+                             request->errbuf);
+    if (request->scrape_count > 0)
+        scrapecache_put(request->url, request->scrape_hashes, request->scrape_results, request->scrape_count,
+                        request->min_interval);
+    if (request->scrape_map != NULL) {
+        for (int i = 0; i < request->scrape_count; i++)
+            request->results[request->scrape_map[i]] = request->scrape_results[i];
+        free((void *) request->scrape_hashes);
+        free(request->scrape_results);
+        free(request->scrape_map);
+        request->scrape_map = NULL;
+    }
+    if (request->callback)
+        request->callback(request, request->arg);
+}
+
+/* Detach the job; the request's callback runs once its last job is gone. */
+static void finish_job(struct scrape_engine *engine, struct scrape_job *job, const char *error)
+{
+    struct scrape_request *request = job->request;
+
+    udp_forget(engine, job);
+    timer_cancel(engine, &job->timer);
+    if (job->waiter)
+        resolver_cancel(job->waiter);
+    if (job->conn)
+        connection_abandon(engine, job);
+    else if (job->queue)
+        queue_remove(job);
+    if (job->active) {
+        engine->active--;
+        engine->dispatch_pending = 1;
+    }
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        engine->jobs = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+
+    if (error != NULL && request->status == 0) {
+        request->status = 1;
+        snprintf(request->errbuf, ERRBUF_SIZE, "%s", error);
+    }
+    free(job->buffer);
+    free(job);
+
+    request_release(engine, request);
+}
+
+static void fail_job(struct scrape_engine *engine, struct scrape_job *job, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void fail_job(struct scrape_engine *engine, struct scrape_job *job, const char *format, ...)
+{
+    char errbuf[ERRBUF_SIZE];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(errbuf, ERRBUF_SIZE, format, ap);
+    va_end(ap);
+    finish_job(engine, job, errbuf);
+}
+
+static int watch_fd(struct scrape_engine *engine, struct engine_source *source, int fd, unsigned int events, int op)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+    return epoll_ctl(engine->epoll_fd, op, fd, &event);
+}
+
+/* -------------------------------------------------------------------------
+   HAPPY EYEBALLS (RFC 8305)
+   A race opens a socket to its first address, then another one every
+   RACE_DELAY_MS (or at once when an attempt fails) until a socket answers.
+   The winner is kept; every other attempt is closed. The owner arms a
+   timer for race->at. UDP jobs race on the same schedule without sockets
+   of their own, see udp_race_join().
+   ------------------------------------------------------------------------- */
+/* Add the next address that gets a socket to the race; 0 if none is left. */
+static int race_open(struct scrape_engine *engine, struct scrape_race *race, struct engine_source *source)
+{
+    while (race->next < race->address_count) {
+        int index = race->next++;
+        struct scrape_address *address = &race->addresses[index];
+        int fd = socket(address->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (fd == -1) {
+            race->error = errno;
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *) &address->addr, address->length) != 0 && errno != EINPROGRESS) {
+            race->error = errno;
+            close(fd);
+            continue;
+        }
+        watch_fd(engine, source, fd, EPOLLOUT, EPOLL_CTL_ADD);
+        race->fds[race->count] = fd;
+        race->indexes[race->count++] = index;
+
+        race->at = race->next < race->address_count ? now_ms() + RACE_DELAY_MS : 0;
+        return 1;
+    }
+    race->at = 0;
+    return 0;
+}
+
+static void race_drop(struct scrape_race *race, int index)
+{
+    close(race->fds[index]);
+    race->count--;
+    race->fds[index] = race->fds[race->count];
+    race->indexes[index] = race->indexes[race->count];
+}
+
+/* Keep the socket at index, close the others; returns the winner's fd. */
+static int race_win(struct scrape_race *race, int index)
+{
+    int fd = race->fds[index];
+
+    for (int i = 0; i < race->count; i++) {
+        if (i != index)
+            close(race->fds[i]);
+    }
+    race->count = 0;
+    race->at = 0;
+    return fd;
+}
+
+static void race_close(struct scrape_race *race)
+{
+    while (race->count > 0)
+        close(race->fds[--race->count]);
+    race->at = 0;
+}
+
+/* An attempt failed: start the next one now. Returns 0 once nothing is left racing. */
+static int race_lost(struct scrape_engine *engine, struct scrape_race *race, struct engine_source *source,
+                     int index, int error)
+{
+    race->error = error;
+    race_drop(race, index);
+    return race_open(engine, race, source) || race->count > 0;
+}
+
+/* Which racing TCP connect finished? The index of the winner, -1 if none
+   has yet, -2 once every address failed (race->error says why). */
+static int race_connected(struct scrape_engine *engine, struct scrape_race *race, struct engine_source *source)
+{
+    struct pollfd fds[MAX_ADDRESSES];
+    int count = race->count;
+
+    for (int i = 0; i < count; i++) {
+        fds[i].fd = race->fds[i];
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+    }
+    if (poll(fds, count, 0) <= 0)
+        return -1;
+
+    /* backwards: race_lost() moves the last attempt into the freed slot */
+    for (int i = count - 1; i >= 0; i--) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+
+        if (!(fds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+            continue;
+        getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error == 0)
+            return i;
+        if (!race_lost(engine, race, source, i, error))
+            return -2;
+    }
+    return -1;
+}
+
+/* -------------------------------------------------------------------------
+   HTTP CONNECTION POOL
+   Jobs wait on engine->http_waiting until a connection to their tracker
+   can take them: an idle one, one that already answered with keep-alive
+   and has fewer than HTTP_PIPELINE_DEPTH requests outstanding, or a new
+   one while the tracker has fewer than HTTP_MAX_CONNECTIONS. Connections
+   outlive scrape_engine_run(), so later rounds reuse them.
+   ------------------------------------------------------------------------- */
+static void http_complete(struct scrape_engine *engine, struct scrape_job *job, struct http_response *response);
+static void http_pump(struct scrape_engine *engine);
+static void connection_event(struct scrape_engine *engine, struct engine_source *source, unsigned int events);
+static void connection_timer(struct scrape_engine *engine, struct engine_timer *timer, long long int now);
+
+/* Events for its fd may still be in the current epoll batch: the memory
+   goes once the batch is done. */
+static void connection_free(struct scrape_engine *engine, struct http_connection *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        engine->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    if (conn->fd >= 0) {
+        conn->transport.ops->close(&conn->transport);
+        close(conn->fd);
+    }
+    race_close(&conn->race);
+    timer_cancel(engine, &conn->timer);
+    conn->dead = 1;
+    conn->next = engine->graveyard;
+    engine->graveyard = conn;
+}
+
+static void free_graveyard(struct scrape_engine *engine)
+{
+    while (engine->graveyard) {
+        struct http_connection *conn = engine->graveyard;
+
+        engine->graveyard = conn->next;
+        http_response_free(&conn->response);
+        free(conn->out);
+        free(conn->host);
+        free(conn);
+    }
+}
+
+/* Move the connection's jobs back to the wait queue and free it. */
+static void connection_requeue(struct scrape_engine *engine, struct http_connection *conn)
+{
+    struct scrape_job *job;
+
+    while ((job = conn->queue.head) != NULL) {
+        queue_remove(job);
+        job->conn = NULL;
+        job->state = JOB_HTTP_WAITING;
+        queue_push(&engine->http_waiting, job);
+    }
+    connection_free(engine, conn);
+    http_pump(engine);
+}
+
+static void connection_fail(struct scrape_engine *engine, struct http_connection *conn, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* The connection broke. If the tracker had already answered on it and
+   closed it before starting the next response, it just ended the keep-alive
+   (idle timeout, request limit): the outstanding requests go to another
+   connection. That always follows progress, so it can't loop. Anything
+   else fails them. */
+static void connection_fail(struct scrape_engine *engine, struct http_connection *conn, const char *format, ...)
+{
+    char errbuf[ERRBUF_SIZE];
+    struct job_queue failed = { NULL, NULL, 0 };
+    struct scrape_job *job;
+    int retry = conn->served > 0 && conn->response.state == HTTP_STATUS_LINE && conn->response.line_length == 0;
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(errbuf, ERRBUF_SIZE, format, ap);
+    va_end(ap);
+
+    while ((job = conn->queue.head) != NULL) {
+        queue_remove(job);
+        job->conn = NULL;
+        if (retry) {
+            job->state = JOB_HTTP_WAITING;
+            queue_push(&engine->http_waiting, job);
+        }
+        else
+            queue_push(&failed, job);
+    }
+    connection_free(engine, conn);
+
+    while ((job = failed.head) != NULL) {
+        queue_remove(job);
+        finish_job(engine, job, errbuf);
+    }
+    http_pump(engine);
+}
+
+/* The job ends before its response came (timeout, cancel): that response
+   would be mistaken for the next one, so the connection goes and the other
+   jobs on it start over. */
+static void connection_abandon(struct scrape_engine *engine, struct scrape_job *job)
+{
+    struct http_connection *conn = job->conn;
+
+    queue_remove(job);
+    job->conn = NULL;
+    connection_requeue(engine, conn);
+}
+
+/* Always readable (but only what the handshake waits for while it runs);
+   writable too while requests are waiting to go out. */
+static void connection_watch(struct scrape_engine *engine, struct http_connection *conn)
+{
+    unsigned int events = EPOLLIN;
+
+    if (conn->fd < 0)
+        return;
+    if (conn->handshaking)
+        events = conn->want_write ? EPOLLOUT : EPOLLIN;
+    else if (conn->want_write || conn->out_sent < conn->out_length)
+        events |= EPOLLOUT;
+    watch_fd(engine, &conn->source, conn->fd, events, EPOLL_CTL_MOD);
+}
+
+/* Start connecting to the job's tracker; NULL (with errno) if no address took a socket. */
+static struct http_connection *connection_new(struct scrape_engine *engine, struct scrape_job *job, int pooled)
+{
+    struct http_connection *conn = calloc(1, sizeof(struct http_connection));
+
+    conn->host = strdup(job->url->host);
+    conn->port = job->url->port;
+    conn->tls = job->url->tls;
+    conn->pooled = pooled;
+    conn->fd = -1;
+    conn->source.event = connection_event;
+    conn->timer.slot = -1;
+    conn->timer.fire = connection_timer;
+    memcpy(conn->race.addresses, job->race.addresses, sizeof(job->race.addresses));
+    conn->race.address_count = job->race.address_count;
+    http_response_init(&conn->response);
+
+    if (!race_open(engine, &conn->race, &conn->source)) {
+        errno = conn->race.error;
+        http_response_free(&conn->response);
+        free(conn->host);
+        free(conn);
+        return NULL;
+    }
+    timer_arm(engine, &conn->timer, conn->race.at);
+
+    conn->next = engine->connections;
+    if (engine->connections)
+        engine->connections->prev = conn;
+    engine->connections = conn;
+    return conn;
+}
+
+/* A connection that can take the job now, NULL if it has to wait (or, with
+   *error set, if no new connection could be opened). */
+static struct http_connection *connection_get(struct scrape_engine *engine, struct scrape_job *job, int *error)
+{
+    struct http_connection *conn, *next, *best = NULL;
+    long long int now = now_ms();
+    int count = 0;
+
+    *error = 0;
+    if (strcmp(job->http_version, "1.0") == 0) {
+        conn = connection_new(engine, job, 0);
+        if (conn == NULL)
+            *error = errno;
+        return conn;
+    }
+
+    for (conn = engine->connections; conn != NULL; conn = next) {
+        int depth;
+
+        next = conn->next;
+        if (!conn->pooled || conn->port != job->url->port || conn->tls != job->url->tls ||
+            strcmp(conn->host, job->url->host) != 0)
+            continue;
+        if (conn->queue.length == 0 && conn->served > 0 && now - conn->idle_since >= HTTP_IDLE_TIMEOUT) {
+            connection_free(engine, conn);
+            continue;
+        }
+        count++;
+
+        /* pipeline only once the tracker showed it keeps the connection open */
+        depth = conn->served > 0 ? HTTP_PIPELINE_DEPTH : 1;
+        if (conn->queue.length < depth && (best == NULL || conn->queue.length < best->queue.length))
+            best = conn;
+    }
+    if (best != NULL || count >= HTTP_MAX_CONNECTIONS)
+        return best;
+
+    conn = connection_new(engine, job, 1);
+    if (conn == NULL)
+        *error = errno;
+    return conn;
+}
+
+/* Queue the job's request on conn; it goes out when the socket is writable. */
+static void connection_submit(struct scrape_engine *engine, struct http_connection *conn, struct scrape_job *job)
+{
+    struct scrape_request *request = job->request;
+    int request_length;
+    char *http_request;
+
+    if (job->announce)
+        http_request = scrape_build_http_announce(job->url, request->scrape_hashes[job->first], engine->peer_id,
+                                                  job->http_version, &request_length);
+    else
+        http_request = scrape_build_http_request(job->url, request->scrape_hashes + job->first, job->count,
+                                                 job->http_version, &request_length);
+    buffer_reserve(&conn->out, &conn->out_capacity, conn->out_length + request_length);
+    memcpy(conn->out + conn->out_length, http_request, request_length);
+    conn->out_length += request_length;
+    free(http_request);
+
+    job->conn = conn;
+    job->state = JOB_HTTP_QUEUED;
+    queue_push(&conn->queue, job);
+    connection_watch(engine, conn);
+}
+
+/* Hand waiting jobs to connections that can take them. */
+static void http_pump(struct scrape_engine *engine)
+{
+    struct scrape_job *job, *next;
+
+    for (job = engine->http_waiting.head; job != NULL && !engine->stopped; job = next) {
+        struct http_connection *conn;
+        int error;
+
+        next = job->queue_next;
+        conn = connection_get(engine, job, &error);
+        if (conn == NULL && error == 0)
+            continue;
+        queue_remove(job);
+        if (conn == NULL) {
+            fail_job(engine, job, "connect() error to %s:%d: %s", job->url->host, job->url->port, strerror(error));
+            /* its callback may have changed the queue */
+            next = engine->http_waiting.head;
+            continue;
+        }
+        connection_submit(engine, conn, job);
+    }
+}
+
+static void http_submit(struct scrape_engine *engine, struct scrape_job *job)
+{
+    job->state = JOB_HTTP_WAITING;
+    queue_push(&engine->http_waiting, job);
+    http_pump(engine);
+}
+
+/* Returns 0, or 1 if the connection failed (and is gone). */
+static int connection_flush(struct scrape_engine *engine, struct http_connection *conn)
+{
+    if (conn->out_sent == conn->out_length)
+        return 0;
+    while (conn->out_sent < conn->out_length) {
+        ssize_t len = conn->transport.ops->send(&conn->transport, conn->out + conn->out_sent,
+                                                conn->out_length - conn->out_sent);
+        if (len == TRANSPORT_ERROR) {
+            connection_fail(engine, conn, "send() error to %s:%d: %s", conn->host, conn->port,
+                            conn->transport.error);
+            return 1;
+        }
+        /* TLS may need to read first; EPOLLIN is always watched */
+        if (len < 0)
+            return 0;
+        conn->out_sent += len;
+    }
+    conn->out_sent = conn->out_length = 0;
+    connection_watch(engine, conn);
+    return 0;
+}
+
+/* The response at the head of the queue is complete. Returns 1 if the
+   connection is gone. */
+static int connection_response(struct scrape_engine *engine, struct http_connection *conn)
+{
+    struct scrape_job *job = conn->queue.head;
+    int keep_alive = conn->pooled && conn->response.keep_alive;
+
+    queue_remove(job);
+    job->conn = NULL;
+    conn->served++;
+    conn->idle_since = now_ms();
+    http_complete(engine, job, &conn->response);
+    if (conn->dead)
+        return 1;
+    http_response_reset(&conn->response);
+
+    if (!keep_alive) {
+        /* the tracker closes after this one: resend the rest elsewhere */
+        connection_requeue(engine, conn);
+        return 1;
+    }
+    return 0;
+}
+
+static void connection_receive(struct scrape_engine *engine, struct http_connection *conn)
+{
+    char data[16384];
+
+    for (;;) {
+        ssize_t len = conn->transport.ops->recv(&conn->transport, data, sizeof(data));
+        int offset = 0;
+
+        if (len == TRANSPORT_WANT_WRITE) {
+            conn->want_write = 1;
+            connection_watch(engine, conn);
+            break;
+        }
+        if (len == TRANSPORT_WANT_READ)
+            break;
+        if (len < 0) {
+            connection_fail(engine, conn, "recv() error from %s:%d: %s", conn->host, conn->port,
+                            conn->transport.error);
+            return;
+        }
+        if (len == 0) {
+            /* closed: fine while idle, and a body may run until the close */
+            if (conn->queue.head == NULL) {
+                connection_free(engine, conn);
+                return;
+            }
+            if (http_response_eof(&conn->response) == 0) {
+                if (connection_response(engine, conn))
+                    return;
+            }
+            if (conn->queue.head == NULL)
+                connection_free(engine, conn);
+            else
+                connection_fail(engine, conn, "HTTP scrape from %s:%d: %s", conn->host, conn->port,
+                                conn->response.error ? conn->response.error : "connection closed");
+            return;
+        }
+
+        while (offset < len) {
+            int used;
+
+            if (conn->queue.head == NULL) {
+                /* nobody asked for this */
+                connection_free(engine, conn);
+                return;
+            }
+            used = http_response_feed(&conn->response, data + offset, (int) len - offset);
+            if (used < 0) {
+                connection_fail(engine, conn, "bad HTTP response from %s:%d: %s", conn->host, conn->port,
+                                conn->response.error);
+                return;
+            }
+            offset += used;
+            if (conn->response.state == HTTP_DONE && connection_response(engine, conn))
+                return;
+        }
+    }
+    /* responses may have made room for waiting jobs */
+    http_pump(engine);
+}
+
+/* The TCP connect won: start the transport on the socket. Returns 1 if
+   the connection is gone. */
+static int connection_start(struct scrape_engine *engine, struct http_connection *conn, int fd)
+{
+    conn->fd = fd;
+    if (!conn->tls)
+        transport_plain(&conn->transport, fd);
+    else if (transport_tls(&conn->transport, fd, conn->host, conn->port) != 0) {
+        /* nothing to release, but connection_free() closes through it */
+        transport_plain(&conn->transport, fd);
+        connection_fail(engine, conn, "TLS to %s:%d: %s", conn->host, conn->port, conn->transport.error);
+        return 1;
+    }
+    conn->handshaking = 1;
+    return 0;
+}
+
+/* Returns 1 while the handshake runs, or if it failed (and the connection is gone). */
+static int connection_handshake(struct scrape_engine *engine, struct http_connection *conn)
+{
+    int status = conn->transport.ops->handshake(&conn->transport);
+
+    if (status == TRANSPORT_ERROR) {
+        connection_fail(engine, conn, "%s handshake with %s:%d: %s", conn->transport.ops->name, conn->host,
+                        conn->port, conn->transport.error);
+        return 1;
+    }
+    conn->want_write = status == TRANSPORT_WANT_WRITE;
+    if (status == 0)
+        conn->handshaking = 0;
+    connection_watch(engine, conn);
+    return conn->handshaking;
+}
+
+static void connection_event(struct scrape_engine *engine, struct engine_source *source, unsigned int events)
+{
+    struct http_connection *conn = CONTAINER_OF(source, struct http_connection, source);
+    int index;
+
+    (void) events;
+    if (conn->dead)
+        return;
+    if (conn->fd < 0) {
+        index = race_connected(engine, &conn->race, &conn->source);
+        if (index == -2) {
+            connection_fail(engine, conn, "connect() error to %s:%d: %s", conn->host, conn->port,
+                            strerror(conn->race.error));
+            return;
+        }
+        if (index < 0) {
+            timer_arm(engine, &conn->timer, conn->race.at);
+            return;
+        }
+        timer_cancel(engine, &conn->timer);
+        conn->idle_since = now_ms();
+        if (connection_start(engine, conn, race_win(&conn->race, index)))
+            return;
+    }
+    if (conn->handshaking && connection_handshake(engine, conn))
+        return;
+    if (conn->want_write) {
+        /* a read that waited for writability can go on */
+        conn->want_write = 0;
+        connection_watch(engine, conn);
+    }
+    if (connection_flush(engine, conn) == 0)
+        connection_receive(engine, conn);
+}
+
+/* The next address joins the race. */
+static void connection_timer(struct scrape_engine *engine, struct engine_timer *timer, long long int now)
+{
+    struct http_connection *conn = CONTAINER_OF(timer, struct http_connection, timer);
+
+    if (conn->race.at && conn->race.at <= now) {
+        if (!race_open(engine, &conn->race, &conn->source) && conn->race.count == 0) {
+            connection_fail(engine, conn, "connect() error to %s:%d: %s", conn->host, conn->port,
+                            strerror(conn->race.error));
+            return;
+        }
+    }
+    timer_arm(engine, &conn->timer, conn->race.at);
+}
+
+/* -------------------------------------------------------------------------
+   HTTP
+   ------------------------------------------------------------------------- */
+static void http_complete(struct scrape_engine *engine, struct scrape_job *job, struct http_response *response)
+{
+    struct scrape_request *request = job->request;
+    char errbuf[ERRBUF_SIZE];
+    int min_interval;
+
+    // Check for HTTP 505 response
+    if (response->status == 505) {
+        if (strcmp(job->http_version, "1.0") != 0) {
+            // Retry with HTTP/1.0
+            job->http_version = "1.0";
+            http_submit(engine, job);
+            return;
+        }
+        finish_job(engine, job, "HTTP version not supported (505) even after fallback");
+        return;
+    }
+
+    if (job->announce) {
+        if (scrape_parse_http_announce(response->status, response->body, response->body_length,
+                                       request->scrape_results + job->first, errbuf) != 0) {
+            finish_job(engine, job, errbuf);
+            return;
+        }
+        finish_job(engine, job, NULL);
+        return;
+    }
+    if (scrape_parse_http_response(response->status, response->body, response->body_length,
+                                   request->scrape_hashes + job->first, job->count,
+                                   request->scrape_results + job->first, &min_interval, errbuf) != 0) {
+        /* it answered, but won't scrape */
+        if (!announce_instead(engine, job))
+            finish_job(engine, job, errbuf);
+        return;
+    }
+    if (min_interval > 0) {
+        job->tracker->not_before = now_ms() + min_interval * 1000LL;
+        request->min_interval = min_interval;
+    }
+    finish_job(engine, job, NULL);
+}
+
+/* -------------------------------------------------------------------------
+   UDP (BEP 15)
+   Every job shares one unconnected socket per address family. Packets are
+   queued on engine->udp_outbox and leave in sendmmsg() batches before the
+   loop sleeps; replies are drained with recvmmsg() and handed to their job
+   by transaction_id. ICMP errors arrive on the sockets' error queues
+   (IP_RECVERR) and fail the address they name. A job races its addresses
+   like a TCP connect does: the next one gets the packet too after
+   RACE_DELAY_MS, or at once when one fails, and the first to answer wins.
+   ------------------------------------------------------------------------- */
+static void udp_socket_event(struct scrape_engine *engine, struct engine_source *source, unsigned int events);
+
+static int udp_socket_get(struct scrape_engine *engine, int family)
+{
+    struct udp_socket *udp = &engine->udp[family == AF_INET6];
+    int on = 1, size = UDP_RCVBUF;
+
+    if (udp->fd >= 0)
+        return udp->fd;
+    udp->fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (udp->fd < 0)
+        return -1;
+    if (family == AF_INET6) {
+        setsockopt(udp->fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        setsockopt(udp->fd, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on));
+    }
+    else
+        setsockopt(udp->fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+    /* a big batch of replies may arrive before we get to read them */
+    setsockopt(udp->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    watch_fd(engine, &udp->source, udp->fd, EPOLLIN, EPOLL_CTL_ADD);
+    if (engine->udp_in == NULL)
+        engine->udp_in = malloc(UDP_BATCH * UDP_PACKET_SIZE);
+    return udp->fd;
+}
+
+/* The address the job talks to: the winner, else the first one. */
+static struct sockaddr *udp_address(struct scrape_job *job)
+{
+    return (struct sockaddr *) &job->race.addresses[job->winner >= 0 ? job->winner : 0].addr;
+}
+
+static int same_address(const struct sockaddr_storage *a, const struct sockaddr *b)
+{
+    if (a->ss_family != b->sa_family)
+        return 0;
+    if (b->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *) a, *y = (const struct sockaddr_in6 *) b;
+        return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, 16) == 0;
+    }
+    if (b->sa_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *) a, *y = (const struct sockaddr_in *) b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    return 0;
+}
+
+/* Which of the job's addresses in play is this one? -1 if none. */
+static int udp_address_index(const struct scrape_job *job, const struct sockaddr *addr)
+{
+    if (job->winner >= 0)
+        return same_address(&job->race.addresses[job->winner].addr, addr) ? job->winner : -1;
+    for (int i = 0; i < job->race.next; i++) {
+        if (!(job->failed & 1u << i) && same_address(&job->race.addresses[i].addr, addr))
+            return i;
+    }
+    return -1;
+}
+
+/* ---- the transaction_id table ---- */
+static unsigned int hash_transaction(unsigned int id)
+{
+    id *= 2654435761u;
+    return id ^ id >> 16;
+}
+
+static struct scrape_job *udp_lookup(struct scrape_engine *engine, unsigned int id)
+{
+    unsigned int pos;
+
+    if (engine->udp_jobs == NULL)
+        return NULL;
+    for (pos = hash_transaction(id) & engine->udp_mask; engine->udp_jobs[pos] != NULL;
+         pos = (pos + 1) & engine->udp_mask) {
+        if (engine->udp_jobs[pos]->transaction_id == id)
+            return engine->udp_jobs[pos];
+    }
+    return NULL;
+}
+
+static void udp_insert(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned int pos = hash_transaction(job->transaction_id) & engine->udp_mask;
+
+    while (engine->udp_jobs[pos] != NULL)
+        pos = (pos + 1) & engine->udp_mask;
+    engine->udp_jobs[pos] = job;
+}
+
+static void udp_unregister(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned int pos, next;
+
+    if (job->transaction_id == 0)
+        return;
+    pos = hash_transaction(job->transaction_id) & engine->udp_mask;
+    while (engine->udp_jobs[pos] != job)
+        pos = (pos + 1) & engine->udp_mask;
+
+    /* backward shift: pull each later job of the probe sequence into the
+       hole unless its home slot lies between the hole and where it is */
+    for (next = (pos + 1) & engine->udp_mask; engine->udp_jobs[next] != NULL; next = (next + 1) & engine->udp_mask) {
+        unsigned int home = hash_transaction(engine->udp_jobs[next]->transaction_id) & engine->udp_mask;
+
+        if (((next - home) & engine->udp_mask) >= ((next - pos) & engine->udp_mask)) {
+            engine->udp_jobs[pos] = engine->udp_jobs[next];
+            pos = next;
+        }
+    }
+    engine->udp_jobs[pos] = NULL;
+    engine->udp_count--;
+    job->transaction_id = 0;
+}
+
+/* Give the job a fresh transaction_id, unique among the jobs in flight. */
+static void udp_register(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned int id;
+
+    udp_unregister(engine, job);
+    if ((engine->udp_count + 1) * 2 > (int) engine->udp_mask) {
+        struct scrape_job **old_jobs = engine->udp_jobs;
+        unsigned int old_mask = engine->udp_mask;
+
+        engine->udp_mask = old_jobs ? old_mask * 2 + 1 : 63;
+        engine->udp_jobs = calloc(engine->udp_mask + 1, sizeof(struct scrape_job *));
+        for (unsigned int i = 0; old_jobs != NULL && i <= old_mask; i++) {
+            if (old_jobs[i] != NULL)
+                udp_insert(engine, old_jobs[i]);
+        }
+        free(old_jobs);
+    }
+    do
+        id = (unsigned int) rand() * (unsigned int) rand();
+    while (id == 0 || udp_lookup(engine, id) != NULL);
+    job->transaction_id = id;
+    udp_insert(engine, job);
+    engine->udp_count++;
+}
+
+/* ---- the outbox ---- */
+static void udp_queue(struct scrape_engine *engine, struct scrape_job *job, int address)
+{
+    if (engine->udp_out_count == engine->udp_out_capacity) {
+        engine->udp_out_capacity = engine->udp_out_capacity ? engine->udp_out_capacity * 2 : UDP_BATCH;
+        engine->udp_outbox = realloc(engine->udp_outbox, sizeof(struct udp_outgoing) * engine->udp_out_capacity);
+    }
+    engine->udp_outbox[engine->udp_out_count].job = job;
+    engine->udp_outbox[engine->udp_out_count++].address = address;
+    job->queued++;
+}
+
+/* Drop the job's packets that haven't left yet. */
+static void udp_unqueue(struct scrape_engine *engine, struct scrape_job *job)
+{
+    for (int i = 0; job->queued > 0 && i < engine->udp_out_count; i++) {
+        if (engine->udp_outbox[i].job == job) {
+            engine->udp_outbox[i].job = NULL;
+            job->queued--;
+        }
+    }
+}
+
+static void udp_forget(struct scrape_engine *engine, struct scrape_job *job)
+{
+    udp_unregister(engine, job);
+    udp_unqueue(engine, job);
+}
+
+static const char *udp_exchange(const struct scrape_job *job)
+{
+    if (job->state == JOB_UDP_CONNECTING)
+        return "connect";
+    return job->announce ? "announce" : "scrape";
+}
+
+/* Addresses that got the packet and haven't failed. */
+static int udp_racing(const struct scrape_job *job)
+{
+    int count = 0;
+
+    for (int i = 0; i < job->race.next; i++)
+        count += !(job->failed & 1u << i);
+    return count;
+}
+
+/* The next address joins the race with the current packet; 0 if none is left. */
+static int udp_race_join(struct scrape_engine *engine, struct scrape_job *job)
+{
+    struct scrape_race *race = &job->race;
+
+    if (race->next >= race->address_count) {
+        race->at = 0;
+        return 0;
+    }
+    udp_queue(engine, job, race->next++);
+    race->at = race->next < race->address_count ? now_ms() + RACE_DELAY_MS : 0;
+    return 1;
+}
+
+/* Send job->buffer to the winner, or to every address still racing. */
+static void udp_send_packet(struct scrape_engine *engine, struct scrape_job *job)
+{
+    if (job->winner >= 0) {
+        udp_queue(engine, job, job->winner);
+        return;
+    }
+    for (int i = 0; i < job->race.next; i++) {
+        if (!(job->failed & 1u << i))
+            udp_queue(engine, job, i);
+    }
+}
+
+/* An address reported an error: while racing, the next one joins at once;
+   the job fails once none is left, or if it was the winner. */
+static void udp_address_failed(struct scrape_engine *engine, struct scrape_job *job, int address,
+                               const char *call, int error)
+{
+    if (job->winner >= 0 ? address != job->winner : (job->failed & 1u << address) != 0)
+        return; /* an address the job no longer cares about */
+    if (job->winner < 0) {
+        job->failed |= 1u << address;
+        job->race.error = error;
+        if (udp_race_join(engine, job) || udp_racing(job) > 0) {
+            job_arm(engine, job);
+            return;
+        }
+    }
+    fail_job(engine, job, "%s() error in UDP %s to %s:%d: %s", call, udp_exchange(job),
+             job->url->host, job->url->port, strerror(error));
+}
+
+/* Send the outbox, UDP_BATCH datagrams of one family per sendmmsg(). */
+static void udp_flush(struct scrape_engine *engine)
+{
+    int done = 0, retried = -1;
+
+    while (done < engine->udp_out_count) {
+        struct mmsghdr messages[UDP_BATCH];
+        struct iovec iovs[UDP_BATCH];
+        struct scrape_job *job;
+        int family, fd, count = 0, sent;
+
+        if (engine->udp_outbox[done].job == NULL) {
+            done++;
+            continue;
+        }
+        job = engine->udp_outbox[done].job;
+        family = job->race.addresses[engine->udp_outbox[done].address].addr.ss_family;
+        fd = udp_socket_get(engine, family);
+        if (fd < 0) {
+            int address = engine->udp_outbox[done].address;
+
+            engine->udp_outbox[done++].job = NULL;
+            job->queued--;
+            udp_address_failed(engine, job, address, "socket", errno);
+            continue;
+        }
+
+        /* the longest run of packets for the same socket */
+        memset(messages, 0, sizeof(messages));
+        for (; done + count < engine->udp_out_count && count < UDP_BATCH; count++) {
+            struct udp_outgoing *out = &engine->udp_outbox[done + count];
+            struct scrape_address *address;
+
+            if (out->job == NULL)
+                break;
+            address = &out->job->race.addresses[out->address];
+            if (address->addr.ss_family != family)
+                break;
+            iovs[count].iov_base = out->job->buffer;
+            iovs[count].iov_len = out->job->length;
+            messages[count].msg_hdr.msg_name = &address->addr;
+            messages[count].msg_hdr.msg_namelen = address->length;
+            messages[count].msg_hdr.msg_iov = &iovs[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+        }
+
+        sent = sendmmsg(fd, messages, count, 0);
+        if (sent < 0) {
+            int address = engine->udp_outbox[done].address;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                engine->udp_blocked = 1;
+                watch_fd(engine, &engine->udp[family == AF_INET6].source, fd, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                break;
+            }
+            /* the error may belong to an earlier ICMP message (it is on the
+               error queue too); only one that repeats is this packet's */
+            if (errno == EINTR || retried != done) {
+                retried = done;
+                continue;
+            }
+            engine->udp_outbox[done++].job = NULL;
+            job->queued--;
+            udp_address_failed(engine, job, address, "sendmmsg", errno);
+            continue;
+        }
+        for (int i = 0; i < sent; i++) {
+            engine->udp_outbox[done + i].job->queued--;
+            engine->udp_outbox[done + i].job = NULL;
+        }
+        done += sent;
+    }
+
+    memmove(engine->udp_outbox, engine->udp_outbox + done,
+            sizeof(struct udp_outgoing) * (engine->udp_out_count - done));
+    engine->udp_out_count -= done;
+}
+
+/* Send the packet in job->buffer as a new exchange; retransmissions restart at n = 0. */
+static void udp_transmit(struct scrape_engine *engine, struct scrape_job *job, int state)
+{
+    job->state = state;
+    job->attempt = 0;
+    /* a packet of the previous exchange still waiting is stale now */
+    udp_unqueue(engine, job);
+    if (job->winner < 0 && job->race.next == 0)
+        udp_race_join(engine, job); /* first packet: the race starts with it */
+    else
+        udp_send_packet(engine, job);
+    job->retransmit_at = now_ms() + SCRAPE_UDP_RETRANSMIT_BASE * 1000LL;
+    job_arm(engine, job);
+}
+
+static void udp_send_connect(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned char *packet;
+
+    buffer_reserve(&job->buffer, &job->capacity, 16);
+    packet = (unsigned char *) job->buffer;
+    udp_register(engine, job);
+    memcpy(packet, "\x00\x00\x04\x17\x27\x10\x19\x80", 8); /* standard magic connection_id */
+    put_u32(packet + 8, 0);        /* action: connect = 0 */
+    put_u32(packet + 12, job->transaction_id);
+    job->length = 16;
+    udp_transmit(engine, job, JOB_UDP_CONNECTING);
+}
+
+/* A "stopped" announce that wants no peers (action 1): the reply still
+   counts the swarm. */
+static void udp_send_announce(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned char *packet;
+
+    buffer_reserve(&job->buffer, &job->capacity, 98);
+    packet = (unsigned char *) job->buffer;
+    udp_register(engine, job);
+    memset(packet, 0, 98);         /* downloaded, left, uploaded, IP, key: 0 */
+    memcpy(packet, job->connection_id, 8);
+    put_u32(packet + 8, 1);        /* action: announce = 1 */
+    put_u32(packet + 12, job->transaction_id);
+    memcpy(packet + 16, job->request->scrape_hashes[job->first], 20);
+    memcpy(packet + 36, engine->peer_id, 20);
+    put_u32(packet + 80, 3);       /* event: stopped = 3 */
+    put_u32(packet + 92, 0);       /* num_want */
+    packet[96] = SCRAPE_ANNOUNCE_PORT >> 8;
+    packet[97] = SCRAPE_ANNOUNCE_PORT & 0xff;
+    job->length = 98;
+    udp_transmit(engine, job, JOB_UDP_SCRAPING);
+}
+
+static void udp_send_scrape(struct scrape_engine *engine, struct scrape_job *job)
+{
+    unsigned char *packet;
+
+    if (job->announce) {
+        udp_send_announce(engine, job);
+        return;
+    }
+    buffer_reserve(&job->buffer, &job->capacity, 16 + job->count * 20);
+    packet = (unsigned char *) job->buffer;
+    udp_register(engine, job);
+    memcpy(packet, job->connection_id, 8);
+    put_u32(packet + 8, 2);        /* action: scrape = 2 */
+    put_u32(packet + 12, job->transaction_id);
+    memcpy(packet + 16, job->request->scrape_hashes + job->first, job->count * 20);
+    job->length = 16 + job->count * 20;
+    udp_transmit(engine, job, JOB_UDP_SCRAPING);
+}
+
+/* No reply within 15 * 2^n seconds: resend the same packet, or give up after n = --udp-retries. */
+static void udp_retransmit(struct scrape_engine *engine, struct scrape_job *job, long long int now)
+{
+    const char *what = udp_exchange(job);
+
+    if (job->attempt >= option_udp_retries) {
+        /* some trackers silently drop an unknown connection_id */
+        if (job->cached_id && job->state == JOB_UDP_SCRAPING)
+            conncache_invalidate(udp_address(job));
+        fail_job(engine, job, "UDP %s: no response after %d retransmissions", what, job->attempt);
+        return;
+    }
+
+    /* the connection_id may have run out while we waited */
+    if (job->state == JOB_UDP_SCRAPING && now >= job->id_expires) {
+        udp_send_connect(engine, job);
+        return;
+    }
+
+    job->attempt++;
+    udp_send_packet(engine, job);
+    job->retransmit_at = now + (SCRAPE_UDP_RETRANSMIT_BASE * 1000LL << job->attempt);
+    job_arm(engine, job);
+}
+
+static void udp_start(struct scrape_engine *engine, struct scrape_job *job)
+{
+    /* a cached connection_id for any address skips the handshake, and the race */
+    for (int i = 0; i < job->race.address_count; i++) {
+        int remaining = conncache_get((struct sockaddr *) &job->race.addresses[i].addr, job->connection_id);
+        if (remaining > 0) {
+            job->cached_id = 1;
+            job->id_expires = now_ms() + remaining * 1000LL;
+            job->race.addresses[0] = job->race.addresses[i];
+            job->race.address_count = 1;
+            udp_send_scrape(engine, job);
+            return;
+        }
+    }
+    udp_send_connect(engine, job);
+}
+
+/* One datagram from a tracker. */
+static void udp_receive(struct scrape_engine *engine, const unsigned char *packet, int len,
+                        const struct sockaddr *from)
+{
+    struct scrape_job *job;
+    int address;
+    unsigned int action;
+
+    /* a late reply to an earlier exchange, or junk, or from an address the
+       job never sent this packet to: not an error, keep waiting */
+    if (len < 8 || (job = udp_lookup(engine, get_u32(packet + 4))) == NULL ||
+        (address = udp_address_index(job, from)) < 0)
+        return;
+    if (job->winner < 0) {
+        /* the first address to answer wins the race */
+        job->winner = address;
+        job->race.at = 0;
+        job_arm(engine, job);
+    }
+    action = get_u32(packet);
+
+    if (action == 3) {
+        /* a cached connection_id the tracker no longer accepts; forget it
+           and redo the handshake once */
+        if (job->cached_id && job->state == JOB_UDP_SCRAPING) {
+            conncache_invalidate(udp_address(job));
+            job->cached_id = 0;
+            udp_send_connect(engine, job);
+            return;
+        }
+        if (job->state == JOB_UDP_SCRAPING && announce_instead(engine, job))
+            return;
+        fail_job(engine, job, "tracker error: %.*s", len - 8, (const char *) packet + 8);
+        return;
+    }
+
+    if (job->state == JOB_UDP_CONNECTING) {
+        /* action, transaction_id, connection_id */
+        if (len < 16 || action != 0) {
+            fail_job(engine, job, "bad connect response: action=%u, length=%d", action, len);
+            return;
+        }
+        memcpy(job->connection_id, packet + 8, 8);
+        job->id_expires = now_ms() + CONNCACHE_TTL * 1000LL;
+        conncache_put(udp_address(job), job->connection_id);
+        udp_send_scrape(engine, job);
+        return;
+    }
+
+    /* action, transaction_id, interval, leechers, seeders, then peers */
+    if (job->announce) {
+        struct scrape_result *result = &job->request->scrape_results[job->first];
+
+        if (len < 20 || action != 1) {
+            fail_job(engine, job, "bad announce response: action=%u, length=%d", action, len);
+            return;
+        }
+        result->status = 0;
+        result->seeders = (int) get_u32(packet + 16);
+        result->completed = -1;
+        result->leechers = (int) get_u32(packet + 12);
+        finish_job(engine, job, NULL);
+        return;
+    }
+
+    /* action, transaction_id, then seeders/completed/leechers per hash */
+    if (action != 2) {
+        fail_job(engine, job, "bad scrape response: action=%u", action);
+        return;
+    }
+    for (int i = 0; i < job->count; i++) {
+        struct scrape_result *result = &job->request->scrape_results[job->first + i];
+        if (8 + (i + 1) * 12 > len)
+            continue; /* truncated reply, leave the hash unreported */
+        result->status = 0;
+        result->seeders   = (int) get_u32(packet + 8 + i * 12);
+        result->completed = (int) get_u32(packet + 8 + i * 12 + 4);
+        result->leechers  = (int) get_u32(packet + 8 + i * 12 + 8);
+    }
+    finish_job(engine, job, NULL);
+}
+
+/* ICMP errors: each names the destination of the packet that caused it,
+   which fails that address for every job sending to it. */
+static void udp_receive_errors(struct scrape_engine *engine, int fd)
+{
+    for (;;) {
+        struct sockaddr_storage to;
+        char control[512];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        struct scrape_job *job, *next;
+        int error = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &to;
+        msg.msg_namelen = sizeof(to);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                error = (int) ((struct sock_extended_err *) CMSG_DATA(cmsg))->ee_errno;
+        }
+        if (error == 0 || msg.msg_namelen == 0)
+            continue;
+        for (job = engine->jobs; job != NULL; job = next) {
+            int address;
+
+            next = job->next;
+            if ((job->state == JOB_UDP_CONNECTING || job->state == JOB_UDP_SCRAPING) &&
+                (address = udp_address_index(job, (struct sockaddr *) &to)) >= 0)
+                udp_address_failed(engine, job, address, "recv", error);
+        }
+    }
+}
+
+static void udp_socket_event(struct scrape_engine *engine, struct engine_source *source, unsigned int events)
+{
+    struct udp_socket *udp = CONTAINER_OF(source, struct udp_socket, source);
+    struct mmsghdr messages[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_storage from[UDP_BATCH];
+    int count;
+
+    if (events & EPOLLERR)
+        udp_receive_errors(engine, udp->fd);
+    if (events & EPOLLOUT) {
+        engine->udp_blocked = 0;
+        watch_fd(engine, source, udp->fd, EPOLLIN, EPOLL_CTL_MOD);
+    }
+    if (!(events & EPOLLIN))
+        return;
+
+    /* a full batch means there may be more */
+    do {
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovs[i].iov_base = engine->udp_in + i * UDP_PACKET_SIZE;
+            iovs[i].iov_len = UDP_PACKET_SIZE;
+            messages[i].msg_hdr.msg_name = &from[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            messages[i].msg_hdr.msg_iov = &iovs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        count = recvmmsg(udp->fd, messages, UDP_BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < count; i++)
+            udp_receive(engine, engine->udp_in + i * UDP_PACKET_SIZE, (int) messages[i].msg_len,
+                        (struct sockaddr *) &from[i]);
+    } while (count == UDP_BATCH);
+}
+
+/* -------------------------------------------------------------------------
+   TIMERS
+   ------------------------------------------------------------------------- */
+static void job_resolve(struct scrape_job *job);
+
+static void job_timer(struct scrape_engine *engine, struct engine_timer *timer, long long int now)
+{
+    struct scrape_job *job = CONTAINER_OF(timer, struct scrape_job, timer);
+
+    if (now < job->deadline) {
+        if (job->state == JOB_DEFERRED && job->start_at <= now) {
+            job->start_at = 0;
+            job_resolve(job);
+        }
+        else if (job->race.at && job->race.at <= now) {
+            udp_race_join(engine, job);
+            job_arm(engine, job);
+        }
+        else if (job->retransmit_at && job->retransmit_at <= now)
+            udp_retransmit(engine, job, now);
+        else
+            job_arm(engine, job); /* woke early */
+        return;
+    }
+
+    switch (job->state) {
+    case JOB_RESOLVING:
+        fail_job(engine, job, "cannot resolve hostname: '%s' (timeout)", job->url->host);
+        break;
+    case JOB_SCHEDULED:
+        fail_job(engine, job, "scrape of %s not started before the timeout (rate limit)", job->url->host);
+        break;
+    case JOB_HTTP_QUEUED:
+        if (job->conn->fd < 0)
+            fail_job(engine, job, "connect() to %s:%d: timeout", job->url->host, job->url->port);
+        else if (job->conn->handshaking)
+            fail_job(engine, job, "%s handshake with %s:%d: timeout", job->conn->transport.ops->name,
+                     job->url->host, job->url->port);
+        else
+            fail_job(engine, job, "HTTP %s from %s:%d: timeout", job->announce ? "announce" : "scrape",
+                     job->url->host, job->url->port);
+        break;
+    case JOB_UDP_CONNECTING:
+        fail_job(engine, job, "UDP connect: no response (timeout)");
+        break;
+    case JOB_UDP_SCRAPING:
+        /* some trackers silently drop an unknown connection_id */
+        if (job->cached_id)
+            conncache_invalidate(udp_address(job));
+        fail_job(engine, job, "UDP %s: no response (timeout)", udp_exchange(job));
+        break;
+    default:
+        fail_job(engine, job, "HTTP scrape from %s:%d: timeout", job->url->host, job->url->port);
+    }
+}
+
+/* -------------------------------------------------------------------------
+   SCHEDULER
+   A resolved job waits on its host until the host's token bucket and the
+   engine-wide max_requests both allow it. Hosts are served round-robin, one
+   job each per turn, so a big batch for one tracker doesn't starve others.
+   ------------------------------------------------------------------------- */
+static struct engine_host *host_get(struct scrape_engine *engine, const char *name)
+{
+    struct engine_host *host = engine->hosts;
+
+    for (int i = 0; i < engine->host_count; i++, host = host->next) {
+        if (strcmp(host->name, name) == 0)
+            return host;
+    }
+    host = calloc(1, sizeof(struct engine_host));
+    host->name = strdup(name);
+    host->tokens = SCRAPE_HOST_BURST;
+    host->refilled = now_ms();
+    if (engine->hosts == NULL) {
+        host->prev = host->next = host;
+        engine->hosts = host;
+    } else {
+        /* join just before the cursor: last in the current round */
+        host->next = engine->hosts;
+        host->prev = engine->hosts->prev;
+        host->prev->next = host;
+        engine->hosts->prev = host;
+    }
+    engine->host_count++;
+    return host;
+}
+
+/* Take a token if there is one; else 0, with *ready_at set to when there will be. */
+static int host_take_token(struct engine_host *host, long long int now, long long int *ready_at)
+{
+    if (option_host_rate <= 0)
+        return 1;
+    host->tokens += (now - host->refilled) * option_host_rate / 1000.0;
+    if (host->tokens > SCRAPE_HOST_BURST)
+        host->tokens = SCRAPE_HOST_BURST;
+    host->refilled = now;
+    if (host->tokens >= 1) {
+        host->tokens -= 1;
+        return 1;
+    }
+    *ready_at = now + (long long int) ((1 - host->tokens) * 1000 / option_host_rate) + 1;
+    return 0;
+}
+
+static void start_job(struct scrape_engine *engine, struct scrape_job *job)
+{
+    if (job->url->protocol == SCRAPE_PROTOCOL_UDP)
+        udp_start(engine, job);
+    else
+        http_submit(engine, job);
+}
+
+static void job_schedule(struct scrape_engine *engine, struct scrape_job *job)
+{
+    if (job->tracker->host == NULL)
+        job->tracker->host = host_get(engine, job->url->host);
+    job->state = JOB_SCHEDULED;
+    queue_push(&job->tracker->host->ready, job);
+    engine->dispatch_pending = 1;
+}
+
+/* Start whatever the limits allow, one job per host per turn. */
+static void schedule_dispatch(struct scrape_engine *engine)
+{
+    long long int now = now_ms(), wake_at = 0;
+    int idle = 0;
+
+    engine->dispatch_pending = 0;
+    while (idle < engine->host_count && (option_max_requests <= 0 || engine->active < option_max_requests)) {
+        struct engine_host *host = engine->hosts;
+        struct scrape_job *job = host->ready.head;
+        long long int ready_at = 0;
+
+        engine->hosts = host->next;
+        if (job == NULL || !host_take_token(host, now, &ready_at)) {
+            if (ready_at && (wake_at == 0 || ready_at < wake_at))
+                wake_at = ready_at;
+            idle++;
+            continue;
+        }
+        idle = 0;
+        queue_remove(job);
+        job->active = 1;
+        engine->active++;
+        start_job(engine, job);
+    }
+    /* only a token can wake a host now; a free slot sets dispatch_pending */
+    timer_arm(engine, &engine->dispatch_timer, idle == engine->host_count ? wake_at : 0);
+}
+
+static void dispatch_timer(struct scrape_engine *engine, struct engine_timer *timer, long long int now)
+{
+    (void) timer;
+    (void) now;
+    engine->dispatch_pending = 1;
+}
+
+/* -------------------------------------------------------------------------
+   RESOLUTION
+   ------------------------------------------------------------------------- */
+static struct scrape_job *new_job(struct scrape_engine *engine, struct scrape_request *request,
+                                  const struct url_struct *url, int first, int count, long long int deadline)
+{
+    struct scrape_job *job = calloc(1, sizeof(struct scrape_job));
+
+    job->timer.slot = -1;
+    job->timer.fire = job_timer;
+    job->engine = engine;
+    job->request = request;
+    job->first = first;
+    job->count = count;
+    job->url = url;
+    job->http_version = "1.1";
+    job->winner = -1;
+    job->deadline = deadline;
+
+    job->next = engine->jobs;
+    if (engine->jobs)
+        engine->jobs->prev = job;
+    engine->jobs = job;
+    request->pending_jobs++;
+    job_arm(engine, job);
+    return job;
+}
+
+/* The host is known: split the request into slices and schedule them all. */
+static void job_resolved(void *arg, const struct addrinfo *addresses, const char *error)
+{
+    struct scrape_job *job = arg;
+    struct scrape_engine *engine = job->engine;
+    struct scrape_race *race = &job->race;
+    const struct addrinfo *by_family[2][MAX_ADDRESSES];  /* [0] IPv4, [1] IPv6 */
+    int family_count[2] = { 0, 0 }, first_family = -1;
+    int chunk, count = job->count;
+
+    job->waiter = NULL;
+    for (const struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+        int family = address->ai_family == AF_INET6 ? 1 : address->ai_family == AF_INET ? 0 : -1;
+        if (family < 0 || family_count[family] == MAX_ADDRESSES)
+            continue;
+        if (first_family < 0)
+            first_family = family;
+        by_family[family][family_count[family]++] = address;
+    }
+
+    /* RFC 8305 section 4: alternate the families, starting with the one
+       getaddrinfo() (which sorts by RFC 6724) put first */
+    race->address_count = 0;
+    for (int i = 0; i < MAX_ADDRESSES; i++) {
+        for (int k = 0; k < 2; k++) {
+            int family = k == 0 ? first_family : !first_family;
+            struct scrape_address *target = &race->addresses[race->address_count];
+
+            if (first_family < 0 || i >= family_count[family] || race->address_count == MAX_ADDRESSES)
+                continue;
+            memcpy(&target->addr, by_family[family][i]->ai_addr, by_family[family][i]->ai_addrlen);
+            target->length = by_family[family][i]->ai_addrlen;
+            if (family == 1)
+                ((struct sockaddr_in6 *) &target->addr)->sin6_port = htons((unsigned short) job->url->port);
+            else
+                ((struct sockaddr_in *) &target->addr)->sin_port = htons((unsigned short) job->url->port);
+            race->address_count++;
+        }
+    }
+    if (race->address_count == 0) {
+        fail_job(engine, job, "cannot resolve hostname: '%s' (%s)", job->url->host,
+                 error ? error : "no usable address");
+        return;
+    }
+
+    /* UDP fits SCRAPE_UDP_MAX_HASHES per packet; HTTP keeps each URL to a
+       sane length; an announce is for one hash. Every slice runs as its own
+       job, as the scheduler allows. */
+    if (job->announce)
+        chunk = 1;
+    else
+        chunk = job->url->protocol == SCRAPE_PROTOCOL_UDP ? SCRAPE_UDP_MAX_HASHES : SCRAPE_HTTP_MAX_HASHES;
+    if (count > chunk)
+        job->count = chunk;
+    for (int first = chunk; first < count; first += chunk) {
+        struct scrape_job *slice = new_job(engine, job->request, job->url, first,
+                                           count - first < chunk ? count - first : chunk, job->deadline);
+        slice->tracker = job->tracker;
+        slice->announce = job->announce;
+        memcpy(slice->race.addresses, race->addresses, sizeof(race->addresses));
+        slice->race.address_count = race->address_count;
+        job_schedule(engine, slice);
+    }
+    job_schedule(engine, job);
+}
+
+/* The tracker answered, but won't scrape: with --announce, ask it for each
+   of the job's hashes with an announce instead, all at once as the
+   scheduler allows. 0 if that isn't an option; else the job is finished. */
+static int announce_instead(struct scrape_engine *engine, struct scrape_job *job)
+{
+    if (!option_announce || job->announce)
+        return 0;
+    for (int i = 0; i < job->count; i++) {
+        struct scrape_job *announce = new_job(engine, job->request, &job->tracker->announce, job->first + i, 1,
+                                              job->deadline);
+
+        announce->announce = 1;
+        announce->tracker = job->tracker;
+        memcpy(announce->race.addresses, job->race.addresses, sizeof(job->race.addresses));
+        announce->race.address_count = job->race.address_count;
+        job_schedule(engine, announce);
+    }
+    finish_job(engine, job, NULL);
+    return 1;
+}
+
+/* One job covers the whole request until the host is resolved; a cached
+   answer runs job_resolved() right away and may already have freed it. */
+static void job_resolve(struct scrape_job *job)
+{
+    struct resolver_waiter *waiter;
+
+    job->state = JOB_RESOLVING;
+    waiter = resolver_lookup(job->url->host, job_resolved, job);
+    if (waiter != NULL)
+        job->waiter = waiter;
+}
+
+/* -------------------------------------------------------------------------
+   PUBLIC API
+   ------------------------------------------------------------------------- */
+struct scrape_engine *scrape_engine_new(void)
+{
+    struct scrape_engine *engine = calloc(1, sizeof(struct scrape_engine));
+
+    engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    engine->wheel_tick = now_ms() / WHEEL_TICK_MS;
+    engine->dispatch_timer.slot = -1;
+    engine->dispatch_timer.fire = dispatch_timer;
+    memcpy(engine->peer_id, "-DT0000-", 8);
+    for (int i = 8; i < 20; i++)
+        engine->peer_id[i] = (unsigned char) rand();
+    for (int i = 0; i < 2; i++) {
+        engine->udp[i].source.event = udp_socket_event;
+        engine->udp[i].fd = -1;
+    }
+
+    /* resolver completions wake us like any socket, tagged with a NULL source */
+    if (resolver_fd() >= 0) {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, resolver_fd(), &event);
+    }
+    return engine;
+}
+
+void scrape_engine_free(struct scrape_engine *engine)
+{
+    /* nothing may be requeued from here on */
+    engine->stopped = 1;
+    while (engine->jobs)
+        finish_job(engine, engine->jobs, "cancelled");
+    while (engine->connections)
+        connection_free(engine, engine->connections);
+    free_graveyard(engine);
+    for (unsigned int i = 0; engine->trackers != NULL && i <= engine->tracker_mask; i++) {
+        if (engine->trackers[i] != NULL) {
+            free(engine->trackers[i]->url);
+            scrape_free_url(&engine->trackers[i]->scrape);
+            scrape_free_url(&engine->trackers[i]->announce);
+            free(engine->trackers[i]);
+        }
+    }
+    free(engine->trackers);
+    timer_cancel(engine, &engine->dispatch_timer);
+    for (int i = 0; i < engine->host_count; i++) {
+        struct engine_host *host = engine->hosts;
+
+        engine->hosts = host->next;
+        free(host->name);
+        free(host);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (engine->udp[i].fd >= 0)
+            close(engine->udp[i].fd);
+    }
+    free(engine->udp_jobs);
+    free(engine->udp_outbox);
+    free(engine->udp_in);
+    close(engine->epoll_fd);
+    free(engine);
+}
+
+void scrape_engine_submit(struct scrape_engine *engine, struct scrape_request *request, int timeout_ms)
+{
+    struct engine_tracker *tracker;
+    const struct url_struct *url;
+    struct scrape_job *job;
+    long long int deadline, not_before;
+
+    request->status = 0;
+    request->errbuf[0] = '\0';
+    request->pending_jobs = 1; /* held until every job is queued */
+    request->scrape_hashes = request->info_hashes;
+    request->scrape_results = request->results;
+    request->scrape_map = NULL;
+    request->scrape_count = 0;
+    request->min_interval = 0;
+    request->started = 0;
+    for (int i = 0; i < request->count; i++) {
+        request->results[i].status = 1;
+        request->results[i].name[0] = '\0';
+    }
+
+    if (timeout_ms <= 0 && option_timeout > 0)
+        timeout_ms = option_timeout * 1000;
+
+    /* a URL that has no scrape URL may still take announces */
+    tracker = tracker_get(engine, request->url);
+    url = tracker->scrape.protocol ? &tracker->scrape : option_announce ? &tracker->announce : NULL;
+    if (url == NULL || url->protocol == 0) {
+        snprintf(request->errbuf, ERRBUF_SIZE, "%s", tracker->error);
+        request->status = 1;
+        goto release;
+    }
+#ifndef HAVE_OPENSSL
+    if (url->tls) {
+        snprintf(request->errbuf, ERRBUF_SIZE, "https:// needs a build with OpenSSL");
+        request->status = 1;
+        goto release;
+    }
+#endif
+
+    /* without a timeout UDP jobs end with their retransmission schedule */
+    if (timeout_ms > 0)
+        deadline = now_ms() + timeout_ms;
+    else if (url->protocol == SCRAPE_PROTOCOL_UDP)
+        deadline = LLONG_MAX;
+    else
+        deadline = now_ms() + SCRAPE_DEFAULT_TIMEOUT * 1000;
+
+    /* fresh cached results need no network; only the rest is scraped */
+    for (int i = 0; i < request->count; i++) {
+        if (!scrapecache_get(request->url, request->info_hashes[i], option_max_age, &request->results[i]))
+            request->scrape_count++;
+    }
+    if (request->scrape_count == 0)
+        goto release;
+    if (request->scrape_count < request->count) {
+        unsigned char (*hashes)[20] = malloc(20 * request->scrape_count);
+        int count = 0;
+
+        request->scrape_results = malloc(sizeof(struct scrape_result) * request->scrape_count);
+        request->scrape_map = malloc(sizeof(int) * request->scrape_count);
+        for (int i = 0; i < request->count; i++) {
+            if (request->results[i].status == 0)
+                continue;
+            memcpy(hashes[count], request->info_hashes[i], 20);
+            request->scrape_results[count] = request->results[i];
+            request->scrape_map[count++] = i;
+        }
+        request->scrape_hashes = (const unsigned char (*)[20]) hashes;
+    }
+
+    job = new_job(engine, request, url, 0, request->scrape_count, deadline);
+    job->announce = url == &tracker->announce;
+    job->tracker = tracker;
+
+    /* the tracker asked for a pause between scrapes: wait it out if the
+       deadline allows, else don't bother it at all */
+    not_before = job->tracker->not_before;
+    if (not_before > now_ms()) {
+        if (not_before >= deadline) {
+            fail_job(engine, job, "tracker asks to wait %lld more seconds (min_request_interval)",
+                     (not_before - now_ms() + 999) / 1000);
+            goto release;
+        }
+        job->state = JOB_DEFERRED;
+        job->start_at = not_before;
+        request->started = not_before;
+        job_arm(engine, job);
+        goto release;
+    }
+    request->started = now_ms();
+    job_resolve(job);
+
+release:
+    request_release(engine, request);
+}
+
+void scrape_engine_stop(struct scrape_engine *engine)
+{
+    engine->stopped = 1;
+}
+
+void scrape_engine_run(struct scrape_engine *engine)
+{
+    struct epoll_event events[EPOLL_BATCH];
+
+    engine->stopped = 0;
+    while (engine->jobs != NULL && !engine->stopped) {
+        int count;
+
+        if (engine->dispatch_pending) {
+            schedule_dispatch(engine);
+            continue;
+        }
+        /* what this round queued leaves in as few syscalls as possible */
+        if (engine->udp_out_count > 0 && !engine->udp_blocked) {
+            udp_flush(engine);
+            continue;
+        }
+        count = epoll_wait(engine->epoll_fd, events, EPOLL_BATCH, timer_next_timeout(engine, now_ms()));
+
+        if (count < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < count; i++) {
+            struct engine_source *source = events[i].data.ptr;
+            if (source == NULL)
+                resolver_dispatch();
+            else
+                source->event(engine, source, events[i].events);
+        }
+        timer_expire(engine, now_ms());
+        free_graveyard(engine);
+    }
+
+    if (engine->stopped) {
+        while (engine->jobs)
+            finish_job(engine, engine->jobs, "cancelled");
+    }
+    free_graveyard(engine);
+}
@@ -1,6 +1,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -11,7 +12,10 @@
 #include "common.h"
 #include "benc.h"
 #include "torrent.h"
-#define CLOSESOCKET(s) close(s)
+#include "scrapec.h"
+#include "scrape_engine.h"
+#include "conncache.h"
+#include "scrapecache.h"
 
 /* -------------------------------------------------------------------------
    VERSION DEFINITION (for standalone usage)
@@ -26,436 +30,431 @@
 extern int option_timeout;
 
 /* -------------------------------------------------------------------------
-   INTERNAL URL STRUCT
+   scrape_parse_announce_url(): split a tracker URL (RFC 3986) into
+   url_struct: scheme, host, port, and the path with its query, which
+   private trackers use for the passkey. The fragment is dropped.
    ------------------------------------------------------------------------- */
-struct url_struct {
-    int protocol;     /* 1:HTTP; 2:UDP */
-    char host[64];    /* truncated length for demonstration */
-    int port;
-    char path[64];    /* truncated length for demonstration */
-};
-
-/* -------------------------------------------------------------------------
-   parse_url(): interpret the given URL into url_struct
-   ------------------------------------------------------------------------- */
-static int parse_url(struct url_struct *url_struct, const char *url, char *errbuf)
+int scrape_parse_announce_url(struct url_struct *url_struct, const char *url, char *errbuf)
 {
-    char *ptr, *ptr2;
-
-    /* Identify protocol (http:// or udp://) */
-    if (strncmp(url, "http://", 7) == 0) {
-        url_struct->protocol = 1; /* HTTP */
-        ptr = (char *) url + 7;
-    } else if (strncmp(url, "udp://", 6) == 0) {
-        url_struct->protocol = 2; /* UDP */
-        ptr = (char *) url + 6;
+    const char *authority, *host, *host_end, *port, *path, *end, *ptr;
+    size_t host_length, path_length;
+    char *buffer, *target;
+
+    memset(url_struct, 0, sizeof(*url_struct));
+
+    /* the scheme is case-insensitive; it gives the default port */
+    if (strncasecmp(url, "http://", 7) == 0) {
+        url_struct->protocol = SCRAPE_PROTOCOL_HTTP;
+        url_struct->port = 80;
+        authority = url + 7;
+    } else if (strncasecmp(url, "https://", 8) == 0) {
+        url_struct->protocol = SCRAPE_PROTOCOL_HTTP;
+        url_struct->tls = 1;
+        url_struct->port = 443;
+        authority = url + 8;
+    } else if (strncasecmp(url, "udp://", 6) == 0) {
+        url_struct->protocol = SCRAPE_PROTOCOL_UDP;
+        authority = url + 6;
     } else {
         snprintf(errbuf, ERRBUF_SIZE, "unrecognized protocol in URL: '%s'", url);
         errbuf[ERRBUF_SIZE - 1] = '\0';
-        return 1;
+        goto error;
     }
 
-    /* host[:port][/path] separation */
-    ptr2 = strchr(ptr, '/');
-    if (!ptr2) {
-        /* No '/' means entire remainder is host:port, no path given */
-        if (strlen(ptr) >= 64) {
-            snprintf(errbuf, ERRBUF_SIZE, "hostname is too long.");
-            return 1;
+    /* the path ends up in a request line: no spaces or control characters */
+    for (ptr = url; *ptr; ptr++) {
+        if ((unsigned char) *ptr <= ' ' || *ptr == 0x7f) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid character in URL.");
+            goto error;
         }
-        strncpy(url_struct->host, ptr, 64);
-        strncpy(url_struct->path, "/", 64);
-    } else {
-        /* We do have a path portion */
-        if (strlen(ptr) >= 64) {
-            snprintf(errbuf, ERRBUF_SIZE, "hostname is too long.");
-            return 1;
+    }
+
+    /* authority = [userinfo "@"] host [":" port], up to the path, query or fragment */
+    path = authority + strcspn(authority, "/?#");
+    if (memchr(authority, '@', path - authority)) {
+        snprintf(errbuf, ERRBUF_SIZE, "authentication not supported in URLs.");
+        goto error;
+    }
+    if (*authority == '[') {
+        /* an IPv6 literal, "[2001:db8::1]:6969", keeps its colons */
+        host = authority + 1;
+        host_end = memchr(host, ']', path - host);
+        if (!host_end || host_end == host || (host_end + 1 != path && host_end[1] != ':')) {
+            snprintf(errbuf, ERRBUF_SIZE, "invalid IPv6 address in URL.");
+            goto error;
         }
-        memcpy(url_struct->host, ptr, (size_t)(ptr2 - ptr));
-        url_struct->host[ptr2 - ptr] = '\0';
+        for (ptr = host; ptr < host_end; ptr++) {
+            if (!strchr("0123456789abcdefABCDEF:.", *ptr)) {
+                snprintf(errbuf, ERRBUF_SIZE, "invalid IPv6 address in URL.");
+                goto error;
+            }
+        }
+        port = host_end + 1 != path ? host_end + 1 : NULL;
+    } else {
+        host = authority;
+        port = memchr(authority, ':', path - authority);
+        host_end = port ? port : path;
+    }
+    if (host_end == host) {
+        snprintf(errbuf, ERRBUF_SIZE, "no host in URL.");
+        goto error;
+    }
 
-        if (strlen(ptr2) >= 64) {
-            snprintf(errbuf, ERRBUF_SIZE, "path is too long.");
-            return 1;
+    /* an empty port, "host:", means the default */
+    if (port != NULL && port + 1 != path) {
+        int value = 0;
+
+        for (ptr = port + 1; ptr < path; ptr++) {
+            if (*ptr < '0' || *ptr > '9' || (value = value * 10 + (*ptr - '0')) > 65535) {
+                snprintf(errbuf, ERRBUF_SIZE, "invalid port specified.");
+                goto error;
+            }
         }
-        strncpy(url_struct->path, ptr2, 64);
+        url_struct->port = value;
+    }
+    if (url_struct->port == 0) {
+        /* For UDP trackers, port is mandatory (we have no default like 80). */
+        snprintf(errbuf, ERRBUF_SIZE, url_struct->protocol == SCRAPE_PROTOCOL_UDP ?
+                 "no port specified for UDP URL." : "invalid port specified.");
+        goto error;
     }
 
-    /* Check for user:pass@host type cases (not supported) */
-    if (strchr(url_struct->host, '@')) {
-        snprintf(errbuf, ERRBUF_SIZE, "authentication not supported in URLs.");
+    /* host and path share one allocation; an empty path is "/" */
+    end = path + strcspn(path, "#");
+    host_length = host_end - host;
+    path_length = end - path;
+    buffer = malloc(host_length + path_length + 3);
+    memcpy(buffer, host, host_length);
+    buffer[host_length] = '\0';
+    url_struct->host = buffer;
+    url_struct->path = target = buffer + host_length + 1;
+    if (*path != '/')
+        *target++ = '/';
+    memcpy(target, path, path_length);
+    target[path_length] = '\0';
+    return 0;
+
+error:
+    url_struct->protocol = 0;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------
+   scrape_parse_url(): the same, with the path of an HTTP tracker's scrape
+   URL: a last path component starting with "announce" has that replaced
+   by "scrape"; the rest of it and the query stay
+   ------------------------------------------------------------------------- */
+int scrape_parse_url(struct url_struct *url_struct, const char *url, char *errbuf)
+{
+    char *last, *query;
+
+    if (scrape_parse_announce_url(url_struct, url, errbuf) != 0)
         return 1;
+    if (url_struct->protocol != SCRAPE_PROTOCOL_HTTP)
+        return 0;
+
+    query = url_struct->path + strcspn(url_struct->path, "?");
+    for (last = query; last[-1] != '/'; last--)
+        ;
+    if (query - last >= 6 && memcmp(last, "scrape", 6) == 0)
+        return 0;
+    if (query - last >= 8 && memcmp(last, "announce", 8) == 0) {
+        memcpy(last, "scrape", 6);
+        memmove(last + 6, last + 8, strlen(last + 8) + 1);
+        return 0;
     }
+    snprintf(errbuf, ERRBUF_SIZE, "path must contain /announce or /scrape for scraping, got: '%.*s'",
+             (int) (query - last + 1), last - 1);
+    scrape_free_url(url_struct);
+    return 1;
+}
 
-    /* If a ':port' is present, parse it out. Otherwise default. */
-    ptr = strchr(url_struct->host, ':');
-    if (!ptr) {
-        if (url_struct->protocol == 2) {
-            /* For UDP trackers, port is mandatory (we have no default like 80). */
-            snprintf(errbuf, ERRBUF_SIZE, "no port specified for UDP URL.");
-            return 1;
-        }
-        url_struct->port = 80; /* default for HTTP */
-    } else {
-        url_struct->port = strtol(ptr + 1, NULL, 10);
-        if (url_struct->port <= 0) {
-            snprintf(errbuf, ERRBUF_SIZE, "invalid port specified.");
-            return 1;
-        }
-        *ptr = '\0'; /* Truncate host string at the colon. */
+void scrape_free_url(struct url_struct *url_struct)
+{
+    free(url_struct->host);
+    memset(url_struct, 0, sizeof(*url_struct));
+}
+
+/* -------------------------------------------------------------------------
+   Index of a "files" dictionary: open addressing on the 20-byte keys.
+   Info hashes are uniformly distributed, so their first bytes make a
+   good hash. Returns the key entities, NULL slots empty.
+   ------------------------------------------------------------------------- */
+static unsigned int hash_info_hash(const unsigned char *info_hash)
+{
+    return (unsigned int) info_hash[0] << 24 | info_hash[1] << 16 | info_hash[2] << 8 | info_hash[3];
+}
+
+static struct benc_entity **index_files(struct benc_entity *files, unsigned int *pmask)
+{
+    struct benc_entity *key, **slots;
+    unsigned int mask = 15, count = 0;
+
+    for (key = files->dictionary.head; key != NULL && key->next != NULL; key = key->next->next)
+        count++;
+    while (mask < count * 2)
+        mask = mask * 2 + 1;
+    slots = calloc(mask + 1, sizeof(struct benc_entity *));
+
+    for (key = files->dictionary.head; key != NULL && key->next != NULL; key = key->next->next) {
+        unsigned int pos;
+
+        if (key->type != BENC_STRING || key->string.length != 20)
+            continue;
+        pos = hash_info_hash((const unsigned char *) key->string.str) & mask;
+        while (slots[pos] != NULL && memcmp(slots[pos]->string.str, key->string.str, 20) != 0)
+            pos = (pos + 1) & mask;
+        if (slots[pos] == NULL)
+            slots[pos] = key;  /* the first of duplicate keys wins */
     }
+    *pmask = mask;
+    return slots;
+}
 
-    /* For HTTP, forcibly rewrite "announce" -> "scrape" if needed */
-    if (url_struct->protocol == 1) {
-        ptr = strrchr(url_struct->path, '/');
-        if (!ptr) {
-            snprintf(errbuf, ERRBUF_SIZE, "invalid path in HTTP URL.");
-            return 1;
-        }
-        if (memcmp(ptr, "/scrape", 7) == 0) {
-            /* Already /scrape? OK. */
-        } else if (memcmp(ptr, "/announce", 9) == 0) {
-            /* Convert to /scrape */
-            int len = (int) strlen(ptr);
-            memcpy(ptr, "/scrape", 7);
-            memmove(ptr + 7, ptr + 9, (size_t)(len - 8)); /* shift leftover bytes (including terminating \0) */
-        } else {
-            snprintf(errbuf, ERRBUF_SIZE,
-                     "path must contain /announce or /scrape for scraping, got: '%s'", ptr);
-            return 1;
-        }
+static struct benc_entity *lookup_file(struct benc_entity **slots, unsigned int mask, const unsigned char *info_hash)
+{
+    unsigned int pos = hash_info_hash(info_hash) & mask;
+
+    for (; slots[pos] != NULL; pos = (pos + 1) & mask) {
+        if (memcmp(slots[pos]->string.str, info_hash, 20) == 0)
+            return slots[pos]->next;
     }
+    return NULL;
+}
+
+static int integer_field(struct benc_entity *dictionary, const char *key, int *value)
+{
+    struct benc_entity *entity = benc_lookup_string(dictionary, key);
 
+    if (entity == NULL || entity->type != BENC_INTEGER)
+        return 1;
+    *value = (int) entity->integer;
     return 0;
 }
 
 /* -------------------------------------------------------------------------
-   parse_http_response(): interpret HTTP response to extract seeders, etc.
+   scrape_parse_http_response(): interpret the decoded body of an HTTP
+   response to extract seeders, etc. for every requested info hash, and
+   the tracker's "flags" (BEP 48)
    ------------------------------------------------------------------------- */
-static int parse_http_response(const char *buffer, int buffer_length, int *result, char *errbuf)
+int scrape_parse_http_response(int status, const char *body, int body_length,
+                               const unsigned char (*info_hashes)[20], int count,
+                               struct scrape_result *results, int *min_interval, char *errbuf)
 {
-    const char *ptr;
-    struct benc_entity *root, *entity;
+    struct benc_entity *root, *files, *entity, **slots;
+    unsigned int mask;
 
-    /* Quick minimal checks */
-    if (buffer_length < 90) /* a "typical" successful scrape is bigger than this */
-        goto errout1;
-
-    /* Must have "HTTP/1.x 200 ..." near the start */
-    if (strncmp(buffer, "HTTP/1.0 200", 12) != 0 &&
-        strncmp(buffer, "HTTP/1.1 200", 12) != 0)
-        goto errout1;
-
-    /* Attempt to find end of headers */
-    ptr = strstr(buffer, "\r\n\r\n");
-    if (!ptr) {
-        /* Some servers may use just "\n\n" instead of CRLF pair */
-        ptr = strstr(buffer, "\n\n");
-        if (!ptr) goto errout1;
-        ptr -= 2; /* so that the offset after +4 is consistent below */
+    *min_interval = 0;
+    if (status != 200) {
+        snprintf(errbuf, ERRBUF_SIZE, "bad HTTP response: status %d", status);
+        return 1;
     }
-    ptr += 4; /* skip over that \r\n\r\n or \n\n boundary */
 
     /* Now parse the bencoded data from the HTTP body */
-    root = benc_parse_memory(ptr, buffer + buffer_length - ptr, NULL, errbuf);
+    root = benc_parse_memory(body, body_length, NULL, errbuf);
     if (!root) {
         /* Append the partial body to the error for debugging */
         snprintf(errbuf + strlen(errbuf), ERRBUF_SIZE - strlen(errbuf),
-                 "\nhttp data: %s", ptr);
+                 "\nhttp data: %.40s", body);
         errbuf[ERRBUF_SIZE - 1] = '\0';
         return 1;
     }
 
-    entity = benc_lookup_string(root, "files");
-    if (!entity || !entity->dictionary.head) {
-        goto errout2;
+    if (root->type != BENC_DICTIONARY)
+        goto errout;
+    entity = benc_lookup_string(root, "failure reason");
+    if (entity != NULL && entity->type == BENC_STRING) {
+        snprintf(errbuf, ERRBUF_SIZE, "tracker error: %.*s", entity->string.length, entity->string.str);
+        benc_free_entity(root);
+        return 1;
     }
-    /* Typically "files" dictionary has a single child whose name is the infohash. 
-       Then within it: "complete", "downloaded", and "incomplete". */
-    entity = entity->dictionary.head->next; /* jump to dictionary’s child—this is quite hacky, but that’s the code’s pattern */
-    if (!benc_lookup_string(entity, "complete") ||
-        !benc_lookup_string(entity, "downloaded") ||
-        !benc_lookup_string(entity, "incomplete"))
-    {
-        goto errout2;
+    entity = benc_lookup_string(root, "flags");
+    if (entity != NULL && entity->type == BENC_DICTIONARY &&
+        integer_field(entity, "min_request_interval", min_interval) == 0 && *min_interval < 0)
+        *min_interval = 0;
+
+    files = benc_lookup_string(root, "files");
+    if (!files || files->type != BENC_DICTIONARY) {
+        goto errout;
     }
 
-    /* Great, read it out. */
-    result[0] = (int) benc_lookup_string(entity, "complete")->integer;   /* seeders    */
-    result[1] = (int) benc_lookup_string(entity, "downloaded")->integer; /* completed */
-    result[2] = (int) benc_lookup_string(entity, "incomplete")->integer; /* leechers   */
+    /* "files" maps each 20-byte info hash to its "complete", "downloaded"
+       and "incomplete" counters, and maybe a "name"; hashes the tracker
+       doesn't know are absent, and it may add ones we didn't ask for. */
+    slots = index_files(files, &mask);
+    for (int i = 0; i < count; i++) {
+        struct benc_entity *name;
+
+        entity = lookup_file(slots, mask, info_hashes[i]);
+        results[i].status = 1;
+        results[i].name[0] = '\0';
+        if (entity == NULL || entity->type != BENC_DICTIONARY ||
+            integer_field(entity, "complete", &results[i].seeders) != 0 ||
+            integer_field(entity, "downloaded", &results[i].completed) != 0 ||
+            integer_field(entity, "incomplete", &results[i].leechers) != 0)
+            continue;
+
+        results[i].status = 0;
+        name = benc_lookup_string(entity, "name");
+        if (name != NULL && name->type == BENC_STRING)
+            snprintf(results[i].name, sizeof(results[i].name), "%.*s", name->string.length, name->string.str);
+    }
+    free(slots);
 
     benc_free_entity(root);
     return 0;
 
-errout2:
-    snprintf(errbuf, ERRBUF_SIZE, "error in HTTP scrape data. %s", ptr);
+errout:
+    snprintf(errbuf, ERRBUF_SIZE, "error in HTTP scrape data. %.40s", body);
     errbuf[ERRBUF_SIZE - 1] = '\0';
     benc_free_entity(root);
     return 1;
-
-errout1:
-    snprintf(errbuf, ERRBUF_SIZE, "bad HTTP response: %.80s", buffer);
-    errbuf[ERRBUF_SIZE - 1] = '\0';
-    return 1;
 }
 
 /* -------------------------------------------------------------------------
-   scrapec_http(): connect via TCP, send GET to the tracker’s /scrape URL
+   scrape_parse_http_announce(): the swarm's counts from the response to a
+   "stopped" announce; "downloaded" is not standard, completed is -1
+   without it
    ------------------------------------------------------------------------- */
-   static int scrapec_http_internal(const char *host, int port, const char *path,
-    const unsigned char *info_hash, int *result,
-    char *errbuf, const char *http_version);
-
-static int scrapec_http(const char *host, int port, const char *path,
-const unsigned char *info_hash, int *result, char *errbuf)
-{
-return scrapec_http_internal(host, port, path, info_hash, result, errbuf, "1.1");
-}
-
-static int scrapec_http_internal(const char *host, int port, const char *path,
-    const unsigned char *info_hash, int *result,
-    char *errbuf, const char *http_version)
+int scrape_parse_http_announce(int status, const char *body, int body_length,
+                               struct scrape_result *result, char *errbuf)
 {
-char buffer[8192];
-int buffer_length;
-struct hostent *hostent;
-int sock;
-struct sockaddr_in addr;
-
-/* Build the HTTP GET request */
-buffer_length = snprintf(buffer, sizeof(buffer),
-"GET %s?info_hash="
-"%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X"
-"%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X%%%02X"
-" HTTP/%s\r\n"
-"Accept: */*\r\n"
-"Connection: close\r\n"
-"User-Agent: dumptorrent-scrape\r\n"
-"Host: %s:%d\r\n\r\n",
-path,
-info_hash[0], info_hash[1], info_hash[2], info_hash[3],
-info_hash[4], info_hash[5], info_hash[6], info_hash[7],
-info_hash[8], info_hash[9], info_hash[10], info_hash[11],
-info_hash[12], info_hash[13], info_hash[14], info_hash[15],
-info_hash[16], info_hash[17], info_hash[18], info_hash[19],
-http_version, host, port);
-
-hostent = gethostbyname(host);
-if (!hostent || hostent->h_length != 4 || !hostent->h_addr_list[0]) {
-snprintf(errbuf, ERRBUF_SIZE, "cannot resolve hostname: '%s'", host);
-return 1;
-}
-
-memcpy(&addr.sin_addr, hostent->h_addr_list[0], 4);
-addr.sin_port = htons((unsigned short) port);
-addr.sin_family = AF_INET;
+    struct benc_entity *root, *entity;
 
-sock = socket(PF_INET, SOCK_STREAM, 0);
-if (sock == -1) {
-snprintf(errbuf, ERRBUF_SIZE, "socket() error");
-return 1;
+    if (status != 200) {
+        snprintf(errbuf, ERRBUF_SIZE, "bad HTTP response: status %d", status);
+        return 1;
+    }
+    root = benc_parse_memory(body, body_length, NULL, errbuf);
+    if (!root)
+        return 1;
+    entity = root->type == BENC_DICTIONARY ? benc_lookup_string(root, "failure reason") : NULL;
+    if (entity != NULL && entity->type == BENC_STRING) {
+        snprintf(errbuf, ERRBUF_SIZE, "tracker error: %.*s", entity->string.length, entity->string.str);
+        benc_free_entity(root);
+        return 1;
+    }
+    if (root->type != BENC_DICTIONARY || integer_field(root, "complete", &result->seeders) != 0 ||
+        integer_field(root, "incomplete", &result->leechers) != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "no peer counts in HTTP announce data. %.40s", body);
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        benc_free_entity(root);
+        return 1;
+    }
+    if (integer_field(root, "downloaded", &result->completed) != 0)
+        result->completed = -1;
+    result->status = 0;
+    result->name[0] = '\0';
+    benc_free_entity(root);
+    return 0;
 }
 
-if (option_timeout != 0) {
-struct timeval timeoutval = {option_timeout, 0};
-if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeoutval, sizeof(timeoutval)) == -1 ||
-setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeoutval, sizeof(timeoutval)) == -1)
+/* What joins the next parameter to the path: its query may be there already */
+static const char *query_separator(const char *path)
 {
-snprintf(errbuf, ERRBUF_SIZE, "setsockopt timeout error");
-CLOSESOCKET(sock);
-return 1;
-}
-}
+    size_t length = strlen(path);
 
-if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-snprintf(errbuf, ERRBUF_SIZE, "connect() error to %s:%d: %s", host, port, strerror(errno));
-CLOSESOCKET(sock);
-return 1;
+    if (!strchr(path, '?'))
+        return "?";
+    return path[length - 1] == '?' || path[length - 1] == '&' ? "" : "&";
 }
 
-if (send(sock, buffer, buffer_length, 0) != buffer_length) {
-snprintf(errbuf, ERRBUF_SIZE, "send() error");
-CLOSESOCKET(sock);
-return 1;
+/* %-encode 20 raw bytes */
+static char *append_escaped(char *ptr, const unsigned char *bytes)
+{
+    for (int j = 0; j < 20; j++)
+        ptr += sprintf(ptr, "%%%02X", bytes[j]);
+    return ptr;
 }
 
-buffer_length = 0;
-for (;;) {
-int len = (int)recv(sock, buffer + buffer_length, sizeof(buffer) - buffer_length - 1, 0);
-if (len < 0) {
-snprintf(errbuf, ERRBUF_SIZE, "recv() error");
-CLOSESOCKET(sock);
-return 1;
-}
-if (len == 0) break;
-buffer_length += len;
-if (buffer_length >= (int)sizeof(buffer) - 1) {
-snprintf(errbuf, ERRBUF_SIZE, "response too large for buffer");
-CLOSESOCKET(sock);
-return 1;
-}
+/* HTTP/1.1 keeps the connection for the next request; an IPv6 literal
+   goes back in brackets */
+static char *append_http_headers(char *ptr, const struct url_struct *url_struct, const char *http_version)
+{
+    return ptr + sprintf(ptr,
+                         " HTTP/%s\r\n"
+                         "Accept: */*\r\n"
+#ifdef HAVE_ZLIB
+                         "Accept-Encoding: gzip\r\n"
+#endif
+                         "%s"
+                         "User-Agent: dumptorrent-scrape\r\n"
+                         "Host: %s%s%s:%d\r\n\r\n",
+                         http_version, strcmp(http_version, "1.0") == 0 ? "Connection: close\r\n" : "",
+                         strchr(url_struct->host, ':') ? "[" : "", url_struct->host,
+                         strchr(url_struct->host, ':') ? "]" : "", url_struct->port);
 }
-CLOSESOCKET(sock);
 
-buffer[buffer_length] = '\0';
-
-// Check for HTTP 505 response
-if (strncmp(buffer, "HTTP/1.1 505", 12) == 0 || strncmp(buffer, "HTTP/1.0 505", 12) == 0) {
-if (strcmp(http_version, "1.0") != 0) {
-// Retry with HTTP/1.0
-return scrapec_http_internal(host, port, path, info_hash, result, errbuf, "1.0");
-}
-snprintf(errbuf, ERRBUF_SIZE, "HTTP version not supported (505) even after fallback");
-return 1;
+/* -------------------------------------------------------------------------
+   scrape_build_http_request(): GET for the tracker's /scrape URL with one
+   info_hash parameter per requested hash
+   ------------------------------------------------------------------------- */
+char *scrape_build_http_request(const struct url_struct *url_struct, const unsigned char (*info_hashes)[20],
+                                int count, const char *http_version, int *plength)
+{
+    char *request, *ptr;
+
+    /* 71 bytes per "&info_hash=%XX..." parameter */
+    request = malloc(strlen(url_struct->path) + strlen(url_struct->host) + count * 72 + 256);
+    ptr = request + sprintf(request, "GET %s", url_struct->path);
+    for (int i = 0; i < count; i++) {
+        ptr += sprintf(ptr, "%sinfo_hash=", i == 0 ? query_separator(url_struct->path) : "&");
+        ptr = append_escaped(ptr, info_hashes[i]);
+    }
+    ptr = append_http_headers(ptr, url_struct, http_version);
+    *plength = (int) (ptr - request);
+    return request;
 }
 
-return parse_http_response(buffer, buffer_length, result, errbuf);
+/* -------------------------------------------------------------------------
+   scrape_build_http_announce(): GET for the tracker's announce URL that
+   asks for no peers and leaves the swarm at once ("stopped"), for the
+   counts that come with the answer
+   ------------------------------------------------------------------------- */
+char *scrape_build_http_announce(const struct url_struct *url_struct, const unsigned char *info_hash,
+                                 const unsigned char *peer_id, const char *http_version, int *plength)
+{
+    char *request, *ptr;
+
+    request = malloc(strlen(url_struct->path) + strlen(url_struct->host) + 512);
+    ptr = request + sprintf(request, "GET %s%sinfo_hash=", url_struct->path, query_separator(url_struct->path));
+    ptr = append_escaped(ptr, info_hash);
+    ptr += sprintf(ptr, "&peer_id=");
+    ptr = append_escaped(ptr, peer_id);
+    ptr += sprintf(ptr, "&port=%d&uploaded=0&downloaded=0&left=0&event=stopped&numwant=0&compact=1",
+                   SCRAPE_ANNOUNCE_PORT);
+    ptr = append_http_headers(ptr, url_struct, http_version);
+    *plength = (int) (ptr - request);
+    return request;
 }
 
-
 /* -------------------------------------------------------------------------
-   scrapec_udp(): connect via UDP, do the standard handshake for UDP trackers
+   scrapec_batch(): scrape many info hashes from one tracker in as few
+   requests as the protocol allows. Returns 1 (with errbuf) if the tracker
+   couldn't be reached; otherwise 0, with results[i].status telling which
+   hashes the tracker actually reported.
    ------------------------------------------------------------------------- */
-static int scrapec_udp(const char *host, int port,
-                       const unsigned char *info_hash, int *result, char *errbuf)
+int scrapec_batch(const char *url, const unsigned char (*info_hashes)[20], int count,
+                  struct scrape_result *results, char *errbuf)
 {
-    struct hostent *hostent;
-    int sock;
-    struct sockaddr_in addr;
-    union {
-        struct {
-            unsigned char connection_id[8];
-            unsigned int action;
-            unsigned int transaction_id;
-        } ci; /* connect input */
-        struct {
-            unsigned int action;
-            unsigned int transaction_id;
-            unsigned char connection_id[8];
-        } co; /* connect output */
-        struct {
-            unsigned char connection_id[8];
-            unsigned int action;
-            unsigned int transaction_id;
-            unsigned char info_hash[20];
-        } si; /* scrape input */
-        struct {
-            unsigned int action;
-            unsigned int transaction_id;
-            unsigned int seeders;
-            unsigned int completed;
-            unsigned int leechers;
-        } so; /* scrape output */
-        unsigned char raw[64]; /* fallback space if needed */
-    } buffer;
-    unsigned int r;
-    unsigned char connection_id[8];
-
-    /* DNS resolution */
-    hostent = gethostbyname(host);
-    if (!hostent || hostent->h_length != 4) {
-        snprintf(errbuf, ERRBUF_SIZE, "cannot resolve hostname: '%s'", host);
-        return 1;
-    }
-    memcpy(&addr.sin_addr, hostent->h_addr_list[0], 4);
-    addr.sin_port = htons((unsigned short) port);
-    addr.sin_family = AF_INET;
-
-    /* Create UDP socket */
-    sock = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sock == -1) {
-        snprintf(errbuf, ERRBUF_SIZE, "socket() error (UDP)");
-        return 1;
-    }
-
-    /* Timeouts if any */
-    if (option_timeout != 0) {
-        struct timeval timeoutval = {option_timeout, 0};
-        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeoutval, sizeof(timeoutval)) == -1 ||
-            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeoutval, sizeof(timeoutval)) == -1)
-        {
-            snprintf(errbuf, ERRBUF_SIZE, "setsockopt timeout error (UDP)");
-            CLOSESOCKET(sock);
-            return 1;
-        }
-    }
-
-    /* 'connect' UDP (really just sets default peer) */
-    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        snprintf(errbuf, ERRBUF_SIZE, "connect() error (UDP) to %s:%d: %s", host, port, strerror(errno));
-        CLOSESOCKET(sock);
-        return 1;
-    }
-
-    /* First handshake: send connect request */
-    r = (unsigned int) rand() * (unsigned int) rand(); /* random 32-bit for transaction ID */
-    memcpy(buffer.ci.connection_id, "\x00\x00\x04\x17\x27\x10\x19\x80", 8); /* standard magic connection_id */
-    buffer.ci.action = htonl(0);       /* action: connect = 0 */
-    buffer.ci.transaction_id = r;
-    if ((int)send(sock, &buffer, sizeof(buffer.ci), 0) != (int)sizeof(buffer.ci)) {
-        snprintf(errbuf, ERRBUF_SIZE, "send() error in UDP connect");
-        CLOSESOCKET(sock);
+    struct scrape_engine *engine;
+    struct scrape_request request;
+
+    memset(&request, 0, sizeof(request));
+    request.url = url;
+    request.info_hashes = info_hashes;
+    request.count = count;
+    request.results = results;
+
+    engine = scrape_engine_new();
+    scrape_engine_submit(engine, &request, 0);
+    scrape_engine_run(engine);
+    scrape_engine_free(engine);
+
+    if (request.status != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s", request.errbuf);
         return 1;
     }
-
-    /* Receive connect response (the “udp_connect_output”) */
-    int recv_len = recv(sock, &buffer, sizeof(buffer), 0);
-    if (recv_len < (int)sizeof(buffer.co)) {
-        if (recv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            snprintf(errbuf, ERRBUF_SIZE, "UDP connect: no response (timeout)");
-        } else {
-            snprintf(errbuf, ERRBUF_SIZE, "recv() error in UDP connect: %s", strerror(errno));
-        }
-        CLOSESOCKET(sock);
-        return 1;
-    }
-    if (buffer.co.transaction_id != r || buffer.co.action != htonl(0)) {
-        snprintf(errbuf, ERRBUF_SIZE,
-                 "bad connect response: transaction_id=%x, expected=%x, action=%d",
-                 ntohl(buffer.co.transaction_id), ntohl(r), ntohl(buffer.co.action));
-        CLOSESOCKET(sock);
-        return 1;
-    }
-    memcpy(connection_id, buffer.co.connection_id, 8);
-
-    /* Second handshake: send scrape request */
-    r = (unsigned int) rand() * (unsigned int) rand();
-    memcpy(buffer.si.connection_id, connection_id, 8);
-    buffer.si.action = htonl(2); /* action: scrape = 2 */
-    buffer.si.transaction_id = r;
-    memcpy(buffer.si.info_hash, info_hash, 20);
-    if ((int)send(sock, &buffer, sizeof(buffer.si), 0) != (int)sizeof(buffer.si)) {
-        snprintf(errbuf, ERRBUF_SIZE, "send() error in UDP scrape");
-        CLOSESOCKET(sock);
-        return 1;
-    }
-
-    /* Receive scrape response (the “udp_scrape_output”) */
-    recv_len = recv(sock, &buffer, sizeof(buffer), 0);
-    if (recv_len < (int)sizeof(buffer.so)) {
-        if (recv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            snprintf(errbuf, ERRBUF_SIZE, "UDP scrape: no response (timeout)");
-        } else {
-            snprintf(errbuf, ERRBUF_SIZE, "recv() error in UDP scrape");
-        }
-        CLOSESOCKET(sock);
-        return 1;
-    }
-    if (buffer.so.transaction_id != r || buffer.so.action != htonl(2)) {
-        snprintf(errbuf, ERRBUF_SIZE,
-                 "bad scrape response: transaction_id=%x, expected=%x, action=%d",
-                 ntohl(buffer.so.transaction_id), ntohl(r), ntohl(buffer.so.action));
-        CLOSESOCKET(sock);
-        return 1;
-    }
-
-    /* Convert from network order to host.  */
-    result[0] = (int) ntohl(buffer.so.seeders);
-    result[1] = (int) ntohl(buffer.so.completed);
-    result[2] = (int) ntohl(buffer.so.leechers);
-
-    CLOSESOCKET(sock);
     return 0;
 }
 
@@ -465,19 +464,18 @@ static int scrapec_udp(const char *host, int port,
    ------------------------------------------------------------------------- */
 int scrapec(const char *url, const unsigned char *info_hash, int *result, char *errbuf)
 {
-    struct url_struct url_struct;
-    /* Break down the passed URL into host, port, path, protocol. */
-    if (parse_url(&url_struct, url, errbuf)) {
-        return 1;
-    }
+    struct scrape_result batch_result;
 
-    /* Then call either scrapec_http() or scrapec_udp(). */
-    if (url_struct.protocol == 1) {
-        return scrapec_http(url_struct.host, url_struct.port, url_struct.path,
-                            info_hash, result, errbuf);
-    } else {
-        return scrapec_udp(url_struct.host, url_struct.port, info_hash, result, errbuf);
+    if (scrapec_batch(url, (const unsigned char (*)[20]) info_hash, 1, &batch_result, errbuf) != 0)
+        return 1;
+    if (batch_result.status != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "info hash not found in scrape response");
+        return 1;
     }
+    result[0] = batch_result.seeders;
+    result[1] = batch_result.completed;
+    result[2] = batch_result.leechers;
+    return 0;
 }
 
 /* -------------------------------------------------------------------------
@@ -486,11 +484,31 @@ int scrapec(const char *url, const unsigned char *info_hash, int *result, char *
 #ifdef BUILD_MAIN
 
 int option_timeout = 0; /* If you want to set a default, do so here */
+int option_udp_retries = SCRAPE_UDP_DEFAULT_RETRIES;
+int option_max_requests = SCRAPE_DEFAULT_MAX_REQUESTS;
+int option_host_rate = SCRAPE_DEFAULT_HOST_RATE;
+int option_max_age = SCRAPECACHE_DEFAULT_MAX_AGE;
+int option_announce = 0;
+static const char *option_conn_cache = NULL;
+static const char *option_scrape_cache = NULL;
+
+static void save_conn_cache(void)
+{
+    conncache_save(option_conn_cache);
+}
 
 static void print_usage(const char *arg0)
 {
-    printf("Usage: %s [options] <scrape_url> <info_hash>\n", arg0);
+    printf("Usage: %s [options] <scrape_url> <info_hash> [<info_hash>...]\n", arg0);
     printf("  -w <timeout> : network timeout in seconds\n");
+    printf("  -r <n>       : UDP retransmissions, after 15*2^i seconds (max %d)\n", SCRAPE_UDP_MAX_RETRIES);
+    printf("  -R <n>       : requests per second to the tracker (default %d, 0 for no limit)\n",
+           SCRAPE_DEFAULT_HOST_RATE);
+    printf("  -a           : if the tracker won't scrape, ask with a \"stopped\" announce per hash\n");
+    printf("  -c <file>    : keep UDP connection IDs in <file> between runs\n");
+    printf("  -s <file>    : answer from scrape results kept in <file> when fresh enough\n");
+    printf("  -m <seconds> : oldest cached result to use, or min_request_interval if longer (default %d, 0 always scrapes)\n",
+           SCRAPECACHE_DEFAULT_MAX_AGE);
     printf("  -V           : print scrape version and exit\n");
     printf("\nExample:\n");
     printf("  %s http://tracker.example.com/announce d1eab... [40 hex chars]\n", arg0);
@@ -532,12 +550,13 @@ static int parse_info_hash(const char *str, unsigned char *info_hash)
 
 int main(int argc, char *argv[])
 {
-    unsigned char info_hash[20];
-    int result[3];
+    unsigned char (*info_hashes)[20] = NULL;
+    struct scrape_result *results;
+    int hash_count = 0;
     char errbuf[ERRBUF_SIZE];
     const char *url = NULL;
 
-    /* We expect 2 positional args: <scrape_url> and <info_hash> 
+    /* We expect a <scrape_url> followed by one or more <info_hash>,
        but also allow -w, -V, etc. */
     int i = 1;
     while (i < argc) {
@@ -561,6 +580,62 @@ int main(int argc, char *argv[])
             }
             i += 2;
         }
+        else if (!strcmp(argv[i], "-r")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-r requires an integer argument.\n");
+                return 1;
+            }
+            option_udp_retries = strtol(argv[i + 1], NULL, 10);
+            if (option_udp_retries < 0 || option_udp_retries > SCRAPE_UDP_MAX_RETRIES) {
+                fprintf(stderr, "retries must be between 0 and %d.\n", SCRAPE_UDP_MAX_RETRIES);
+                return 1;
+            }
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-R")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-R requires an integer argument.\n");
+                return 1;
+            }
+            option_host_rate = strtol(argv[i + 1], NULL, 10);
+            if (option_host_rate < 0) {
+                fprintf(stderr, "rate must be non-negative.\n");
+                return 1;
+            }
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-a")) {
+            option_announce = 1;
+            i++;
+        }
+        else if (!strcmp(argv[i], "-c")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-c requires a file argument.\n");
+                return 1;
+            }
+            option_conn_cache = argv[i + 1];
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-s")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-s requires a file argument.\n");
+                return 1;
+            }
+            option_scrape_cache = argv[i + 1];
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-m")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-m requires an integer argument.\n");
+                return 1;
+            }
+            option_max_age = strtol(argv[i + 1], NULL, 10);
+            if (option_max_age < 0) {
+                fprintf(stderr, "max age must be non-negative.\n");
+                return 1;
+            }
+            i += 2;
+        }
         else if (argv[i][0] == '-') {
             /* Unknown flag or -something else */
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -568,15 +643,16 @@ int main(int argc, char *argv[])
             return 1;
         }
         else {
-            /* It's a positional argument, presumably either URL or INFO_HASH. */
+            /* It's a positional argument: the URL first, then info hashes. */
             if (!url) {
                 url = argv[i];
             } else {
-                /* Then it must be the info_hash */
-                if (parse_info_hash(argv[i], info_hash)) {
+                info_hashes = realloc(info_hashes, sizeof(*info_hashes) * (hash_count + 1));
+                if (parse_info_hash(argv[i], info_hashes[hash_count])) {
                     fprintf(stderr, "Invalid info_hash; must be 40 hex chars.\n");
                     return 1;
                 }
+                hash_count++;
             }
             i++;
         }
@@ -588,32 +664,48 @@ int main(int argc, char *argv[])
         print_usage(argv[0]);
         return 1;
     }
-
-    /* We can detect if info_hash was not set by checking if parse_info_hash was never called. */
-    /* A lazy approach: if info_hash is all zero at this point, that might be suspicious. */
-    /* But let’s just check if i >= 3… or keep it simpler: if parse_info_hash wasn’t called. */
-    /* We'll assume that if we never set it, parse_info_hash wouldn't have run. 
-       We might just do a 2-arg check. */
-    /* If you want a more explicit approach, store a boolean once parse_info_hash succeeds. */
-    /* For demonstration, let's do a quick hack: if info_hash[0..19] is all zero, that might be suspicious. */
-    static const unsigned char zeroes[20] = {0};
-    if (memcmp(info_hash, zeroes, 20) == 0) {
+    if (hash_count == 0) {
         fprintf(stderr, "No valid info_hash provided.\n");
         print_usage(argv[0]);
         return 1;
     }
 
-    /* We can do the scrape now */
+    /* We can do the scrape now, all hashes in one batch */
     srand((unsigned) time(NULL));
-    if (scrapec(url, info_hash, result, errbuf) != 0) {
+    if (option_conn_cache) {
+        conncache_load(option_conn_cache);
+        atexit(save_conn_cache);
+    }
+    if (option_scrape_cache && scrapecache_open(option_scrape_cache, errbuf) != 0)
+        fprintf(stderr, "%s: %s\n", option_scrape_cache, errbuf);
+    results = malloc(sizeof(struct scrape_result) * hash_count);
+    if (scrapec_batch(url, (const unsigned char (*)[20]) info_hashes, hash_count, results, errbuf) != 0) {
         fprintf(stderr, "Scrape error: %s\n", errbuf);
         return 1;
     }
 
-    /* On success, we have seeders, completed, leechers in result. */
-    printf("seeders=%d, completed=%d, leechers=%d\n",
-		result[0], result[1], result[2]);
-    return 0;
+    /* On success, print seeders, completed, leechers per hash. */
+    int failed = 0;
+    for (i = 0; i < hash_count; i++) {
+        if (hash_count > 1) {
+            for (int j = 0; j < 20; j++)
+                printf("%02x", info_hashes[i][j]);
+            printf(": ");
+        }
+        if (results[i].status != 0) {
+            printf("not found\n");
+            failed = 1;
+        } else {
+            printf("seeders=%d, completed=%d, leechers=%d",
+                   results[i].seeders, results[i].completed, results[i].leechers);
+            if (results[i].name[0])
+                printf(", name=%s", results[i].name);
+            printf("\n");
+        }
+    }
+    free(results);
+    free(info_hashes);
+    return failed;
 }
 
 #endif /* BUILD_MAIN */
@@ -0,0 +1,356 @@
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "scrapecache.h"
+
+#define SCRAPECACHE_MAGIC "DTSCRAP1"
+#define READ_ATTEMPTS     1000     /* a writer that died mid-slot leaves it odd */
+
+struct scrapecache_header {
+    char magic[8];
+    uint32_t slot_count;           /* power of two */
+    uint32_t used;
+    unsigned char reserved[48];    /* the header takes one slot's room */
+};
+
+struct scrapecache_slot {
+    uint32_t sequence;             /* odd while written, 0 while never used */
+    uint32_t min_interval;         /* seconds, from the tracker */
+    uint64_t tracker;              /* FNV-1a of the tracker URL */
+    unsigned char info_hash[20];
+    int32_t seeders;
+    int32_t completed;
+    int32_t leechers;
+    int64_t scraped_at;            /* wall clock */
+    unsigned char reserved[8];
+};
+
+static char *cache_name;
+static int cache_fd = -1;
+static struct scrapecache_header *cache_header;
+static struct scrapecache_slot *cache_slots;
+static size_t cache_size;
+
+static uint64_t hash_url(const char *url)
+{
+    uint64_t hash = 14695981039346656037ull;    /* FNV-1a */
+    while (*url)
+        hash = (hash ^ (unsigned char) *url++) * 1099511628211ull;
+    return hash;
+}
+
+/* info hashes are uniformly distributed already */
+static uint32_t slot_hash(uint64_t tracker, const unsigned char *info_hash)
+{
+    uint32_t hash;
+    memcpy(&hash, info_hash, 4);
+    return hash ^ (uint32_t) (tracker ^ tracker >> 32);
+}
+
+static size_t file_size(uint32_t slot_count)
+{
+    return sizeof(struct scrapecache_header) + (size_t) slot_count * sizeof(struct scrapecache_slot);
+}
+
+/* -------------------------------------------------------------------------
+   SLOTS: a seqlock per slot
+   ------------------------------------------------------------------------- */
+/* Copy a consistent snapshot of slot; 0 if it was never used (or stays torn). */
+static int read_slot(const struct scrapecache_slot *slot, struct scrapecache_slot *copy)
+{
+    for (int i = 0; i < READ_ATTEMPTS; i++) {
+        uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        if (before & 1)
+            continue;
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == before)
+            return before != 0;
+    }
+    return 0;
+}
+
+/* Called with the file lock held. */
+static void write_slot(struct scrapecache_slot *slot, const struct scrapecache_slot *value)
+{
+    uint32_t sequence = slot->sequence | 1;
+
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *) slot + sizeof(slot->sequence), (const char *) value + sizeof(value->sequence),
+           sizeof(*slot) - sizeof(slot->sequence));
+    /* skip 0, which marks an unused slot */
+    __atomic_store_n(&slot->sequence, sequence + 1 ? sequence + 1 : 2, __ATOMIC_RELEASE);
+}
+
+/* The slot holding (tracker, info_hash), or the empty one where it would go; NULL if the table is full. */
+static struct scrapecache_slot *find_slot(struct scrapecache_slot *slots, uint32_t slot_count, uint64_t tracker,
+                                          const unsigned char *info_hash, struct scrapecache_slot *copy)
+{
+    uint32_t mask = slot_count - 1, pos = slot_hash(tracker, info_hash) & mask;
+
+    for (uint32_t i = 0; i < slot_count; i++, pos = (pos + 1) & mask) {
+        if (!read_slot(&slots[pos], copy))
+            return &slots[pos];
+        if (copy->tracker == tracker && memcmp(copy->info_hash, info_hash, 20) == 0)
+            return &slots[pos];
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------
+   FILE
+   ------------------------------------------------------------------------- */
+static void detach(void)
+{
+    if (cache_header)
+        munmap(cache_header, cache_size);
+    if (cache_fd >= 0)
+        close(cache_fd);
+    cache_header = NULL;
+    cache_slots = NULL;
+    cache_fd = -1;
+}
+
+static int map_file(int fd, char *errbuf)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct scrapecache_header)) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s: not a scrape cache file", cache_name);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s: mmap() error: %s", cache_name, strerror(errno));
+        return 1;
+    }
+    cache_header = map;
+    if (memcmp(cache_header->magic, SCRAPECACHE_MAGIC, 8) != 0 || cache_header->slot_count == 0 ||
+        (cache_header->slot_count & (cache_header->slot_count - 1)) != 0 ||
+        file_size(cache_header->slot_count) != (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        cache_header = NULL;
+        snprintf(errbuf, ERRBUF_SIZE, "%s: not a scrape cache file", cache_name);
+        return 1;
+    }
+    cache_fd = fd;
+    cache_size = st.st_size;
+    cache_slots = (struct scrapecache_slot *) (cache_header + 1);
+    return 0;
+}
+
+/* Size a new file for slot_count empty slots. */
+static int init_file(int fd, uint32_t slot_count)
+{
+    struct scrapecache_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRAPECACHE_MAGIC, 8);
+    header.slot_count = slot_count;
+    if (ftruncate(fd, file_size(slot_count)) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        return 1;
+    return 0;
+}
+
+static int attach(char *errbuf)
+{
+    struct stat st;
+    int fd = open(cache_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s: %s", cache_name, strerror(errno));
+        return 1;
+    }
+    /* whoever creates it sizes it, under the lock */
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && init_file(fd, SCRAPECACHE_MIN_SLOTS) != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "%s: %s", cache_name, strerror(errno));
+        flock(fd, LOCK_UN);
+        close(fd);
+        return 1;
+    }
+    flock(fd, LOCK_UN);
+    if (map_file(fd, errbuf) != 0) {
+        close(fd);
+        return 1;
+    }
+    return 0;
+}
+
+/* Take the write lock on the file now at cache_name: another process may
+   have replaced ours while growing it. */
+static int lock_cache(void)
+{
+    char errbuf[ERRBUF_SIZE];
+
+    for (;;) {
+        struct stat by_fd, by_name;
+
+        if (flock(cache_fd, LOCK_EX) != 0)
+            return 1;
+        if (stat(cache_name, &by_name) == 0 && fstat(cache_fd, &by_fd) == 0 &&
+            by_name.st_dev == by_fd.st_dev && by_name.st_ino == by_fd.st_ino)
+            return 0;
+        detach();
+        if (attach(errbuf) != 0)
+            return 1;
+    }
+}
+
+/* Rehash into a file sized for the live entries and rename it over ours;
+   entries older than SCRAPECACHE_KEEP are dropped. Called with the lock held,
+   returns with the new file locked. */
+static int grow(void)
+{
+    char *tmp_name = malloc(strlen(cache_name) + 8);
+    int64_t oldest = (int64_t) time(NULL) - SCRAPECACHE_KEEP;
+    uint32_t live = 0, slot_count = SCRAPECACHE_MIN_SLOTS, used = 0;
+    struct scrapecache_header *header;
+    struct scrapecache_slot *slots, copy, scratch;
+    void *map;
+    int fd;
+
+    for (uint32_t i = 0; i < cache_header->slot_count; i++)
+        live += read_slot(&cache_slots[i], &copy) && copy.scraped_at >= oldest;
+    while (slot_count < live * 4)
+        slot_count *= 2;
+
+    sprintf(tmp_name, "%s.XXXXXX", cache_name);
+    fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        free(tmp_name);
+        return 1;
+    }
+    if (init_file(fd, slot_count) != 0 ||
+        (map = mmap(NULL, file_size(slot_count), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(tmp_name);
+        free(tmp_name);
+        return 1;
+    }
+    header = map;
+    slots = (struct scrapecache_slot *) (header + 1);
+    for (uint32_t i = 0; i < cache_header->slot_count; i++) {
+        struct scrapecache_slot *slot;
+
+        if (!read_slot(&cache_slots[i], &copy) || copy.scraped_at < oldest)
+            continue;
+        slot = find_slot(slots, slot_count, copy.tracker, copy.info_hash, &scratch);
+        write_slot(slot, &copy);
+        used++;
+    }
+    header->used = used;
+
+    /* nobody can have the new file open before the rename */
+    fchmod(fd, 0644);
+    flock(fd, LOCK_EX);
+    if (rename(tmp_name, cache_name) != 0) {
+        munmap(map, file_size(slot_count));
+        close(fd);
+        unlink(tmp_name);
+        free(tmp_name);
+        return 1;
+    }
+    free(tmp_name);
+
+    detach();   /* also drops the old file's lock */
+    cache_fd = fd;
+    cache_header = header;
+    cache_slots = slots;
+    cache_size = file_size(slot_count);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+   PUBLIC API
+   ------------------------------------------------------------------------- */
+int scrapecache_open(const char *file_name, char *errbuf)
+{
+    if (cache_fd >= 0)
+        return 0;
+    cache_name = strdup(file_name);
+    if (attach(errbuf) != 0) {
+        free(cache_name);
+        cache_name = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+void scrapecache_close(void)
+{
+    detach();
+    free(cache_name);
+    cache_name = NULL;
+}
+
+int scrapecache_get(const char *url, const unsigned char *info_hash, int max_age, struct scrape_result *result)
+{
+    struct scrapecache_slot copy;
+    int64_t age;
+
+    /* 0 asks for a fresh scrape, whatever min_request_interval says */
+    if (max_age == 0)
+        return 0;
+    if (cache_header == NULL ||
+        find_slot(cache_slots, cache_header->slot_count, hash_url(url), info_hash, &copy) == NULL ||
+        copy.sequence == 0 || copy.tracker != hash_url(url) || memcmp(copy.info_hash, info_hash, 20) != 0)
+        return 0;
+
+    age = (int64_t) time(NULL) - copy.scraped_at;
+    if (age < 0 || (age >= max_age && age >= copy.min_interval))
+        return 0;
+    result->status = 0;
+    result->seeders = copy.seeders;
+    result->completed = copy.completed;
+    result->leechers = copy.leechers;
+    result->name[0] = '\0';
+    return 1;
+}
+
+void scrapecache_put(const char *url, const unsigned char (*info_hashes)[20], const struct scrape_result *results,
+                     int count, int min_interval)
+{
+    uint64_t tracker = hash_url(url);
+    struct scrapecache_slot value, copy;
+
+    if (cache_fd < 0 || lock_cache() != 0)
+        return;
+
+    memset(&value, 0, sizeof(value));
+    value.tracker = tracker;
+    value.min_interval = min_interval > 0 ? (uint32_t) min_interval : 0;
+    value.scraped_at = (int64_t) time(NULL);
+    for (int i = 0; i < count; i++) {
+        struct scrapecache_slot *slot;
+
+        if (results[i].status != 0)
+            continue;
+        /* keep the table at most half full */
+        if (cache_header->used * 2 >= cache_header->slot_count && grow() != 0)
+            break;
+        slot = find_slot(cache_slots, cache_header->slot_count, tracker, info_hashes[i], &copy);
+        if (slot == NULL)
+            break;
+        if (slot->sequence == 0)
+            cache_header->used++;
+        memcpy(value.info_hash, info_hashes[i], 20);
+        value.seeders = results[i].seeders;
+        value.completed = results[i].completed;
+        value.leechers = results[i].leechers;
+        write_slot(slot, &value);
+    }
+    flock(cache_fd, LOCK_UN);
+}
@@ -1,15 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "torrent.h"
 #include "common.h"
 #include "benc.h"
 #include "scrapec.h"
+#include "scrape_engine.h"
+#include "trackerhealth.h"
+#include "filetree.h"
+#include "piecemap.h"
+#include "magnet.h"
 
 extern int option_output;
 extern int option_timeout;
+extern int option_tree;
+extern int option_tree_depth;
+extern char *option_set_announce;
+extern char **option_add_trackers;
+extern int option_add_tracker_count;
+extern int option_strip_comment;
+extern int option_set_private;
 
 static char *human_readable_number(uint64_t n)
 {
@@ -117,9 +133,53 @@ void print_field(struct benc_entity *root)
     printf("not implemented\n");
 }
 
+/* Print the directory trie, one line per node down to option_tree_depth. */
+static void show_file_tree(struct file_tree *tree)
+{
+    int width = 0;
+    int node;
+
+    /* every printed node is somewhere in the array, so one linear scan sizes the column */
+    for (node = 0; node < tree->node_count; node++) {
+        struct file_tree_node *n = &tree->nodes[node];
+        int w;
+        if (option_tree_depth >= 0 && n->depth > option_tree_depth)
+            continue;
+        w = n->depth * 4 + tree->names[n->name].length + n->is_dir;
+        if (width < w)
+            width = w;
+    }
+
+    /* pre-order walk using the sibling links */
+    node = 0;
+    while (node >= 0) {
+        struct file_tree_node *n = &tree->nodes[node];
+        struct file_tree_name *name = &tree->names[n->name];
+        int w = n->depth * 4 + name->length + n->is_dir;
+
+        printf("                %*s%.*s%s", n->depth * 4, "", name->length, name->str, n->is_dir ? "/" : "");
+        while (w++ <= width)
+            printf(" ");
+        if (n->is_dir)
+            printf("%s [%lld file%s]\n", human_readable_number(n->size), n->file_count, n->file_count == 1 ? "" : "s");
+        else
+            puts(human_readable_number(n->size));
+
+        if (n->first_child >= 0 && (option_tree_depth < 0 || n->depth < option_tree_depth)) {
+            node = n->first_child;
+            continue;
+        }
+        while (node >= 0 && tree->nodes[node].next_sibling < 0)
+            node = tree->nodes[node].parent;
+        if (node >= 0)
+            node = tree->nodes[node].next_sibling;
+    }
+}
+
 void show_torrent_info(struct benc_entity *root)
 {
     struct benc_entity *announce, *info, *name, *piece_length, *length;
+    struct file_tree *tree = NULL;
     unsigned char info_hash[20];
     long long int total_length;
     int max_filename_length;
@@ -160,20 +220,31 @@ void show_torrent_info(struct benc_entity *root)
         }
         total_length = 0;
         max_filename_length = 0;
-        for (struct benc_entity *fileslist = files->list.head; fileslist != NULL; fileslist = fileslist->next) {
-            struct benc_entity *path = benc_lookup_string(fileslist, "path");
-            struct benc_entity *length2 = benc_lookup_string(fileslist, "length");
-            if (!path || !length2) {
-                printf("invalid file structure.\n");
+        if (option_tree && option_output != OUTPUT_BRIEF) {
+            char errbuf[ERRBUF_SIZE];
+            /* the trie carries the totals, so the flat walk isn't needed */
+            tree = file_tree_build(files, name, errbuf);
+            if (tree == NULL) {
+                printf("%s\n", errbuf);
                 return;
             }
-            total_length += length2->integer;
-            int filename_length = -1;
-            for (struct benc_entity *pathlist = path->list.head; pathlist != NULL; pathlist = pathlist->next) {
-                filename_length += pathlist->string.length + 1;
-            }
-            if (max_filename_length < filename_length) {
-                max_filename_length = filename_length;
+            total_length = tree->nodes[0].size;
+        } else {
+            for (struct benc_entity *fileslist = files->list.head; fileslist != NULL; fileslist = fileslist->next) {
+                struct benc_entity *path = benc_lookup_string(fileslist, "path");
+                struct benc_entity *length2 = benc_lookup_string(fileslist, "length");
+                if (!path || !length2) {
+                    printf("invalid file structure.\n");
+                    return;
+                }
+                total_length += length2->integer;
+                int filename_length = -1;
+                for (struct benc_entity *pathlist = path->list.head; pathlist != NULL; pathlist = pathlist->next) {
+                    filename_length += pathlist->string.length + 1;
+                }
+                if (max_filename_length < filename_length) {
+                    max_filename_length = filename_length;
+                }
             }
         }
     }
@@ -220,7 +291,10 @@ void show_torrent_info(struct benc_entity *root)
     }
 
     printf("Files:\n");
-    if (benc_lookup_string(info, "length") != NULL) {
+    if (tree != NULL) {
+        show_file_tree(tree);
+        file_tree_free(tree);
+    } else if (benc_lookup_string(info, "length") != NULL) {
         printf("                %s %s\n", name->string.str, human_readable_number(total_length));
     } else {
         struct benc_entity *fileslist;
@@ -269,13 +343,38 @@ void show_torrent_info(struct benc_entity *root)
     }
 }
 
+struct torrent_scrape {
+    struct scrape_engine *engine;
+    int done;
+};
+
+static void scrape_torrent_done(struct scrape_request *request, void *arg)
+{
+    struct torrent_scrape *state = arg;
+
+    if (state->done)
+        return; /* cancelled once another tracker answered */
+    if (request->status != 0) {
+        printf("%s: %s\n", request->url, request->errbuf);
+    } else if (request->results[0].status != 0) {
+        printf("%s: info hash not found in scrape response\n", request->url);
+    } else {
+        printf("seeders=%d, completed=%d, leechers=%d (%s)\n", request->results[0].seeders,
+               request->results[0].completed, request->results[0].leechers, request->url);
+        state->done = 1;
+        scrape_engine_stop(state->engine);
+    }
+}
+
 void scrape_torrent(struct benc_entity *root)
 {
     static const int url_max = 64;
     struct benc_entity *announce, *info, *announce_list;
     unsigned char info_hash[20];
-    int result[3];
-    char errbuf[ERRBUF_SIZE];
+    struct scrape_engine *engine;
+    struct scrape_request requests[url_max];
+    struct scrape_result results[url_max];
+    struct torrent_scrape state;
     char *urls[url_max];
     int url_num = 0;
 
@@ -295,7 +394,8 @@ void scrape_torrent(struct benc_entity *root)
         }
         urls[url_num++] = announce->string.str;
     } else {
-        /* collect all announce-list URLs, randomizing the order within each “tier” */
+        /* collect all announce-list URLs, randomizing the order within each “tier”,
+           then putting the trackers that answered fastest and most often first */
         for (struct benc_entity *tierlist = announce_list->list.head; tierlist != NULL; tierlist = tierlist->next) {
             int added_in_tier = 0;
             for (struct benc_entity *backuplist = tierlist->list.head;
@@ -310,19 +410,697 @@ void scrape_torrent(struct benc_entity *root)
                     urls[url_num - 1 - r] = tmp;
                 }
             }
+            trackerhealth_sort(urls + url_num - added_in_tier, added_in_tier);
             if (url_num >= url_max)
                 break;
         }
     }
 
-    for (int count = 0; count < url_num; count++) {
+    /* every tracker at once; the first answer wins and cancels the rest */
+    engine = scrape_engine_new();
+    state.engine = engine;
+    state.done = 0;
+    /* an answer from the scrape cache arrives inside submit */
+    for (int count = 0; count < url_num && !state.done; count++) {
+        const char *error = NULL;
+        int backoff = trackerhealth_backoff(urls[count], &error);
+
+        if (backoff > 0) {
+            printf("skipping %s for %ds: %s\n", urls[count], backoff, error);
+            continue;
+        }
         printf("scraping %s ...\n", urls[count]);
-        if (scrapec(urls[count], info_hash, result, errbuf) != 0) {
-            printf("%s\n", errbuf);
+        memset(&requests[count], 0, sizeof(requests[count]));
+        requests[count].url = urls[count];
+        requests[count].info_hashes = (const unsigned char (*)[20]) info_hash;
+        requests[count].count = 1;
+        requests[count].results = &results[count];
+        requests[count].callback = scrape_torrent_done;
+        requests[count].arg = &state;
+        scrape_engine_submit(engine, &requests[count], 0);
+    }
+    if (!state.done)
+        scrape_engine_run(engine);
+    scrape_engine_free(engine);
+
+    if (!state.done)
+        printf("no more trackers to try.\n");
+}
+
+/* -------------------------------------------------------------------------
+   BATCH SCRAPE: every torrent grouped by tracker, one scrapec_batch per
+   tracker per round; torrents a tracker couldn't answer move on to their
+   next tracker in the following round
+   ------------------------------------------------------------------------- */
+struct batch_torrent {
+    const char *file_name;     /* NULL for a magnet, named by its info hash */
+    unsigned char info_hash[20];
+    int *trackers;             /* indexes into the tracker table, in the order to try them */
+    int tracker_count;
+    int cursor;                /* index of the tracker being tried */
+    int done;
+    struct scrape_result result;
+};
+
+struct batch_tracker {
+    char *url;
+    int dead;                  /* unreachable, skip for the rest of the run */
+    int checked;               /* its health was looked at */
+    int *members;
+    int member_count;
+    int member_capacity;
+    unsigned char (*hashes)[20];
+    struct scrape_result *results;
+    struct scrape_request request;
+};
+
+struct batch_tracker_table {
+    struct batch_tracker *trackers;
+    int count;
+    int capacity;
+    int *slots;                /* tracker index + 1, 0 means empty */
+    int slot_mask;
+};
+
+static unsigned int hash_url(const char *url)
+{
+    unsigned int h = 2166136261u; /* FNV-1a */
+    for (; *url; url++) {
+        h ^= (unsigned char) *url;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void tracker_table_rehash(struct batch_tracker_table *table)
+{
+    free(table->slots);
+    table->slot_mask = table->slot_mask * 2 + 1;
+    table->slots = calloc(table->slot_mask + 1, sizeof(int));
+    for (int i = 0; i < table->count; i++) {
+        unsigned int pos = hash_url(table->trackers[i].url) & table->slot_mask;
+        while (table->slots[pos])
+            pos = (pos + 1) & table->slot_mask;
+        table->slots[pos] = i + 1;
+    }
+}
+
+/* The tracker's index, added if new. */
+static int tracker_table_get(struct batch_tracker_table *table, const char *url)
+{
+    unsigned int pos = hash_url(url) & table->slot_mask;
+    struct batch_tracker *tracker;
+
+    while (table->slots[pos]) {
+        if (strcmp(table->trackers[table->slots[pos] - 1].url, url) == 0)
+            return table->slots[pos] - 1;
+        pos = (pos + 1) & table->slot_mask;
+    }
+
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 16;
+        table->trackers = realloc(table->trackers, sizeof(struct batch_tracker) * table->capacity);
+    }
+    tracker = &table->trackers[table->count];
+    tracker->url = strdup(url);
+    tracker->dead = 0;
+    tracker->checked = 0;
+    tracker->members = NULL;
+    tracker->member_count = tracker->member_capacity = 0;
+    tracker->hashes = NULL;
+    tracker->results = NULL;
+    table->slots[pos] = ++table->count;
+    if (table->count * 2 > table->slot_mask)
+        tracker_table_rehash(table);
+    return table->count - 1;
+}
+
+/* Append urls (sorted by tracker health first) to the torrent's trackers, skipping ones it has. */
+static void add_batch_trackers(struct batch_torrent *torrent, struct batch_tracker_table *table, char **urls,
+                               int count)
+{
+    trackerhealth_sort(urls, count);
+    torrent->trackers = realloc(torrent->trackers, sizeof(int) * (torrent->tracker_count + count));
+    for (int i = 0; i < count; i++) {
+        int tracker = tracker_table_get(table, urls[i]), known = 0;
+
+        for (int j = 0; j < torrent->tracker_count && !known; j++)
+            known = torrent->trackers[j] == tracker;
+        if (!known)
+            torrent->trackers[torrent->tracker_count++] = tracker;
+    }
+}
+
+/* announce-list in tier order, or just announce */
+static int load_batch_torrent(struct batch_torrent *torrent, struct batch_tracker_table *table,
+                              const char *file_name, char *errbuf)
+{
+    struct benc_entity *root, *info, *announce, *announce_list;
+    char **urls = NULL;
+    int url_count = 0;
+
+    memset(torrent, 0, sizeof(*torrent));
+    torrent->file_name = file_name;
+    root = benc_parse_file(file_name, errbuf);
+    if (root == NULL)
+        return 1;
+    if (root->type != BENC_DICTIONARY || (info = benc_lookup_string(root, "info")) == NULL) {
+        snprintf(errbuf, ERRBUF_SIZE, "info entry not found");
+        benc_free_entity(root);
+        return 1;
+    }
+    benc_sha1_entity(info, torrent->info_hash);
+
+    announce_list = benc_lookup_string(root, "announce-list");
+    if (announce_list != NULL && announce_list->type == BENC_LIST) {
+        for (struct benc_entity *tierlist = announce_list->list.head; tierlist != NULL; tierlist = tierlist->next) {
+            url_count = 0;
+            if (tierlist->type != BENC_LIST)
+                continue;
+            for (struct benc_entity *backuplist = tierlist->list.head; backuplist != NULL; backuplist = backuplist->next) {
+                if (backuplist->type != BENC_STRING)
+                    continue;
+                urls = realloc(urls, sizeof(char *) * (url_count + 1));
+                urls[url_count++] = backuplist->string.str;
+            }
+            add_batch_trackers(torrent, table, urls, url_count);
+        }
+    }
+    announce = benc_lookup_string(root, "announce");
+    if (torrent->tracker_count == 0 && announce != NULL && announce->type == BENC_STRING)
+        add_batch_trackers(torrent, table, &announce->string.str, 1);
+    free(urls);
+    benc_free_entity(root);
+
+    if (torrent->tracker_count == 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "announce entry not found");
+        return 1;
+    }
+    return 0;
+}
+
+static void print_batch_name(const struct batch_torrent *torrent)
+{
+    if (torrent->file_name != NULL) {
+        printf("%s", torrent->file_name);
+        return;
+    }
+    for (int i = 0; i < 20; i++)
+        printf("%02x", torrent->info_hash[i]);
+}
+
+/* Scrape the torrents that aren't done yet, report every one and free
+   them all; returns the number of failures. */
+static int batch_scrape(struct batch_torrent *torrents, int count, struct batch_tracker_table *table)
+{
+    struct scrape_engine *engine = scrape_engine_new();
+    int pending = 0, failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        torrents[i].result.status = 1;
+        pending += !torrents[i].done;
+    }
+
+    while (pending > 0) {
+        /* group every pending torrent under its current tracker */
+        for (int i = 0; i < table->count; i++)
+            table->trackers[i].member_count = 0;
+        for (int i = 0; i < count; i++) {
+            struct batch_torrent *torrent = &torrents[i];
+            struct batch_tracker *tracker = NULL;
+
+            while (!torrent->done) {
+                if (torrent->cursor >= torrent->tracker_count) {
+                    torrent->done = 1;
+                    pending--;
+                    break;
+                }
+                tracker = &table->trackers[torrent->trackers[torrent->cursor]];
+                if (!tracker->dead && !tracker->checked) {
+                    const char *error = NULL;
+                    int backoff = trackerhealth_backoff(tracker->url, &error);
+
+                    tracker->checked = 1;
+                    if (backoff > 0) {
+                        printf("skipping %s for %ds: %s\n", tracker->url, backoff, error);
+                        tracker->dead = 1;
+                    }
+                }
+                if (!tracker->dead)
+                    break;
+                torrent->cursor++;
+            }
+            if (torrent->done)
+                continue;
+            if (tracker->member_count == tracker->member_capacity) {
+                tracker->member_capacity = tracker->member_capacity ? tracker->member_capacity * 2 : 16;
+                tracker->members = realloc(tracker->members, sizeof(int) * tracker->member_capacity);
+            }
+            tracker->members[tracker->member_count++] = i;
+        }
+
+        /* one request per tracker, the whole round in flight at once */
+        for (int t = 0; t < table->count; t++) {
+            struct batch_tracker *tracker = &table->trackers[t];
+
+            if (tracker->member_count == 0)
+                continue;
+            tracker->hashes = realloc(tracker->hashes, 20 * tracker->member_count);
+            tracker->results = realloc(tracker->results, sizeof(struct scrape_result) * tracker->member_count);
+            for (int i = 0; i < tracker->member_count; i++)
+                memcpy(tracker->hashes[i], torrents[tracker->members[i]].info_hash, 20);
+
+            printf("scraping %s (%d torrents) ...\n", tracker->url, tracker->member_count);
+            memset(&tracker->request, 0, sizeof(tracker->request));
+            tracker->request.url = tracker->url;
+            tracker->request.info_hashes = (const unsigned char (*)[20]) tracker->hashes;
+            tracker->request.count = tracker->member_count;
+            tracker->request.results = tracker->results;
+            scrape_engine_submit(engine, &tracker->request, 0);
+        }
+        scrape_engine_run(engine);
+
+        for (int t = 0; t < table->count; t++) {
+            struct batch_tracker *tracker = &table->trackers[t];
+
+            if (tracker->member_count == 0)
+                continue;
+            if (tracker->request.status != 0) {
+                printf("%s: %s\n", tracker->url, tracker->request.errbuf);
+                tracker->dead = 1;
+            }
+            /* a big request is split up: what the tracker did answer before failing still counts */
+            for (int i = 0; i < tracker->member_count; i++) {
+                struct batch_torrent *torrent = &torrents[tracker->members[i]];
+                if (tracker->results[i].status == 0) {
+                    torrent->result = tracker->results[i];
+                    torrent->done = 1;
+                    pending--;
+                } else {
+                    torrent->cursor++;
+                }
+            }
+        }
+    }
+    scrape_engine_free(engine);
+
+    for (int i = 0; i < count; i++) {
+        struct batch_torrent *torrent = &torrents[i];
+        if (torrent->tracker_count == 0)
+            continue; /* load error, already reported */
+        print_batch_name(torrent);
+        if (torrent->result.status == 0) {
+            printf(": seeders=%d, completed=%d, leechers=%d (%s)\n", torrent->result.seeders,
+                   torrent->result.completed, torrent->result.leechers,
+                   table->trackers[torrent->trackers[torrent->cursor]].url);
         } else {
-            printf("seeders=%d, completed=%d, leechers=%d\n", result[0], result[1], result[2]);
+            printf(": no more trackers to try.\n");
+            failed++;
+        }
+        free(torrent->trackers);
+    }
+
+    for (int i = 0; i < table->count; i++) {
+        free(table->trackers[i].url);
+        free(table->trackers[i].members);
+        free(table->trackers[i].hashes);
+        free(table->trackers[i].results);
+    }
+    free(table->trackers);
+    free(table->slots);
+    return failed;
+}
+
+int batch_scrape_torrents(char **file_names, int count)
+{
+    struct batch_torrent *torrents = malloc(sizeof(struct batch_torrent) * (count > 0 ? count : 1));
+    struct batch_tracker_table table = {NULL, 0, 0, NULL, 15};
+    char errbuf[ERRBUF_SIZE];
+    int failed = 0;
+
+    table.slots = calloc(table.slot_mask + 1, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        if (load_batch_torrent(&torrents[i], &table, file_names[i], errbuf) != 0) {
+            printf("%s: %s\n", file_names[i], errbuf);
+            free(torrents[i].trackers);
+            torrents[i].trackers = NULL;
+            torrents[i].tracker_count = 0;
+            torrents[i].done = 1;
+            failed++;
+        }
+    }
+    failed += batch_scrape(torrents, count, &table);
+    free(torrents);
+    return failed;
+}
+
+/* -------------------------------------------------------------------------
+   MAGNET BATCH: magnet links one per line, deduplicated by info hash (the
+   trackers of repeated ones merged), then scraped like a batch of torrents
+   ------------------------------------------------------------------------- */
+struct magnet_index {
+    int *slots;                /* torrent index + 1, 0 means empty */
+    unsigned int slot_mask;
+};
+
+/* The torrent with this info hash, added if new. */
+static struct batch_torrent *magnet_torrent(struct magnet_index *index, struct batch_torrent **torrents,
+                                            int *count, int *capacity, const unsigned char *info_hash)
+{
+    unsigned int pos;
+    struct batch_torrent *torrent;
+
+    /* info hashes are already uniformly distributed */
+    memcpy(&pos, info_hash, sizeof(pos));
+    for (pos &= index->slot_mask; index->slots[pos]; pos = (pos + 1) & index->slot_mask) {
+        if (memcmp((*torrents)[index->slots[pos] - 1].info_hash, info_hash, 20) == 0)
+            return &(*torrents)[index->slots[pos] - 1];
+    }
+
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        *torrents = realloc(*torrents, sizeof(struct batch_torrent) * *capacity);
+    }
+    torrent = &(*torrents)[*count];
+    memset(torrent, 0, sizeof(*torrent));
+    memcpy(torrent->info_hash, info_hash, 20);
+    index->slots[pos] = ++*count;
+
+    if ((unsigned int) *count * 2 > index->slot_mask) {
+        free(index->slots);
+        index->slot_mask = index->slot_mask * 2 + 1;
+        index->slots = calloc(index->slot_mask + 1, sizeof(int));
+        for (int i = 0; i < *count; i++) {
+            memcpy(&pos, (*torrents)[i].info_hash, sizeof(pos));
+            for (pos &= index->slot_mask; index->slots[pos]; pos = (pos + 1) & index->slot_mask)
+                ;
+            index->slots[pos] = i + 1;
+        }
+    }
+    return torrent;
+}
+
+int batch_scrape_magnets(const char *file_name)
+{
+    FILE *fp = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "r");
+    struct batch_tracker_table table = {NULL, 0, 0, NULL, 15};
+    struct magnet_index index = {NULL, 1023};
+    struct batch_torrent *torrents = NULL;
+    struct magnet magnet;
+    char errbuf[ERRBUF_SIZE], *line = NULL, *urls[MAGNET_MAX_ITEMS];
+    size_t line_size = 0;
+    ssize_t length;
+    int count = 0, capacity = 0, line_number = 0, links = 0, failed = 0, no_trackers = 0;
+
+    if (fp == NULL) {
+        printf("%s: %s\n", file_name, strerror(errno));
+        return 1;
+    }
+    table.slots = calloc(table.slot_mask + 1, sizeof(int));
+    index.slots = calloc(index.slot_mask + 1, sizeof(int));
+
+    while ((length = getline(&line, &line_size, fp)) > 0) {
+        struct batch_torrent *torrent;
+
+        line_number++;
+        while (length > 0 && isspace((unsigned char) line[length - 1]))
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+        links++;
+        if (magnet_parse(&magnet, line, errbuf) != 0) {
+            printf("%s:%d: %s\n", file_name, line_number, errbuf);
+            failed++;
+            continue;
+        }
+        torrent = magnet_torrent(&index, &torrents, &count, &capacity, magnet.info_hash);
+        for (int i = 0; i < magnet.tracker_count; i++) {
+            int url_length = magnet_decode(&magnet.trackers[i], NULL, 0);
+
+            urls[i] = malloc(url_length + 1);
+            magnet_decode(&magnet.trackers[i], urls[i], url_length + 1);
+        }
+        add_batch_trackers(torrent, &table, urls, magnet.tracker_count);
+        for (int i = 0; i < magnet.tracker_count; i++)
+            free(urls[i]);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    free(index.slots);
+
+    for (int i = 0; i < count; i++) {
+        if (torrents[i].tracker_count == 0) {
+            torrents[i].done = 1;
+            no_trackers++;
+        }
+    }
+    printf("%d magnet links, %d unique info hashes, %d trackers\n", links, count, table.count);
+    if (no_trackers > 0)
+        printf("%d info hashes have no tracker to scrape\n", no_trackers);
+    failed += no_trackers + batch_scrape(torrents, count, &table);
+    free(torrents);
+    return failed;
+}
+
+static void print_map_path(const struct piece_map *map, int file)
+{
+    if (map->paths == NULL || map->paths[file] == NULL) {
+        printf("%s", map->name ? map->name->string.str : "");
+        return;
+    }
+    for (struct benc_entity *pathlist = map->paths[file]->list.head; pathlist != NULL; pathlist = pathlist->next) {
+        printf("%s", pathlist->string.str);
+        if (pathlist->next)
+            printf("/");
+    }
+}
+
+/* Answer one query: "<piece>" or "<file index>:<byte offset>". */
+static void answer_map_query(const struct piece_map *map, const char *query)
+{
+    const char *colon = strchr(query, ':');
+    char *end;
+
+    if (colon == NULL) {
+        long long int piece = strtoll(query, &end, 10);
+        long long int start, stop;
+        int first, last;
+
+        if (end == query || *end != '\0' || piece_map_piece_files(map, piece, &first, &last)) {
+            printf("%s: no such piece\n", query);
+            return;
+        }
+        start = piece * map->piece_length;
+        stop = start + map->piece_length;
+        if (stop > map->offsets[map->file_count])
+            stop = map->offsets[map->file_count];
+        printf("piece %lld: offset=%lld length=%lld files=%d\n", piece, start, stop - start, last - first + 1);
+        for (int file = first; file <= last; file++) {
+            long long int lo = start > map->offsets[file] ? start : map->offsets[file];
+            long long int hi = stop < map->offsets[file + 1] ? stop : map->offsets[file + 1];
+            if (hi <= lo)
+                continue; /* zero-length file sitting on the boundary */
+            printf("                %d: ", file);
+            print_map_path(map, file);
+            printf(" offset=%lld length=%lld\n", lo - map->offsets[file], hi - lo);
+        }
+    } else {
+        long long int file = strtoll(query, &end, 10);
+        long long int offset, piece;
+
+        if (end != colon || file < 0 || file >= map->file_count) {
+            printf("%s: no such file\n", query);
+            return;
+        }
+        offset = strtoll(colon + 1, &end, 10);
+        piece = *end == '\0' ? piece_map_piece_at(map, (int) file, offset) : -1;
+        if (piece < 0) {
+            printf("%s: offset out of range\n", query);
             return;
         }
+        printf("file %lld offset %lld: piece=%lld piece_offset=%lld\n", file, offset, piece,
+            map->offsets[file] + offset - piece * map->piece_length);
+    }
+}
+
+void query_piece_map(struct benc_entity *root, char **queries, int query_count)
+{
+    struct benc_entity *info;
+    struct piece_map *map;
+    char errbuf[ERRBUF_SIZE];
+
+    info = benc_lookup_string(root, "info");
+    if (info == NULL || info->type != BENC_DICTIONARY) {
+        printf("info entry not found\n");
+        return;
+    }
+    map = piece_map_from_info(info, errbuf);
+    if (map == NULL) {
+        printf("%s\n", errbuf);
+        return;
+    }
+
+    for (int i = 0; i < query_count; i++) {
+        if (strcmp(queries[i], "-") == 0) {
+            char line[256];
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0])
+                    answer_map_query(map, line);
+            }
+        } else {
+            answer_map_query(map, queries[i]);
+        }
+    }
+
+    piece_map_free(map);
+}
+
+static struct benc_entity *new_string_entity(const char *str)
+{
+    return benc_new_string((int) strlen(str), strdup(str));
+}
+
+/* Does any tier of announce-list already carry url? Replaces it with
+   replacement on the way if one is given. */
+static int announce_list_find(struct benc_entity *announce_list, const char *url, int url_length, const char *replacement)
+{
+    int found = 0;
+
+    for (struct benc_entity *tierlist = announce_list->list.head; tierlist != NULL; tierlist = tierlist->next) {
+        if (tierlist->type != BENC_LIST)
+            continue;
+        for (struct benc_entity *backuplist = tierlist->list.head; backuplist != NULL; backuplist = backuplist->next) {
+            if (backuplist->type != BENC_STRING || backuplist->string.length != url_length ||
+                memcmp(backuplist->string.str, url, url_length) != 0)
+                continue;
+            found = 1;
+            if (replacement) {
+                free(backuplist->string.str);
+                backuplist->string.str = strdup(replacement);
+                backuplist->string.length = (int) strlen(replacement);
+                backuplist->raw = tierlist->raw = announce_list->raw = NULL;
+            }
+        }
     }
-    printf("no more trackers to try.\n");
+    return found;
+}
+
+static int apply_edits(struct benc_entity *root, char *errbuf)
+{
+    struct benc_entity *announce, *announce_list, *info;
+
+    if (root->type != BENC_DICTIONARY) {
+        snprintf(errbuf, ERRBUF_SIZE, "root is not a dictionary");
+        return 1;
+    }
+    announce = benc_lookup_string(root, "announce");
+    if (announce != NULL && announce->type != BENC_STRING)
+        announce = NULL;
+    announce_list = benc_lookup_string(root, "announce-list");
+    if (announce_list != NULL && announce_list->type != BENC_LIST) {
+        snprintf(errbuf, ERRBUF_SIZE, "announce-list is not a list");
+        return 1;
+    }
+
+    if (option_set_announce) {
+        if (announce != NULL && announce_list != NULL)
+            announce_list_find(announce_list, announce->string.str, announce->string.length, option_set_announce);
+        benc_set_dictionary(root, "announce", new_string_entity(option_set_announce));
+        announce = benc_lookup_string(root, "announce");
+    }
+
+    for (int i = 0; i < option_add_tracker_count; i++) {
+        const char *url = option_add_trackers[i];
+        struct benc_entity *tier;
+
+        if (announce == NULL) {
+            benc_set_dictionary(root, "announce", new_string_entity(url));
+            announce = benc_lookup_string(root, "announce");
+        }
+        if (announce_list == NULL) {
+            /* clients ignore "announce" once announce-list exists, so carry it over */
+            announce_list = benc_new_list();
+            tier = benc_new_list();
+            benc_append_list(tier, benc_new_string(announce->string.length, strdup(announce->string.str)));
+            benc_append_list(announce_list, tier);
+            benc_set_dictionary(root, "announce-list", announce_list);
+        }
+        if (announce_list_find(announce_list, url, (int) strlen(url), NULL))
+            continue;
+        tier = benc_new_list();
+        benc_append_list(tier, new_string_entity(url));
+        benc_append_list(announce_list, tier);
+        announce_list->raw = NULL;
+    }
+
+    if (option_strip_comment) {
+        benc_remove_dictionary(root, "comment");
+        benc_remove_dictionary(root, "comment.utf-8");
+    }
+
+    if (option_set_private) {
+        info = benc_lookup_string(root, "info");
+        if (info == NULL || info->type != BENC_DICTIONARY) {
+            snprintf(errbuf, ERRBUF_SIZE, "no info");
+            return 1;
+        }
+        benc_set_dictionary(info, "private", benc_new_integer(1));
+    }
+
+    root->raw = NULL;
+    return 0;
+}
+
+int edit_torrent(const char *file_name, char *errbuf)
+{
+    struct benc_entity *root;
+    struct stat st;
+    char *data, *tmp_name;
+    int length, fd, retval = 1;
+
+    data = benc_load_file(file_name, &length, errbuf);
+    if (data == NULL)
+        return 1;
+    root = benc_parse_memory(data, length, NULL, errbuf);
+    if (root == NULL) {
+        free(data);
+        return 1;
+    }
+    if (apply_edits(root, errbuf) != 0)
+        goto out;
+
+    /* write next to the original and rename over it */
+    tmp_name = malloc(strlen(file_name) + 8);
+    sprintf(tmp_name, "%s.XXXXXX", file_name);
+    fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't create temporary file: %s", strerror(errno));
+        free(tmp_name);
+        goto out;
+    }
+    if (stat(file_name, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    if (benc_encode_fd(root, fd, errbuf) != 0) {
+        close(fd);
+        unlink(tmp_name);
+        free(tmp_name);
+        goto out;
+    }
+    if (close(fd) != 0 || rename(tmp_name, file_name) != 0) {
+        snprintf(errbuf, ERRBUF_SIZE, "can't replace %s: %s", file_name, strerror(errno));
+        errbuf[ERRBUF_SIZE - 1] = '\0';
+        unlink(tmp_name);
+        free(tmp_name);
+        goto out;
+    }
+    free(tmp_name);
+    retval = 0;
+
+out:
+    /* raw spans point into data, so free the tree first */
+    benc_free_entity(root);
+    free(data);
+    return retval;
 }
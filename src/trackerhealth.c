@@ -0,0 +1,196 @@
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+#include "trackerhealth.h"
+
+struct tracker_health {
+    char *url;
+    int attempts;
+    double success_rate;         /* EWMA of 1 per answer, 0 per failure */
+    double latency;              /* EWMA of successful scrapes, ms; 0 if none yet */
+    int failures_in_row;
+    time_t backoff_until;        /* wall clock, so it survives a save/load */
+    char last_error[ERRBUF_SIZE];
+};
+
+static struct tracker_health *entries;
+static int entry_count;
+static int entry_capacity;
+
+static struct tracker_health *find_entry(const char *url)
+{
+    for (int i = 0; i < entry_count; i++) {
+        if (strcmp(entries[i].url, url) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
+
+static struct tracker_health *get_entry(const char *url)
+{
+    struct tracker_health *entry = find_entry(url);
+
+    if (entry != NULL)
+        return entry;
+    if (entry_count == entry_capacity) {
+        entry_capacity = entry_capacity ? entry_capacity * 2 : 16;
+        entries = realloc(entries, sizeof(struct tracker_health) * entry_capacity);
+    }
+    entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->url = strdup(url);
+    entry->success_rate = 1.0;
+    return entry;
+}
+
+void trackerhealth_record(const char *url, int success, int latency_ms, const char *error)
+{
+    struct tracker_health *entry = get_entry(url);
+
+    /* weight 1/4 on the newest sample: recent behaviour dominates within a few scrapes */
+    entry->attempts++;
+    entry->success_rate += ((success ? 1.0 : 0.0) - entry->success_rate) / 4;
+    if (success) {
+        if (entry->latency == 0)
+            entry->latency = latency_ms;
+        else
+            entry->latency += (latency_ms - entry->latency) / 4;
+        entry->failures_in_row = 0;
+        entry->backoff_until = 0;
+        return;
+    }
+
+    entry->failures_in_row++;
+    if (entry->failures_in_row > 1) {
+        int shift = entry->failures_in_row - 2;
+        int backoff = shift < 6 ? TRACKERHEALTH_BACKOFF_MIN << shift : TRACKERHEALTH_BACKOFF_MAX;
+
+        if (backoff > TRACKERHEALTH_BACKOFF_MAX)
+            backoff = TRACKERHEALTH_BACKOFF_MAX;
+        entry->backoff_until = time(NULL) + backoff;
+    }
+    snprintf(entry->last_error, ERRBUF_SIZE, "%s", error ? error : "");
+}
+
+int trackerhealth_backoff(const char *url, const char **error)
+{
+    struct tracker_health *entry = find_entry(url);
+    time_t now = time(NULL);
+
+    if (entry == NULL || entry->backoff_until <= now)
+        return 0;
+    if (error != NULL)
+        *error = entry->last_error;
+    return (int) (entry->backoff_until - now);
+}
+
+/* Expected milliseconds until the tracker answers, counting retries elsewhere. */
+static double expected_cost(const char *url)
+{
+    struct tracker_health *entry = find_entry(url);
+    double latency, rate;
+
+    if (entry == NULL)
+        return TRACKERHEALTH_UNKNOWN_LATENCY;
+    latency = entry->latency > 0 ? entry->latency : TRACKERHEALTH_UNKNOWN_LATENCY;
+    rate = entry->success_rate > 0.05 ? entry->success_rate : 0.05;
+    return latency / rate;
+}
+
+void trackerhealth_sort(char **urls, int count)
+{
+    double *costs;
+
+    if (count < 2)
+        return;
+    costs = malloc(sizeof(double) * count);
+    for (int i = 0; i < count; i++)
+        costs[i] = expected_cost(urls[i]);
+
+    /* insertion sort: stable, and announce-list tiers are short */
+    for (int i = 1; i < count; i++) {
+        char *url = urls[i];
+        double cost = costs[i];
+        int j = i;
+
+        for (; j > 0 && costs[j - 1] > cost; j--) {
+            urls[j] = urls[j - 1];
+            costs[j] = costs[j - 1];
+        }
+        urls[j] = url;
+        costs[j] = cost;
+    }
+    free(costs);
+}
+
+/* -------------------------------------------------------------------------
+   PERSISTENCE: one "<url> <attempts> <success rate> <latency ms>
+   <failures in a row> <backoff until> <last error>" per line
+   ------------------------------------------------------------------------- */
+int trackerhealth_load(const char *file_name)
+{
+    FILE *fp = fopen(file_name, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+
+    if (fp == NULL)
+        return 0;
+    while (getline(&line, &line_size, fp) > 0) {
+        struct tracker_health *entry;
+        char *url = malloc(strlen(line) + 1);
+        int attempts, failures_in_row, error_at = 0;
+        double success_rate, latency;
+        long long int backoff_until;
+
+        if (sscanf(line, "%s %d %lf %lf %d %lld %n", url, &attempts, &success_rate, &latency,
+                   &failures_in_row, &backoff_until, &error_at) != 6 || error_at == 0 ||
+            success_rate < 0 || success_rate > 1 || latency < 0) {
+            free(url);
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        entry = get_entry(url);
+        entry->attempts = attempts;
+        entry->success_rate = success_rate;
+        entry->latency = latency;
+        entry->failures_in_row = failures_in_row;
+        entry->backoff_until = (time_t) backoff_until;
+        snprintf(entry->last_error, ERRBUF_SIZE, "%s", line + error_at);
+        free(url);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+int trackerhealth_save(const char *file_name)
+{
+    char *tmp_name = malloc(strlen(file_name) + 8);
+    FILE *fp;
+    int fd;
+
+    /* write a temporary file and rename it, concurrent runs may share the file */
+    sprintf(tmp_name, "%s.XXXXXX", file_name);
+    fd = mkstemp(tmp_name);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        free(tmp_name);
+        return 1;
+    }
+    for (int i = 0; i < entry_count; i++) {
+        fprintf(fp, "%s %d %.3f %.0f %d %lld %s\n", entries[i].url, entries[i].attempts,
+                entries[i].success_rate, entries[i].latency, entries[i].failures_in_row,
+                (long long int) entries[i].backoff_until, entries[i].last_error);
+    }
+    if (fclose(fp) != 0 || rename(tmp_name, file_name) != 0) {
+        unlink(tmp_name);
+        free(tmp_name);
+        return 1;
+    }
+    free(tmp_name);
+    return 0;
+}
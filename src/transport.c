@@ -0,0 +1,326 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+#include "transport.h"
+
+/* -------------------------------------------------------------------------
+   PLAIN TCP
+   ------------------------------------------------------------------------- */
+static int plain_handshake(struct transport *transport)
+{
+    (void) transport;
+    return 0;
+}
+
+static ssize_t plain_send(struct transport *transport, const void *data, size_t length)
+{
+    ssize_t len = send(transport->fd, data, length, MSG_NOSIGNAL);
+
+    if (len >= 0)
+        return len;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return TRANSPORT_WANT_WRITE;
+    snprintf(transport->error, ERRBUF_SIZE, "%s", strerror(errno));
+    return TRANSPORT_ERROR;
+}
+
+static ssize_t plain_recv(struct transport *transport, void *data, size_t length)
+{
+    ssize_t len = recv(transport->fd, data, length, 0);
+
+    if (len >= 0)
+        return len;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return TRANSPORT_WANT_READ;
+    snprintf(transport->error, ERRBUF_SIZE, "%s", strerror(errno));
+    return TRANSPORT_ERROR;
+}
+
+static void plain_close(struct transport *transport)
+{
+    (void) transport;
+}
+
+static const struct transport_ops plain_ops = {
+    "TCP", plain_handshake, plain_send, plain_recv, plain_close
+};
+
+void transport_plain(struct transport *transport, int fd)
+{
+    memset(transport, 0, sizeof(*transport));
+    transport->ops = &plain_ops;
+    transport->fd = fd;
+}
+
+#ifdef HAVE_OPENSSL
+/* -------------------------------------------------------------------------
+   TLS SESSION CACHE: the newest session per "host:port". OpenSSL's own
+   client cache is off, it has no lookup by server.
+   ------------------------------------------------------------------------- */
+struct tls_session {
+    char *key;
+    SSL_SESSION *session;
+};
+
+static struct tls_session *sessions;
+static int session_count;
+static int session_capacity;
+
+static struct tls_session *session_find(const char *key)
+{
+    for (int i = 0; i < session_count; i++) {
+        if (strcmp(sessions[i].key, key) == 0)
+            return &sessions[i];
+    }
+    return NULL;
+}
+
+static void session_forget(const char *key)
+{
+    struct tls_session *entry = session_find(key);
+
+    if (entry != NULL) {
+        SSL_SESSION_free(entry->session);
+        free(entry->key);
+        *entry = sessions[--session_count];
+    }
+}
+
+/* A session (TLS 1.3: a ticket, sent after the handshake) for a connection; we keep the reference. */
+static int session_new(SSL *ssl, SSL_SESSION *session)
+{
+    struct transport *transport = SSL_get_app_data(ssl);
+    struct tls_session *entry = session_find(transport->session_key);
+
+    if (entry != NULL)
+        SSL_SESSION_free(entry->session);
+    else {
+        if (session_count == session_capacity) {
+            session_capacity = session_capacity ? session_capacity * 2 : 16;
+            sessions = realloc(sessions, sizeof(struct tls_session) * session_capacity);
+        }
+        entry = &sessions[session_count++];
+        entry->key = strdup(transport->session_key);
+    }
+    entry->session = session;
+    return 1;
+}
+
+/* -------------------------------------------------------------------------
+   SOCKET BIO: OpenSSL's own would write() without MSG_NOSIGNAL, and a
+   tracker that closed the connection would kill us with SIGPIPE
+   ------------------------------------------------------------------------- */
+static int bio_write(BIO *bio, const char *data, int length)
+{
+    ssize_t len = send((int) (intptr_t) BIO_get_data(bio), data, length, MSG_NOSIGNAL);
+
+    BIO_clear_retry_flags(bio);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        BIO_set_retry_write(bio);
+    return (int) len;
+}
+
+static int bio_read(BIO *bio, char *data, int length)
+{
+    ssize_t len = recv((int) (intptr_t) BIO_get_data(bio), data, length, 0);
+
+    BIO_clear_retry_flags(bio);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        BIO_set_retry_read(bio);
+    return (int) len;
+}
+
+static long bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+    (void) bio;
+    (void) num;
+    (void) ptr;
+    return cmd == BIO_CTRL_FLUSH;
+}
+
+/* -------------------------------------------------------------------------
+   TLS
+   ------------------------------------------------------------------------- */
+static SSL_CTX *tls_context;
+static BIO_METHOD *socket_method;
+
+static int tls_init(void)
+{
+    if (tls_context != NULL)
+        return 0;
+
+    socket_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "scrape socket");
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if (socket_method == NULL || tls_context == NULL) {
+        BIO_meth_free(socket_method);
+        SSL_CTX_free(tls_context);
+        tls_context = NULL;
+        return 1;
+    }
+    BIO_meth_set_write(socket_method, bio_write);
+    BIO_meth_set_read(socket_method, bio_read);
+    BIO_meth_set_ctrl(socket_method, bio_ctrl);
+
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(tls_context);
+    /* the send buffer grows (and moves) while a write waits to be retried */
+    SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* plenty of trackers close without close_notify; HTTP framing still
+       tells a complete response from a cut one, except for a body that
+       runs until the close */
+    SSL_CTX_set_options(tls_context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_context, session_new);
+    return 0;
+}
+
+/* Map a failed SSL_* call to a TRANSPORT_ code, describing errors. */
+static int tls_error(struct transport *transport, int ret)
+{
+    SSL *ssl = transport->backend;
+    int error = SSL_get_error(ssl, ret);
+    long verify = SSL_get_verify_result(ssl);
+    unsigned long code = ERR_peek_last_error();
+
+    if (error == SSL_ERROR_WANT_READ)
+        return TRANSPORT_WANT_READ;
+    if (error == SSL_ERROR_WANT_WRITE)
+        return TRANSPORT_WANT_WRITE;
+
+    if (verify != X509_V_OK)
+        snprintf(transport->error, ERRBUF_SIZE, "certificate verify failed: %s",
+                 X509_verify_cert_error_string(verify));
+    else if (code != 0 && ERR_reason_error_string(code) != NULL)
+        snprintf(transport->error, ERRBUF_SIZE, "%s", ERR_reason_error_string(code));
+    else if (error == SSL_ERROR_SYSCALL && errno != 0)
+        snprintf(transport->error, ERRBUF_SIZE, "%s", strerror(errno));
+    else
+        snprintf(transport->error, ERRBUF_SIZE, "connection closed");
+    ERR_clear_error();
+    return TRANSPORT_ERROR;
+}
+
+static int tls_handshake(struct transport *transport)
+{
+    int ret;
+
+    /* so tls_error() only reports what this call's socket I/O set */
+    errno = 0;
+    ret = SSL_connect(transport->backend);
+    if (ret == 1) {
+        transport->resumed = SSL_session_reused(transport->backend);
+        return 0;
+    }
+    ret = tls_error(transport, ret);
+    /* a session the server rejected mid-handshake won't do better next time */
+    if (ret == TRANSPORT_ERROR)
+        session_forget(transport->session_key);
+    return ret;
+}
+
+static ssize_t tls_send(struct transport *transport, const void *data, size_t length)
+{
+    int ret;
+
+    errno = 0;
+    ret = SSL_write(transport->backend, data, length > INT32_MAX ? INT32_MAX : (int) length);
+    return ret > 0 ? ret : tls_error(transport, ret);
+}
+
+static ssize_t tls_recv(struct transport *transport, void *data, size_t length)
+{
+    int ret;
+
+    errno = 0;
+    ret = SSL_read(transport->backend, data, length > INT32_MAX ? INT32_MAX : (int) length);
+    if (ret > 0)
+        return ret;
+    if (SSL_get_error(transport->backend, ret) == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    return tls_error(transport, ret);
+}
+
+static void tls_close(struct transport *transport)
+{
+    SSL *ssl = transport->backend;
+
+    /* SSL_free() drops the session of a connection that wasn't shut down;
+       a quiet shutdown keeps it resumable without writing anything */
+    if (SSL_is_init_finished(ssl)) {
+        SSL_set_quiet_shutdown(ssl, 1);
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    free(transport->session_key);
+    transport->backend = NULL;
+    transport->session_key = NULL;
+}
+
+static const struct transport_ops tls_ops = {
+    "TLS", tls_handshake, tls_send, tls_recv, tls_close
+};
+
+int transport_tls(struct transport *transport, int fd, const char *host, int port)
+{
+    struct tls_session *cached;
+    unsigned char address[16];
+    int literal;
+    SSL *ssl;
+    BIO *bio;
+
+    memset(transport, 0, sizeof(*transport));
+    transport->fd = fd;
+    if (tls_init() != 0 || (ssl = SSL_new(tls_context)) == NULL) {
+        snprintf(transport->error, ERRBUF_SIZE, "cannot set up TLS");
+        ERR_clear_error();
+        return 1;
+    }
+    bio = BIO_new(socket_method);
+    BIO_set_data(bio, (void *) (intptr_t) fd);
+    BIO_set_init(bio, 1);
+    SSL_set_bio(ssl, bio, bio);
+
+    /* no SNI for an address (RFC 6066), and the certificate must name it as one */
+    literal = inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+    if (literal)
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    else {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+
+    transport->ops = &tls_ops;
+    transport->backend = ssl;
+    transport->session_key = malloc(strlen(host) + 8);
+    sprintf(transport->session_key, "%s:%d", host, port);
+    SSL_set_app_data(ssl, transport);
+    cached = session_find(transport->session_key);
+    if (cached != NULL)
+        SSL_set_session(ssl, cached->session);
+    SSL_set_connect_state(ssl);
+    return 0;
+}
+#else
+int transport_tls(struct transport *transport, int fd, const char *host, int port)
+{
+    (void) host;
+    (void) port;
+    memset(transport, 0, sizeof(*transport));
+    transport->fd = fd;
+    snprintf(transport->error, ERRBUF_SIZE, "https:// needs a build with OpenSSL");
+    return 1;
+}
+#endif
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Start mocktracker on free local ports, benchmark HTTP, HTTPS and UDP
+# scrapes against it, and stop it. HTTPS needs a mocktracker built with
+# OpenSSL and openssl(1) for a throwaway certificate. Extra arguments go
+# to scrapebench.
+#   tools/bench.sh <build dir> [scrapebench options]
+set -e
+build=${1:-build}
+[ $# -gt 0 ] && shift
+port=${BENCH_PORT:-16969}
+tls_port=$((port + 1))
+tmp=$(mktemp -d)
+
+tls=
+if "$build/mocktracker" -h | grep -q -- "-s <port>" &&
+   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 -subj /CN=127.0.0.1 \
+       -addext subjectAltName=IP:127.0.0.1 -keyout "$tmp/key.pem" -out "$tmp/cert.pem" >/dev/null 2>&1; then
+    cat "$tmp/cert.pem" "$tmp/key.pem" > "$tmp/mock.pem"
+    tls="-s $tls_port -c $tmp/mock.pem"
+fi
+
+"$build/mocktracker" -q -p "$port" -u "$port" $tls ${MOCK_OPTIONS} &
+mock=$!
+trap 'kill $mock 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+sleep 0.2
+
+echo "== HTTP, 1 hash per request"
+"$build/scrapebench" -m "$@" "http://127.0.0.1:$port/announce"
+echo "== HTTP, 50 hashes per request"
+"$build/scrapebench" -m -k 50 "$@" "http://127.0.0.1:$port/announce"
+if [ -n "$tls" ]; then
+    echo "== HTTPS, 1 hash per request"
+    SSL_CERT_FILE="$tmp/cert.pem" "$build/scrapebench" -m "$@" "https://127.0.0.1:$tls_port/announce"
+fi
+echo "== UDP, 1 hash per request"
+"$build/scrapebench" -m "$@" "udp://127.0.0.1:$port/announce"
+echo "== UDP, 74 hashes per request"
+"$build/scrapebench" -m -k 74 "$@" "udp://127.0.0.1:$port/announce"
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Fetch a magnet's metadata from mockpeer seeds that behave and ones that
+# don't (bencode garbage, corrupt pieces, rejects): misbehaving peers must
+# be dropped with an error, never take dumptorrent down with them.
+#   tools/metadata_test.sh <build dir>
+set -e
+build=${1:-build}
+port=${METADATA_TEST_PORT:-16881}
+tmp=$(mktemp -d)
+peers=
+trap 'kill $peers 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+mkdir "$tmp/content"
+head -c 100000 /dev/zero > "$tmp/content/a.bin"
+echo hello > "$tmp/content/b.txt"
+# 16K pieces: metadata of a few ut_metadata pieces
+hash=$("$build/dumptorrent" create "$tmp/content" -a http://127.0.0.1:1/announce -p 16K -o "$tmp/t.torrent" |
+       sed 's/.*: //')
+
+# good, bad extension handshake, bad ut_metadata answers, corrupt pieces, rejects
+i=0
+for flags in "" -g -G -x -r; do
+    "$build/mockpeer" -q -p $((port + i)) $flags "$tmp/t.torrent" > "$tmp/peer$i.log" &
+    peers="$peers $!"
+    i=$((i + 1))
+done
+sleep 0.3
+
+failures=0
+# expect <exit code> <text in the output> <peer index>...
+expect() {
+    code=$1 text=$2
+    shift 2
+    args=
+    for peer in "$@"; do
+        args="$args --peer 127.0.0.1:$((port + peer))"
+    done
+    status=0
+    "$build/dumptorrent" -w 5 $args -magnet "magnet:?xt=urn:btih:$hash" > "$tmp/out" 2>&1 || status=$?
+    if [ "$status" -ne "$code" ] || ! grep -q -- "$text" "$tmp/out"; then
+        echo "FAIL: peers $*: exit $status, wanted $code and \"$text\""
+        cat "$tmp/out"
+        failures=$((failures + 1))
+    else
+        echo "ok: peers $*: $text"
+    fi
+}
+
+expect 0 "b.txt" 0
+expect 1 "bad extension handshake" 1
+expect 1 "bad ut_metadata message" 2
+expect 1 "doesn't match the info hash" 3
+expect 1 "rejected metadata piece" 4
+expect 0 "b.txt" 1 2 3 4 0
+
+[ "$failures" -eq 0 ]
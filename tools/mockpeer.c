@@ -0,0 +1,328 @@
+/*
+ * mockpeer: a seeding peer on localhost for testing dumptorrent's magnet
+ * metadata fetch offline. It serves a .torrent's info dictionary over the
+ * BitTorrent handshake, the BEP 10 extension handshake and BEP 9
+ * ut_metadata, and can misbehave: reject every request, send corrupted
+ * pieces or malformed bencode, or lack the extension protocol. It has no
+ * file data to offer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "benc.h"
+#include "sha1.h"
+
+#define MAX_CLIENTS     256
+#define MAX_MESSAGE     65536
+#define PIECE_SIZE      16384
+#define HANDSHAKE_LENGTH 68
+#define MSG_EXTENDED    20
+#define UT_METADATA_ID  3                /* not 1, so clients must use the id we give */
+
+static int option_port = 6881;
+static int option_reject = 0;            /* answer every request with a reject */
+static int option_corrupt = 0;           /* flip a byte in every piece sent */
+static int option_no_extensions = 0;     /* no BEP 10 bit in the handshake */
+static int option_bad_handshake = 0;     /* an extension handshake that isn't bencode */
+static int option_bad_messages = 0;      /* ut_metadata answers that aren't bencode */
+static int option_quiet = 0;
+
+struct client {
+    int fd;                              /* -1 for a free slot */
+    int handshaken;
+    int ut_metadata;                     /* the client's id for our answers */
+    unsigned char in[MAX_MESSAGE + 4];
+    int length;
+};
+
+static struct client clients[MAX_CLIENTS];
+static const char *metadata;             /* the info dictionary as in the file */
+static int metadata_size;
+static unsigned char info_hash[20];
+static long long int pieces_served, pieces_rejected, connections;
+static volatile sig_atomic_t stopping;
+
+static void client_close(int slot)
+{
+    close(clients[slot].fd);
+    clients[slot].fd = -1;
+}
+
+/* Blocking: the client reads while it waits for pieces. */
+static void client_send(int slot, const void *data, int length)
+{
+    if (clients[slot].fd >= 0 && send(clients[slot].fd, data, length, MSG_NOSIGNAL) != length)
+        client_close(slot);
+}
+
+static void send_extended(int slot, int id, const char *payload, int length)
+{
+    unsigned char head[6];
+    unsigned int size = htonl((unsigned int) length + 2);
+
+    memcpy(head, &size, 4);
+    head[4] = MSG_EXTENDED;
+    head[5] = (unsigned char) id;
+    client_send(slot, head, 6);
+    client_send(slot, payload, length);
+}
+
+static void send_handshakes(int slot)
+{
+    unsigned char handshake[HANDSHAKE_LENGTH];
+    char extensions[128];
+
+    handshake[0] = 19;
+    memcpy(handshake + 1, "BitTorrent protocol", 19);
+    memset(handshake + 20, 0, 8);
+    if (!option_no_extensions)
+        handshake[25] = 0x10;
+    memcpy(handshake + 28, info_hash, 20);
+    memcpy(handshake + 48, "-MP0000-mockpeer0000", 20);
+    client_send(slot, handshake, HANDSHAKE_LENGTH);
+    if (option_no_extensions)
+        return;
+    if (option_bad_handshake) {
+        send_extended(slot, 0, "d1:mi1e", 7);
+        return;
+    }
+    snprintf(extensions, sizeof(extensions), "d1:md11:ut_metadatai%dee13:metadata_sizei%dee", UT_METADATA_ID,
+             metadata_size);
+    send_extended(slot, 0, extensions, (int) strlen(extensions));
+}
+
+static void extended_message(int slot, const char *payload, int length)
+{
+    struct benc_entity *root, *m, *type, *piece;
+    char errbuf[ERRBUF_SIZE], head[128];
+
+    if (length < 1)
+        return;
+    root = benc_parse_memory(payload + 1, length - 1, NULL, errbuf);
+    if (root == NULL || root->type != BENC_DICTIONARY) {
+        if (root != NULL)
+            benc_free_entity(root);
+        return;
+    }
+    if (payload[0] == 0) {
+        m = benc_lookup_string(root, "m");
+        m = m != NULL && m->type == BENC_DICTIONARY ? benc_lookup_string(m, "ut_metadata") : NULL;
+        if (m != NULL && m->type == BENC_INTEGER)
+            clients[slot].ut_metadata = (int) m->integer;
+    }
+    else if (payload[0] == UT_METADATA_ID && clients[slot].ut_metadata > 0) {
+        type = benc_lookup_string(root, "msg_type");
+        piece = benc_lookup_string(root, "piece");
+        if (type != NULL && type->type == BENC_INTEGER && type->integer == 0 && piece != NULL && piece->type == BENC_INTEGER) {
+            long long int offset = piece->integer * PIECE_SIZE;
+
+            if (option_bad_messages)
+                send_extended(slot, clients[slot].ut_metadata, "d8:msg_typei1e5:piecei0e", 24);
+            else if (option_reject || offset < 0 || offset >= metadata_size) {
+                snprintf(head, sizeof(head), "d8:msg_typei2e5:piecei%lldee", piece->integer);
+                send_extended(slot, clients[slot].ut_metadata, head, (int) strlen(head));
+                pieces_rejected++;
+            } else {
+                int size = metadata_size - offset < PIECE_SIZE ? (int) (metadata_size - offset) : PIECE_SIZE;
+                int head_length = snprintf(head, sizeof(head), "d8:msg_typei1e5:piecei%llde10:total_sizei%dee",
+                                           piece->integer, metadata_size);
+                char *message = malloc(head_length + size);
+
+                memcpy(message, head, head_length);
+                memcpy(message + head_length, metadata + offset, size);
+                if (option_corrupt)
+                    message[head_length + size / 2] ^= 0x55;
+                send_extended(slot, clients[slot].ut_metadata, message, head_length + size);
+                free(message);
+                pieces_served++;
+            }
+        }
+    }
+    benc_free_entity(root);
+}
+
+static void client_read(int slot)
+{
+    struct client *client = &clients[slot];
+    ssize_t len = recv(client->fd, client->in + client->length, sizeof(client->in) - client->length, 0);
+    int offset = 0;
+
+    if (len <= 0) {
+        client_close(slot);
+        return;
+    }
+    client->length += (int) len;
+
+    if (!client->handshaken) {
+        if (client->length < HANDSHAKE_LENGTH)
+            return;
+        if (client->in[0] != 19 || memcmp(client->in + 1, "BitTorrent protocol", 19) != 0 ||
+            memcmp(client->in + 28, info_hash, 20) != 0) {
+            client_close(slot);
+            return;
+        }
+        client->handshaken = 1;
+        offset = HANDSHAKE_LENGTH;
+        send_handshakes(slot);
+    }
+    while (client->fd >= 0 && client->length - offset >= 4) {
+        unsigned int size;
+
+        memcpy(&size, client->in + offset, 4);
+        size = ntohl(size);
+        if (size > MAX_MESSAGE) {
+            client_close(slot);
+            return;
+        }
+        if ((unsigned int) (client->length - offset - 4) < size)
+            break;
+        if (size >= 1 && client->in[offset + 4] == MSG_EXTENDED)
+            extended_message(slot, (const char *) client->in + offset + 5, (int) size - 1);
+        offset += 4 + (int) size;
+    }
+    if (client->fd >= 0) {
+        memmove(client->in, client->in + offset, client->length - offset);
+        client->length -= offset;
+    }
+}
+
+static void on_signal(int signal)
+{
+    (void) signal;
+    stopping = 1;
+}
+
+static void print_usage(const char *arg0)
+{
+    printf("Usage: %s [options] <file.torrent>\n", arg0);
+    printf("  -p <port> : TCP port (default 6881)\n");
+    printf("  -r        : reject every metadata request\n");
+    printf("  -x        : corrupt every metadata piece sent\n");
+    printf("  -n        : no extension protocol (BEP 10)\n");
+    printf("  -g        : send an extension handshake that isn't bencode\n");
+    printf("  -G        : answer metadata requests with something that isn't bencode\n");
+    printf("  -q        : no summary on exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int index_of[MAX_CLIENTS + 1];
+    struct benc_entity *root, *info;
+    struct sockaddr_in addr;
+    char errbuf[ERRBUF_SIZE];
+    char *data;
+    int listen_fd, length, opt, on = 1;
+    SHA_CTX ctx;
+
+    while ((opt = getopt(argc, argv, "p:rxngGqh")) != -1) {
+        switch (opt) {
+        case 'p': option_port = atoi(optarg); break;
+        case 'r': option_reject = 1; break;
+        case 'x': option_corrupt = 1; break;
+        case 'n': option_no_extensions = 1; break;
+        case 'g': option_bad_handshake = 1; break;
+        case 'G': option_bad_messages = 1; break;
+        case 'q': option_quiet = 1; break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* info->raw points into data, which stays loaded */
+    data = benc_load_file(argv[optind], &length, errbuf);
+    root = data != NULL ? benc_parse_memory(data, length, NULL, errbuf) : NULL;
+    info = root != NULL && root->type == BENC_DICTIONARY ? benc_lookup_string(root, "info") : NULL;
+    if (info == NULL || info->type != BENC_DICTIONARY) {
+        fprintf(stderr, "%s: %s\n", argv[optind], root == NULL ? errbuf : "no info dictionary");
+        return 1;
+    }
+    metadata = info->raw;
+    metadata_size = info->raw_length;
+    SHAInit(&ctx);
+    SHAUpdate(&ctx, (unsigned char *) metadata, metadata_size);
+    SHAFinal(info_hash, &ctx);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short) option_port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+        fprintf(stderr, "cannot listen on 127.0.0.1:%d: %s\n", option_port, strerror(errno));
+        return 1;
+    }
+    printf("127.0.0.1:%d seeding ", option_port);
+    for (int i = 0; i < 20; i++)
+        printf("%02x", info_hash[i]);
+    printf(" (%d bytes of metadata)\n", metadata_size);
+    fflush(stdout);
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stopping) {
+        int count = 0;
+
+        fds[count].fd = listen_fd;
+        fds[count].events = POLLIN;
+        index_of[count++] = -1;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0) {
+                fds[count].fd = clients[i].fd;
+                fds[count].events = POLLIN;
+                index_of[count++] = i;
+            }
+        }
+        if (poll(fds, count, -1) < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < count; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (index_of[i] < 0) {
+                int fd = accept(listen_fd, NULL, NULL), slot = 0;
+
+                while (slot < MAX_CLIENTS && clients[slot].fd >= 0)
+                    slot++;
+                if (fd >= 0 && slot == MAX_CLIENTS)
+                    close(fd);
+                else if (fd >= 0) {
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    memset(&clients[slot], 0, sizeof(struct client));
+                    clients[slot].fd = fd;
+                    connections++;
+                }
+            }
+            else if (clients[index_of[i]].fd == fds[i].fd)
+                client_read(index_of[i]);
+        }
+    }
+
+    if (!option_quiet)
+        fprintf(stderr, "%lld connections, %lld pieces served, %lld rejected\n", connections, pieces_served,
+                pieces_rejected);
+    benc_free_entity(root);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,727 @@
+/*
+ * mocktracker: a tracker on localhost for testing and benchmarking scrapec
+ * offline. It speaks HTTP scrape and announce (keep-alive and pipelining
+ * included), the same over TLS when built with OpenSSL, and BEP 15 UDP,
+ * and can add latency, drop packets, inject errors, pad responses and
+ * refuse to scrape. Announces return no peers.
+ *
+ * Every info hash is known; its counts are derived from its bytes
+ * (seeders = h[0], completed = h[1] | h[2] << 8, leechers = h[3]) so a
+ * client can check what it got back.
+ */
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#define MAX_CLIENTS    1024
+#define MAX_REQUEST    16384
+#define UDP_MAX_HASHES 74
+
+static int option_http_port = 6969;
+static int option_udp_port = 6969;
+static int option_tls_port = 0;
+static const char *option_certificate = NULL;  /* PEM with the certificate and its key */
+static int option_latency_ms = 0;
+static int option_jitter_ms = 0;
+static int option_loss = 0;          /* percent of UDP packets and HTTP requests dropped */
+static int option_errors = 0;        /* percent answered with a tracker error */
+static int option_extra = 0;         /* unrequested "files" entries padding each HTTP answer */
+static int option_min_interval = 0;
+static int option_no_scrape = 0;     /* scrapes get a tracker error, announces still work */
+static int option_quiet = 0;
+
+/* An answer held back until due; HTTP ones keep their connection's order. */
+struct delayed {
+    long long int due;
+    int client;                      /* index in clients[], -1 for UDP */
+    unsigned int generation;         /* the client's, so a reused slot doesn't get it */
+    struct sockaddr_storage addr;    /* UDP */
+    socklen_t addr_length;
+    char *data;
+    int length;
+    struct delayed *next;
+};
+
+struct client {
+    int fd;                          /* -1 for a free slot */
+    unsigned int generation;
+    char request[MAX_REQUEST];
+    int length;
+    long long int last_due;
+    int closing;                     /* closed once its last answer is out */
+#ifdef HAVE_OPENSSL
+    SSL *ssl;                        /* NULL for plain HTTP */
+#endif
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct delayed *delayed;      /* sorted by due */
+static unsigned char connection_id[8];
+static long long int requests_served, packets_dropped;
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_context;
+static long long int tls_handshakes, tls_resumed;
+#endif
+
+static long long int now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int chance(int percent)
+{
+    return percent > 0 && rand() % 100 < percent;
+}
+
+static long long int due_time(void)
+{
+    long long int due = now_ms() + option_latency_ms;
+
+    if (option_jitter_ms > 0)
+        due += rand() % (option_jitter_ms + 1);
+    return due;
+}
+
+static void put_u32(unsigned char *ptr, unsigned int value)
+{
+    value = htonl(value);
+    memcpy(ptr, &value, 4);
+}
+
+static unsigned int get_u32(const unsigned char *ptr)
+{
+    unsigned int value;
+    memcpy(&value, ptr, 4);
+    return ntohl(value);
+}
+
+/* -------------------------------------------------------------------------
+   DELAYED ANSWERS
+   ------------------------------------------------------------------------- */
+static void send_now(int udp_fd, struct delayed *answer)
+{
+    if (answer->client < 0) {
+        sendto(udp_fd, answer->data, answer->length, 0, (struct sockaddr *) &answer->addr, answer->addr_length);
+        return;
+    }
+    if (clients[answer->client].fd >= 0 && clients[answer->client].generation == answer->generation) {
+        int sent = 0;
+
+        /* blocking socket: the client is expected to read what it asked for */
+        while (sent < answer->length) {
+            int n;
+
+#ifdef HAVE_OPENSSL
+            if (clients[answer->client].ssl != NULL)
+                n = SSL_write(clients[answer->client].ssl, answer->data + sent, answer->length - sent);
+            else
+#endif
+            n = send(clients[answer->client].fd, answer->data + sent, answer->length - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+    }
+}
+
+static void schedule(struct delayed *answer)
+{
+    struct delayed **link = &delayed;
+
+    while (*link != NULL && (*link)->due <= answer->due)
+        link = &(*link)->next;
+    answer->next = *link;
+    *link = answer;
+}
+
+static void answer(int udp_fd, struct delayed *answer)
+{
+    if (option_latency_ms == 0 && option_jitter_ms == 0) {
+        send_now(udp_fd, answer);
+        free(answer->data);
+        free(answer);
+        return;
+    }
+    schedule(answer);
+}
+
+static void client_close(int index)
+{
+#ifdef HAVE_OPENSSL
+    SSL_free(clients[index].ssl);
+    clients[index].ssl = NULL;
+#endif
+    close(clients[index].fd);
+    clients[index].fd = -1;
+    clients[index].closing = 0;
+    clients[index].generation++;
+}
+
+static void send_due(int udp_fd)
+{
+    long long int now = now_ms();
+
+    while (delayed != NULL && delayed->due <= now) {
+        struct delayed *answer = delayed;
+        struct client *client = answer->client >= 0 ? &clients[answer->client] : NULL;
+
+        delayed = answer->next;
+        send_now(udp_fd, answer);
+        if (client != NULL && client->closing && client->generation == answer->generation &&
+            answer->due >= client->last_due)
+            client_close(answer->client);
+        free(answer->data);
+        free(answer);
+    }
+}
+
+/* -------------------------------------------------------------------------
+   BENCODED SCRAPE ANSWER
+   ------------------------------------------------------------------------- */
+struct buffer {
+    char *data;
+    int length;
+    int capacity;
+};
+
+static void append(struct buffer *buffer, const void *data, int length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        while (buffer->length + length > buffer->capacity)
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void appendf(struct buffer *buffer, const char *format, long long int value)
+{
+    char text[64];
+    append(buffer, text, snprintf(text, sizeof(text), format, value));
+}
+
+static void append_file(struct buffer *body, const unsigned char *hash)
+{
+    append(body, "20:", 3);
+    append(body, hash, 20);
+    appendf(body, "d8:completei%llde", hash[0]);
+    appendf(body, "10:downloadedi%llde", hash[1] | hash[2] << 8);
+    appendf(body, "10:incompletei%lldee", hash[3]);
+}
+
+/* "files" keys must be sorted: the requested hashes come sorted, and the
+   padding hashes are 0xff but for a 4-byte counter, so they sort last. */
+static void scrape_body(struct buffer *body, unsigned char (*hashes)[20], int count)
+{
+    append(body, "d5:filesd", 9);
+    for (int i = 0; i < count; i++)
+        append_file(body, hashes[i]);
+    for (int i = 0; i < option_extra; i++) {
+        unsigned char hash[20];
+
+        memset(hash, 0xff, sizeof(hash));
+        hash[16] = (unsigned char) (i >> 24);
+        hash[17] = (unsigned char) (i >> 16);
+        hash[18] = (unsigned char) (i >> 8);
+        hash[19] = (unsigned char) i;
+        append_file(body, hash);
+    }
+    append(body, "e", 1);
+    if (option_min_interval > 0)
+        appendf(body, "5:flagsd20:min_request_intervali%lldee", option_min_interval);
+    append(body, "e", 1);
+}
+
+/* A compact announce answer with the counts but no peers. */
+static void announce_body(struct buffer *body, const unsigned char *hash)
+{
+    appendf(body, "d8:completei%llde", hash[0]);
+    appendf(body, "10:downloadedi%llde", hash[1] | hash[2] << 8);
+    appendf(body, "10:incompletei%llde", hash[3]);
+    append(body, "8:intervali1800e5:peers0:e", 26);
+}
+
+static int compare_hash(const void *a, const void *b)
+{
+    return memcmp(a, b, 20);
+}
+
+/* -------------------------------------------------------------------------
+   HTTP
+   ------------------------------------------------------------------------- */
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Percent-decode one query value into exactly 20 bytes; 0 if it isn't a hash. */
+static int decode_hash(const char *value, const char *end, unsigned char *hash)
+{
+    int length = 0;
+
+    while (value < end && length < 20) {
+        if (*value == '%' && end - value >= 3 && hex_value(value[1]) >= 0 && hex_value(value[2]) >= 0) {
+            hash[length++] = (unsigned char) (hex_value(value[1]) << 4 | hex_value(value[2]));
+            value += 3;
+        } else {
+            hash[length++] = (unsigned char) *value++;
+        }
+    }
+    return length == 20 && value == end;
+}
+
+/* Is there a "Connection: close" header among the header lines? */
+static int wants_close(const char *headers)
+{
+    for (const char *line = headers; *line; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11 + strspn(line + 11, " \t");
+            if (strncasecmp(value, "close", 5) == 0)
+                return 1;
+        }
+        if (strstr(line, "\r\n") == NULL)
+            break;
+    }
+    return 0;
+}
+
+/* One complete request head: queue its answer. 0 keeps the connection, 1
+   closes it after the answer, -1 drops it at once (the injected loss). */
+static int http_request(int udp_fd, int index, char *head)
+{
+    struct client *client = &clients[index];
+    unsigned char (*hashes)[20] = NULL;
+    struct buffer body = {NULL, 0, 0}, response = {NULL, 0, 0};
+    struct delayed *delayed_answer;
+    char *target, *query, *version, *line_end;
+    int count = 0, keep_alive, announce;
+
+    line_end = strstr(head, "\r\n");
+    if (line_end == NULL || strncmp(head, "GET ", 4) != 0)
+        return 1;
+    *line_end = '\0';
+    target = head + 4;
+    version = strrchr(target, ' ');
+    if (version == NULL)
+        return 1;
+    *version++ = '\0';
+    keep_alive = strcmp(version, "HTTP/1.1") == 0 && !wants_close(line_end + 2);
+    requests_served++;
+    if (chance(option_loss)) {
+        packets_dropped++;
+        return -1;
+    }
+
+    query = strchr(target, '?');
+    if (query != NULL)
+        *query = '\0';
+    announce = strstr(target, "/announce") != NULL;
+    if (query != NULL)
+        *query = '?';
+    for (; query != NULL; query = strchr(query, '&')) {
+        char *value = ++query, *end = query + strcspn(query, "&");
+
+        if (strncmp(value, "info_hash=", 10) != 0)
+            continue;
+        hashes = realloc(hashes, 20 * (count + 1));
+        if (decode_hash(value + 10, end, hashes[count]))
+            count++;
+    }
+
+    if (chance(option_errors))
+        append(&body, "d14:failure reason14:injected errore", 36);
+    else if (announce && count == 1)
+        announce_body(&body, hashes[0]);
+    else if (announce)
+        append(&body, "d14:failure reason17:invalid info_hashe", 39);
+    else if (option_no_scrape)
+        append(&body, "d14:failure reason15:scrape disablede", 37);
+    else {
+        qsort(hashes, count, 20, compare_hash);
+        scrape_body(&body, hashes, count);
+    }
+    append(&response, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n", 43);
+    appendf(&response, "Content-Length: %lld\r\n", body.length);
+    if (!keep_alive)
+        append(&response, "Connection: close\r\n", 19);
+    append(&response, "\r\n", 2);
+    append(&response, body.data, body.length);
+    free(body.data);
+    free(hashes);
+
+    delayed_answer = calloc(1, sizeof(struct delayed));
+    delayed_answer->client = index;
+    delayed_answer->generation = client->generation;
+    delayed_answer->data = response.data;
+    delayed_answer->length = response.length;
+    /* pipelined answers leave in request order whatever their jitter */
+    delayed_answer->due = due_time();
+    if (delayed_answer->due < client->last_due)
+        delayed_answer->due = client->last_due;
+    client->last_due = delayed_answer->due;
+    answer(udp_fd, delayed_answer);
+    return !keep_alive;
+}
+
+static void client_read(int udp_fd, int index)
+{
+    struct client *client = &clients[index];
+    char *head_end;
+    int n;
+
+#ifdef HAVE_OPENSSL
+    if (client->ssl != NULL)
+        n = SSL_read(client->ssl, client->request + client->length, MAX_REQUEST - 1 - client->length);
+    else
+#endif
+    n = recv(client->fd, client->request + client->length, MAX_REQUEST - 1 - client->length, 0);
+    if (n <= 0) {
+        client_close(index);
+        return;
+    }
+    client->length += n;
+    client->request[client->length] = '\0';
+    while ((head_end = strstr(client->request, "\r\n\r\n")) != NULL) {
+        int used = (int) (head_end + 4 - client->request);
+
+        head_end[2] = '\0';
+        switch (http_request(udp_fd, index, client->request)) {
+        case -1:
+            client_close(index);
+            return;
+        case 1:
+            /* answers still held back go out first */
+            if (delayed == NULL)
+                client_close(index);
+            else
+                client->closing = 1;
+            return;
+        }
+        memmove(client->request, client->request + used, client->length - used + 1);
+        client->length -= used;
+    }
+    if (client->length == MAX_REQUEST - 1)
+        client_close(index);
+}
+
+/* -------------------------------------------------------------------------
+   UDP (BEP 15)
+   ------------------------------------------------------------------------- */
+static void udp_packet(int udp_fd)
+{
+    unsigned char packet[2048], reply[8 + 12 * UDP_MAX_HASHES];
+    struct delayed *delayed_answer;
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof(addr);
+    int length = recvfrom(udp_fd, packet, sizeof(packet), 0, (struct sockaddr *) &addr, &addr_length);
+    int reply_length;
+    unsigned int action;
+
+    if (length < 16)
+        return;
+    requests_served++;
+    if (chance(option_loss)) {
+        packets_dropped++;
+        return;
+    }
+    action = get_u32(packet + 8);
+    memcpy(reply + 4, packet + 12, 4);   /* transaction_id */
+
+    if (chance(option_errors)) {
+        put_u32(reply, 3);
+        memcpy(reply + 8, "injected error", 14);
+        reply_length = 22;
+    } else if (action == 0) {
+        if (get_u32(packet) != 0x417 || get_u32(packet + 4) != 0x27101980)
+            return;
+        put_u32(reply, 0);
+        memcpy(reply + 8, connection_id, 8);
+        reply_length = 16;
+    } else if (action == 1 && length >= 98) {
+        const unsigned char *hash = packet + 16;
+
+        if (memcmp(packet, connection_id, 8) != 0) {
+            put_u32(reply, 3);
+            memcpy(reply + 8, "bad connection id", 17);
+            reply_length = 25;
+        } else {
+            put_u32(reply, 1);
+            put_u32(reply + 8, 1800);     /* interval */
+            put_u32(reply + 12, hash[3]); /* leechers */
+            put_u32(reply + 16, hash[0]); /* seeders */
+            reply_length = 20;
+        }
+    } else if (action == 2 && option_no_scrape) {
+        put_u32(reply, 3);
+        memcpy(reply + 8, "scrape disabled", 15);
+        reply_length = 23;
+    } else if (action == 2) {
+        int count = (length - 16) / 20;
+
+        if (memcmp(packet, connection_id, 8) != 0) {
+            put_u32(reply, 3);
+            memcpy(reply + 8, "bad connection id", 17);
+            reply_length = 25;
+        } else {
+            if (count > UDP_MAX_HASHES)
+                count = UDP_MAX_HASHES;
+            put_u32(reply, 2);
+            for (int i = 0; i < count; i++) {
+                const unsigned char *hash = packet + 16 + i * 20;
+                put_u32(reply + 8 + i * 12, hash[0]);
+                put_u32(reply + 12 + i * 12, hash[1] | hash[2] << 8);
+                put_u32(reply + 16 + i * 12, hash[3]);
+            }
+            reply_length = 8 + 12 * count;
+        }
+    } else {
+        return;
+    }
+
+    delayed_answer = calloc(1, sizeof(struct delayed));
+    delayed_answer->client = -1;
+    delayed_answer->addr = addr;
+    delayed_answer->addr_length = addr_length;
+    delayed_answer->data = malloc(reply_length);
+    memcpy(delayed_answer->data, reply, reply_length);
+    delayed_answer->length = reply_length;
+    delayed_answer->due = due_time();
+    answer(udp_fd, delayed_answer);
+}
+
+/* -------------------------------------------------------------------------
+   MAIN
+   ------------------------------------------------------------------------- */
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int signal)
+{
+    (void) signal;
+    stopping = 1;
+}
+
+static void print_usage(const char *arg0)
+{
+    printf("Usage: %s [options]\n", arg0);
+    printf("  -p <port>    : HTTP port, 0 for none (default 6969)\n");
+    printf("  -u <port>    : UDP port, 0 for none (default 6969)\n");
+#ifdef HAVE_OPENSSL
+    printf("  -s <port>    : HTTPS port (default none)\n");
+    printf("  -c <file>    : PEM certificate and private key for -s\n");
+#endif
+    printf("  -l <ms>      : latency added to every answer\n");
+    printf("  -j <ms>      : random extra latency, up to <ms>\n");
+    printf("  -d <percent> : drop UDP packets and HTTP requests\n");
+    printf("  -e <percent> : answer with a tracker error instead\n");
+    printf("  -x <n>       : pad each HTTP answer with <n> unrequested files\n");
+    printf("  -i <seconds> : send min_request_interval (BEP 48 flags)\n");
+    printf("  -n           : refuse to scrape, answer announces only\n");
+    printf("  -q           : no summary on exit\n");
+}
+
+static int open_socket(int type, int port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, type, 0), on = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short) port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(fd, 128) != 0)) {
+        fprintf(stderr, "cannot listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+#ifdef HAVE_OPENSSL
+static void tls_start(void)
+{
+    tls_context = SSL_CTX_new(TLS_server_method());
+    if (option_certificate == NULL || tls_context == NULL ||
+        SSL_CTX_use_certificate_chain_file(tls_context, option_certificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_context, option_certificate, SSL_FILETYPE_PEM) != 1) {
+        fprintf(stderr, "-s needs a certificate and key: -c <pem file>\n");
+        exit(1);
+    }
+    /* SSL_write() to a client that went away */
+    signal(SIGPIPE, SIG_IGN);
+}
+#else
+static void tls_start(void)
+{
+    fprintf(stderr, "-s needs a build with OpenSSL\n");
+    exit(1);
+}
+#endif
+
+/* A new connection; a TLS one does its (blocking) handshake right away. */
+static void client_accept(int listen_fd, int tls)
+{
+    int fd = accept(listen_fd, NULL, NULL), on = 1, slot = 0;
+
+    while (slot < MAX_CLIENTS && clients[slot].fd >= 0)
+        slot++;
+    if (fd < 0)
+        return;
+    if (slot == MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    clients[slot].fd = fd;
+    clients[slot].length = 0;
+    clients[slot].last_due = 0;
+#ifdef HAVE_OPENSSL
+    if (tls) {
+        /* a client that never finishes the handshake can't hang us */
+        struct timeval timeout = {5, 0};
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        clients[slot].ssl = SSL_new(tls_context);
+        SSL_set_fd(clients[slot].ssl, fd);
+        if (SSL_accept(clients[slot].ssl) != 1) {
+            client_close(slot);
+            return;
+        }
+        tls_handshakes++;
+        tls_resumed += SSL_session_reused(clients[slot].ssl);
+    }
+#else
+    (void) tls;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd fds[MAX_CLIENTS + 3];
+    int index_of[MAX_CLIENTS + 3];
+    int listen_fd = -1, tls_fd = -1, udp_fd = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:s:c:l:j:d:e:x:i:nqh")) != -1) {
+        switch (opt) {
+        case 'p': option_http_port = atoi(optarg); break;
+        case 'u': option_udp_port = atoi(optarg); break;
+        case 's': option_tls_port = atoi(optarg); break;
+        case 'c': option_certificate = optarg; break;
+        case 'l': option_latency_ms = atoi(optarg); break;
+        case 'j': option_jitter_ms = atoi(optarg); break;
+        case 'd': option_loss = atoi(optarg); break;
+        case 'e': option_errors = atoi(optarg); break;
+        case 'x': option_extra = atoi(optarg); break;
+        case 'i': option_min_interval = atoi(optarg); break;
+        case 'n': option_no_scrape = 1; break;
+        case 'q': option_quiet = 1; break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    srand((unsigned) time(NULL) ^ (unsigned) getpid());
+    for (int i = 0; i < 8; i++)
+        connection_id[i] = (unsigned char) rand();
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    if (option_http_port > 0)
+        listen_fd = open_socket(SOCK_STREAM, option_http_port);
+    if (option_udp_port > 0)
+        udp_fd = open_socket(SOCK_DGRAM, option_udp_port);
+    if (option_tls_port > 0) {
+        tls_start();
+        tls_fd = open_socket(SOCK_STREAM, option_tls_port);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stopping) {
+        int count = 0, timeout = -1;
+
+        if (listen_fd >= 0) {
+            fds[count].fd = listen_fd;
+            fds[count].events = POLLIN;
+            index_of[count++] = -1;
+        }
+        if (tls_fd >= 0) {
+            fds[count].fd = tls_fd;
+            fds[count].events = POLLIN;
+            index_of[count++] = -1;
+        }
+        if (udp_fd >= 0) {
+            fds[count].fd = udp_fd;
+            fds[count].events = POLLIN;
+            index_of[count++] = -1;
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0 && !clients[i].closing) {
+                fds[count].fd = clients[i].fd;
+                fds[count].events = POLLIN;
+                index_of[count++] = i;
+            }
+        }
+        if (delayed != NULL) {
+            long long int wait = delayed->due - now_ms();
+            timeout = wait > 0 ? (int) wait : 0;
+        }
+        if (poll(fds, count, timeout) < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < count; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (fds[i].fd == listen_fd || fds[i].fd == tls_fd)
+                client_accept(fds[i].fd, fds[i].fd == tls_fd);
+            else if (fds[i].fd == udp_fd)
+                udp_packet(udp_fd);
+            else if (clients[index_of[i]].fd == fds[i].fd) {
+                client_read(udp_fd, index_of[i]);
+#ifdef HAVE_OPENSSL
+                /* a TLS record may hold more than one read took; poll() can't see it */
+                while (clients[index_of[i]].fd == fds[i].fd && clients[index_of[i]].ssl != NULL &&
+                       SSL_pending(clients[index_of[i]].ssl) > 0)
+                    client_read(udp_fd, index_of[i]);
+#endif
+            }
+        }
+        send_due(udp_fd);
+    }
+
+    if (!option_quiet) {
+        fprintf(stderr, "%lld requests, %lld dropped", requests_served, packets_dropped);
+#ifdef HAVE_OPENSSL
+        if (tls_fd >= 0)
+            fprintf(stderr, ", %lld TLS handshakes (%lld resumed)", tls_handshakes, tls_resumed);
+#endif
+        fprintf(stderr, "\n");
+    }
+    return 0;
+}
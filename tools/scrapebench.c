@@ -0,0 +1,198 @@
+/*
+ * scrapebench: drive the scrape engine against one or more trackers
+ * (normally mocktracker) and report throughput and latency percentiles.
+ * Each of -c slots keeps one request in flight, -n requests in all, sent
+ * to the URLs in turn, each for -k random info hashes.
+ */
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+#include "scrapec.h"
+#include "scrape_engine.h"
+
+/* the engine's knobs; the benchmark sets the concurrency itself */
+int option_timeout = 0;
+int option_udp_retries = SCRAPE_UDP_DEFAULT_RETRIES;
+int option_max_age = 0;
+int option_max_requests = 0;
+int option_host_rate = 0;
+int option_announce = 0;
+
+static int option_requests = 1000;
+static int option_concurrency = 16;
+static int option_hashes = 1;
+static int option_check = 0;
+static int option_verbose = 0;
+
+struct bench_slot {
+    struct scrape_request request;
+    unsigned char (*hashes)[20];
+    struct scrape_result *results;
+    long long int started;
+};
+
+struct bench {
+    struct scrape_engine *engine;
+    char **urls;
+    int url_count;
+    int submitted, finished, failed, hashes_ok, wrong;
+    long long int *latencies;    /* microseconds, one per finished request */
+};
+
+static long long int now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_done(struct scrape_request *request, void *arg);
+
+static void bench_submit(struct bench *bench, struct bench_slot *slot)
+{
+    for (int i = 0; i < option_hashes; i++) {
+        for (int j = 0; j < 20; j++)
+            slot->hashes[i][j] = (unsigned char) rand();
+    }
+    memset(&slot->request, 0, sizeof(slot->request));
+    slot->request.url = bench->urls[bench->submitted % bench->url_count];
+    slot->request.info_hashes = (const unsigned char (*)[20]) slot->hashes;
+    slot->request.count = option_hashes;
+    slot->request.results = slot->results;
+    slot->request.callback = bench_done;
+    slot->request.arg = bench;
+    slot->started = now_us();
+    bench->submitted++;
+    scrape_engine_submit(bench->engine, &slot->request, 0);
+}
+
+static void bench_done(struct scrape_request *request, void *arg)
+{
+    struct bench *bench = arg;
+    struct bench_slot *slot = (struct bench_slot *) request;
+
+    bench->latencies[bench->finished++] = now_us() - slot->started;
+    if (request->status != 0) {
+        bench->failed++;
+        if (option_verbose)
+            fprintf(stderr, "%s: %s\n", request->url, request->errbuf);
+    }
+    for (int i = 0; i < request->count; i++) {
+        const struct scrape_result *result = &slot->results[i];
+        const unsigned char *hash = slot->hashes[i];
+
+        if (result->status != 0)
+            continue;
+        bench->hashes_ok++;
+        /* mocktracker's counts follow from the hash; a UDP announce has no completed */
+        if (option_check && (result->seeders != hash[0] || result->leechers != hash[3] ||
+                             (result->completed != -1 && result->completed != (hash[1] | hash[2] << 8))))
+            bench->wrong++;
+    }
+    if (bench->submitted < option_requests)
+        bench_submit(bench, slot);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    long long int x = *(const long long int *) a, y = *(const long long int *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const long long int *sorted, int count, int percent)
+{
+    int index = (int) ((long long int) count * percent / 100);
+
+    if (index >= count)
+        index = count - 1;
+    return sorted[index] / 1000.0;
+}
+
+static void print_usage(const char *arg0)
+{
+    printf("Usage: %s [options] <scrape_url> [<scrape_url>...]\n", arg0);
+    printf("  -n <n>       : requests in all (default 1000)\n");
+    printf("  -c <n>       : requests in flight at once (default 16)\n");
+    printf("  -k <n>       : info hashes per request (default 1)\n");
+    printf("  -w <timeout> : network timeout in seconds\n");
+    printf("  -r <n>       : UDP retransmissions (default %d)\n", SCRAPE_UDP_DEFAULT_RETRIES);
+    printf("  -a           : fall back to announces if the tracker won't scrape\n");
+    printf("  -m           : check the counts against mocktracker's\n");
+    printf("  -v           : print every failed request\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench bench;
+    struct bench_slot *slots;
+    long long int start, elapsed;
+    int opt, exit_code;
+
+    while ((opt = getopt(argc, argv, "n:c:k:w:r:amvh")) != -1) {
+        switch (opt) {
+        case 'n': option_requests = atoi(optarg); break;
+        case 'c': option_concurrency = atoi(optarg); break;
+        case 'k': option_hashes = atoi(optarg); break;
+        case 'w': option_timeout = atoi(optarg); break;
+        case 'r': option_udp_retries = atoi(optarg); break;
+        case 'a': option_announce = 1; break;
+        case 'm': option_check = 1; break;
+        case 'v': option_verbose = 1; break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || option_requests <= 0 || option_concurrency <= 0 || option_hashes <= 0 ||
+        option_udp_retries < 0 || option_udp_retries > SCRAPE_UDP_MAX_RETRIES) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (option_concurrency > option_requests)
+        option_concurrency = option_requests;
+
+    srand((unsigned) time(NULL));
+    memset(&bench, 0, sizeof(bench));
+    bench.engine = scrape_engine_new();
+    bench.urls = argv + optind;
+    bench.url_count = argc - optind;
+    bench.latencies = malloc(sizeof(long long int) * option_requests);
+    slots = calloc(option_concurrency, sizeof(struct bench_slot));
+
+    start = now_us();
+    for (int i = 0; i < option_concurrency; i++) {
+        slots[i].hashes = malloc(20 * option_hashes);
+        slots[i].results = malloc(sizeof(struct scrape_result) * option_hashes);
+        bench_submit(&bench, &slots[i]);
+    }
+    scrape_engine_run(bench.engine);
+    elapsed = now_us() - start;
+    scrape_engine_free(bench.engine);
+
+    qsort(bench.latencies, bench.finished, sizeof(long long int), compare_latency);
+    printf("requests: %d (%d failed), info hashes answered: %d", bench.finished, bench.failed, bench.hashes_ok);
+    if (option_check)
+        printf(", wrong counts: %d", bench.wrong);
+    printf("\n");
+    printf("elapsed:  %.3f s, %.1f requests/s, %.1f hashes/s\n", elapsed / 1e6,
+           bench.finished / (elapsed / 1e6), bench.hashes_ok / (elapsed / 1e6));
+    if (bench.finished > 0)
+        printf("latency:  p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               percentile(bench.latencies, bench.finished, 50), percentile(bench.latencies, bench.finished, 90),
+               percentile(bench.latencies, bench.finished, 99), bench.latencies[bench.finished - 1] / 1000.0);
+
+    exit_code = bench.failed > 0 || bench.wrong > 0;
+    for (int i = 0; i < option_concurrency; i++) {
+        free(slots[i].hashes);
+        free(slots[i].results);
+    }
+    free(slots);
+    free(bench.latencies);
+    return exit_code;
+}